@@ -2,14 +2,30 @@
 // Based on cstack.github.io/db_tutorial/
 // For learning purposes, extensive comments 
 
+#include <endian.h>  // be32toh and be64toh, used to read keys as integers
 #include <errno.h>  // Used for error handling through error codes
 #include <fcntl.h>  // File control options like open, read, write permissions
+#include <inttypes.h>  // PRId64, used to print 64-bit ids
+#include <pthread.h>  // The background thread that syncs deferred commits
+#include <sched.h>  // sched_yield, used by scans that let other statements run
+#include <signal.h>  // sigaction, used to stop the server cleanly
 #include <stdbool.h>  // Provides a boolean data type and values true/false
+#include <stddef.h>  // offsetof, used to checksum part of a header
 #include <stdint.h>  // Fixed-width integers like int32_t, uint64_t, etc.
 #include <stdio.h>  // Standard Input/Output operations like printf, scanf
 #include <stdlib.h>  // General purpose standard library, includes memory allocation, process control, conversions, etc.
 #include <string.h>  // String handling functions like strcpy, strlen, etc.
+#include <time.h>  // clock_gettime, used to time commits and replication log records
 #include <unistd.h>  // Provides access to POSIX operating system API, includes read, write, close, etc.
+#include <sys/epoll.h>  // The server's event loop over its connections
+#include <sys/mman.h>  // mmap and shm_open, for the shared-memory transport
+#include <sys/socket.h>  // The Unix socket the server listens on
+#include <sys/un.h>  // sockaddr_un, the address of that socket
+#include <sys/wait.h>  // waitpid, used to collect background backup processes
+#if defined(__linux__)
+#include <linux/futex.h>  // FUTEX_WAIT and FUTEX_WAKE, to sleep on a shared ring
+#include <sys/syscall.h>  // SYS_futex
+#endif
 
 /*
 InputBuffer: A struct to manage the input buffer for user input.
@@ -21,6 +37,21 @@ typedef struct {
   ssize_t input_length;   // The actual length of the input string
 } InputBuffer;
 
+// Bytes of input read at once, and of output buffered, in batch mode
+#define BATCH_CHUNK_SIZE (1 << 20)
+
+/*
+BatchReader: Splits the chunks of input read in batch mode into lines.
+*/
+
+typedef struct {
+  char* data;         // The chunk, after the unfinished line carried over from the last one
+  size_t capacity;    // Allocated size of data
+  size_t length;      // Bytes of data filled
+  size_t position;    // Start of the next line in data
+  bool at_end;        // True once the input is exhausted
+} BatchReader;
+
 /*
 ExecuteResult: An enumeration for the result of executing a SQL statement.
 */
@@ -28,6 +59,14 @@ ExecuteResult: An enumeration for the result of executing a SQL statement.
 typedef enum {
   EXECUTE_SUCCESS,        // Indicates successful execution of a statement
   EXECUTE_DUPLICATE_KEY,  // Indicates an execution failure due to a duplicate key
+  EXECUTE_READ_ONLY,      // Indicates a write was attempted on a read-only replica
+  EXECUTE_LOCK_CONFLICT,  // Indicates the transaction was rolled back to avoid a deadlock
+  EXECUTE_LOCK_WAIT,      // Indicates the statement waits for a younger transaction's row lock, to run again
+  EXECUTE_NO_TRANSACTION, // Indicates a commit or rollback outside a transaction
+  EXECUTE_IN_TRANSACTION, // Indicates a begin inside a transaction
+  EXECUTE_OVER_BUDGET,    // Indicates the statement was stopped for exceeding a budget of its workload class
+  EXECUTE_TABLE_FULL,     // Indicates the statement needed more pages than the file can hold, and was undone
+  EXECUTE_DISK_FULL,      // Indicates the cache was full and no page could be spilled to disk, and was undone
 } ExecuteResult;
 
 /*
@@ -45,7 +84,7 @@ PrepareResult: An enumeration for the result of preparing a SQL statement.
 
 typedef enum {
   PREPARE_SUCCESS,               // Indicates successful preparation of a statement
-  PREPARE_NEGATIVE_ID,           // Indicates an error due to a negative ID in an INSERT statement
+  PREPARE_INVALID_ID,            // Indicates an error due to an ID that is not an integer
   PREPARE_STRING_TOO_LONG,       // Indicates an error due to a string being too long
   PREPARE_SYNTAX_ERROR,          // Indicates a syntax error in the SQL statement
   PREPARE_UNRECOGNIZED_STATEMENT // Indicates an unrecognized statement type
@@ -56,10 +95,79 @@ StatementType: Enumeration for types of SQL statements.
 */
 
 typedef enum { 
-  STATEMENT_INSERT, // Represents an INSERT statement
-  STATEMENT_SELECT  // Represents a SELECT statement
+  STATEMENT_INSERT,       // Represents an INSERT statement
+  STATEMENT_INSERT_BATCH, // Represents an INSERT statement carrying several rows
+  STATEMENT_SELECT,       // Represents a SELECT statement
+  STATEMENT_BEGIN,        // Starts a transaction
+  STATEMENT_COMMIT,       // Applies the transaction's inserts as one commit
+  STATEMENT_ROLLBACK      // Discards the transaction's inserts
 } StatementType;
 
+/*
+WorkloadClass: The kinds of statements that get their own budgets and
+concurrency limit. Reports scan the whole table: plain SELECT and COUNT BY.
+*/
+
+typedef enum {
+  WORKLOAD_INTERACTIVE,  // Inserts, transactions and selective SELECTs
+  WORKLOAD_REPORT        // Full-table SELECT and SELECT COUNT BY
+} WorkloadClass;
+
+#define WORKLOAD_CLASSES 2
+
+// Leaves read from disk by a scan that it keeps cached; it evicts the oldest to read more
+#define SCAN_RING_PAGES 16
+
+/*
+ScanRing: The leaves a scan brought into the cache, oldest first once full.
+Pages the scan found cached are left alone, so a large scan cycles through a
+few buffers instead of flushing the hot set.
+*/
+
+typedef struct {
+  uint32_t pages[SCAN_RING_PAGES];
+  uint32_t num_pages;
+  uint32_t next;  // Oldest page once the ring is full
+} ScanRing;
+
+/*
+CachePolicy: How the pager picks the pages to drop once its cache is full.
+*/
+
+typedef enum {
+  CACHE_POLICY_LRU,  // The least recently used page
+  CACHE_POLICY_2Q    // Pages used once before pages used again, each in LRU order
+} CachePolicy;
+
+#define CACHE_POLICIES 2
+const char* CACHE_POLICY_NAMES[CACHE_POLICIES] = {"lru", "2q"};
+
+/*
+CacheList: The list of the page cache a page is on. LRU only uses
+CACHE_LIST_RECENT. 2Q admits a page to CACHE_LIST_RECENT, remembers the number
+of a page dropped from there in CACHE_LIST_GHOST, and moves a page read again
+while remembered to CACHE_LIST_FREQUENT.
+*/
+
+typedef enum {
+  CACHE_LIST_NONE,      // Not on any list
+  CACHE_LIST_RECENT,    // Cached, used once (2Q) or at all (LRU)
+  CACHE_LIST_FREQUENT,  // Cached, read again after being dropped
+  CACHE_LIST_GHOST,     // Not cached, dropped from CACHE_LIST_RECENT lately
+  CACHE_LISTS
+} CacheList;
+
+/*
+PageList: A doubly linked list of pages, most recently used first. The links
+live in the PageCache.
+*/
+
+typedef struct {
+  uint32_t head;    // Most recently used page, or INVALID_PAGE_NUM
+  uint32_t tail;    // Least recently used page, or INVALID_PAGE_NUM
+  uint32_t length;
+} PageList;
+
 
 // Define the maximum size for the username column
 #define COLUMN_USERNAME_SIZE 32
@@ -67,1427 +175,8813 @@ typedef enum {
 // Define the maximum size for the email column
 #define COLUMN_EMAIL_SIZE 255
 
+// Number of leading bytes of the payload column kept in the leaf cell
+#define PAYLOAD_PREFIX_SIZE 16
+
+// Dictionary code of a value that is absent, e.g. the domain of an email without '@'
+#define NO_DICTIONARY_CODE UINT32_MAX
+
 /*
 Row: A structure representing a row in the database.
 */
 
 typedef struct {
-  uint32_t id;                              // Unique identifier for the row
+  int32_t tenant_id;                        // Tenant owning the row, 0 when tenants are not used
+  int64_t id;                               // Identifier of the row within its tenant
   char username[COLUMN_USERNAME_SIZE + 1];  // Username field with a fixed size
   char email[COLUMN_EMAIL_SIZE + 1];        // Email field with a fixed size
+  uint32_t username_code;                   // Dictionary code of the username
+  uint32_t domain_code;                     // Dictionary code of the email domain, or NO_DICTIONARY_CODE
+  uint32_t local_code;                      // Dictionary code of a local part too long for the cell, or NO_DICTIONARY_CODE
+  uint32_t payload_length;                  // Length of the payload column, 0 if none
+  uint32_t payload_page;                    // First overflow page holding the payload past its prefix
+  char payload_prefix[PAYLOAD_PREFIX_SIZE]; // First bytes of the payload, stored in the cell
+  char* payload;                            // Whole payload of a row being inserted, not stored
 } Row;
 
 /*
-Statement: A structure representing a SQL statement.
+DictionaryColumn: The dictionary-encoded columns a SELECT can filter or group on.
+*/
+
+typedef enum {
+  DICTIONARY_COLUMN_NONE,      // No filter or grouping
+  DICTIONARY_COLUMN_USERNAME,  // The username
+  DICTIONARY_COLUMN_DOMAIN     // The email domain, from the last '@' on
+} DictionaryColumn;
+
+/*
+ByteBuffer: A growable array of bytes.
+*/
+
+typedef struct {
+  char* data;       // The bytes
+  size_t length;    // Bytes in use
+  size_t capacity;  // Bytes allocated
+} ByteBuffer;
+
+// Most rows sent to a client in one batch
+#define WIRE_BATCH_ROWS 1024
+// Bytes of text after which a batch is sent even if it has fewer rows
+#define WIRE_BATCH_BYTES (1 << 18)
+
+// Size of a CPU cache line: nodes in memory start on one, and the two ends of
+// a shared ring write separate ones
+#define CACHE_LINE_SIZE 64
+
+/*
+ShmRingHeader: The shared state of a single-producer, single-consumer ring of
+frames. Positions only grow, modulo 2^32. The producer writes head and the
+consumer tail, each on its own cache line. A side that finds nothing to do sets
+its waiting flag and sleeps on the other side's position.
+*/
+
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) uint32_t head;  // Bytes published by the producer
+  uint32_t consumer_waiting;                // Set while the consumer sleeps on head
+  _Alignas(CACHE_LINE_SIZE) uint32_t tail;  // Bytes consumed
+  uint32_t producer_waiting;                // Set while the producer sleeps on tail
+} ShmRingHeader;
+
+/*
+ShmRing: One side's view of a ring in a shared-memory region.
+*/
+
+typedef struct {
+  ShmRingHeader* header;  // Shared positions
+  char* data;             // SHM_RING_SIZE bytes of frames, in the shared region
+  int peer_fd;            // Socket to the other side, which reads as closed once it is gone
+} ShmRing;
+
+/*
+WireOutput: Where a connection's frames are written: a buffer sent over the
+socket, or straight into the ring of a shared-memory region.
+*/
+
+typedef struct {
+  ByteBuffer buffer;  // Frames not yet sent over the socket
+  ShmRing* ring;      // The ring the frames go to instead, or NULL
+} WireOutput;
+
+/*
+ResultBatch: SELECT rows gathered column by column for a client of the server.
+Full batches are encoded into the client's output as WIRE_ROWS frames.
 */
 
 typedef struct {
+  uint32_t num_rows;                               // Rows gathered so far
+  int64_t ids[WIRE_BATCH_ROWS];                    // Id column
+  int32_t tenants[WIRE_BATCH_ROWS];                // Tenant column
+  uint32_t username_offsets[WIRE_BATCH_ROWS + 1];  // Start of each username in usernames, then the end
+  uint32_t email_offsets[WIRE_BATCH_ROWS + 1];     // Start of each email in emails, then the end
+  uint32_t payload_offsets[WIRE_BATCH_ROWS + 1];   // Start of each payload in payloads, then the end
+  ByteBuffer usernames;                            // Username bytes, without terminators
+  ByteBuffer emails;                               // Email bytes
+  ByteBuffer payloads;                             // Payload bytes, only for SELECT *
+  WireOutput* out;                                 // Output of the client
+  uint32_t* ready_connections;                     // Server's queued connections: scans suspend while there are any
+  struct Statement* suspended;                     // Copy of a SELECT that stopped early to let them run
+} ResultBatch;
+
+/*
+Statement: A structure representing a SQL statement.
+*/
+
+typedef struct Statement {
   StatementType type;   // Type of the statement (e.g., INSERT, SELECT)
   Row row_to_insert;    // Row to be inserted, used only by INSERT statements
+  bool with_payload;    // SELECT * also prints the payload column
+  bool has_tenant;      // SELECT only returns the rows of tenant_id
+  int32_t tenant_id;    // Tenant to select, used only if has_tenant is set
+  DictionaryColumn where_column;           // SELECT only returns rows whose column equals where_value
+  char where_value[COLUMN_EMAIL_SIZE + 2]; // Value compared, room for an added '@'
+  DictionaryColumn count_by;               // SELECT COUNT BY counts rows per value of this column
+  Row* batch_rows;      // Rows to be inserted by a batch INSERT, or NULL
+  uint32_t batch_size;  // Number of rows in batch_rows
+  ResultBatch* result;  // Collects the rows of a SELECT for a client, or NULL to print them
+  bool suspended;       // Set when a scan stopped early, at resume_tenant and resume_id
+  bool resuming;        // The scan continues at resume_tenant and resume_id
+  int32_t resume_tenant;
+  int64_t resume_id;
+  WorkloadClass workload;   // Class whose budgets apply
+  uint64_t pages_read;      // Pages read from disk so far
+  uint64_t cpu_us;          // CPU time of the parts run before the current one
+  uint64_t cpu_start_us;    // Thread CPU clock when the current part started
+  uint64_t memory;          // Bytes held for sorting or aggregating
+  const char* over_budget;  // Name of the budget exceeded, or NULL
+  ScanRing ring;            // Pages the statement's scan read
+  bool shared_latch;        // Runs under the statement latch taken shared
 } Statement;
 
 // Macro to determine the size of a specific attribute within a structure
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 // Defining some constants for the database
+const uint32_t TENANT_ID_SIZE = size_of_attribute(Row, tenant_id);
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+const uint32_t USERNAME_CODE_SIZE = size_of_attribute(Row, username_code);
+/*
+The cell keeps the local part of an email inline when it is at most EMAIL_SIZE
+bytes, as most are; a longer one, up to the whole 255-byte column, goes into the
+dictionary and the cell keeps its code
+*/
+const uint32_t EMAIL_SIZE = 32;
+const uint32_t DOMAIN_CODE_SIZE = size_of_attribute(Row, domain_code);
+const uint32_t LOCAL_CODE_SIZE = size_of_attribute(Row, local_code);
+const uint32_t PAYLOAD_LENGTH_SIZE = size_of_attribute(Row, payload_length);
+const uint32_t PAYLOAD_PAGE_SIZE = size_of_attribute(Row, payload_page);
+const uint32_t TENANT_ID_OFFSET = 0;
+const uint32_t ID_OFFSET = TENANT_ID_OFFSET + TENANT_ID_SIZE;
+const uint32_t USERNAME_CODE_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t EMAIL_OFFSET = USERNAME_CODE_OFFSET + USERNAME_CODE_SIZE;
+const uint32_t DOMAIN_CODE_OFFSET = EMAIL_OFFSET + EMAIL_SIZE;
+const uint32_t LOCAL_CODE_OFFSET = DOMAIN_CODE_OFFSET + DOMAIN_CODE_SIZE;
+const uint32_t PAYLOAD_LENGTH_OFFSET = LOCAL_CODE_OFFSET + LOCAL_CODE_SIZE;
+const uint32_t PAYLOAD_PAGE_OFFSET = PAYLOAD_LENGTH_OFFSET + PAYLOAD_LENGTH_SIZE;
+const uint32_t PAYLOAD_PREFIX_OFFSET = PAYLOAD_PAGE_OFFSET + PAYLOAD_PAGE_SIZE;
+const uint32_t ROW_SIZE = TENANT_ID_SIZE + ID_SIZE + USERNAME_CODE_SIZE + EMAIL_SIZE +
+                          DOMAIN_CODE_SIZE + LOCAL_CODE_SIZE + PAYLOAD_LENGTH_SIZE + PAYLOAD_PAGE_SIZE +
+                          PAYLOAD_PREFIX_SIZE;
 const uint32_t PAGE_SIZE = 4096;
 
-#define TABLE_MAX_PAGES 400
+// Most pages of a file, whose length in bytes must fit in 32 bits. The
+// per-page arrays of the Pager grow with the file up to this.
+#define TABLE_MAX_PAGES (UINT32_MAX / 4096)
+// Most pages of a shadow-paged file, whose header maps every page
+#define SHADOW_MAX_PAGES 400
+// Pages the per-page arrays of the Pager have room for at first
+#define PAGER_INITIAL_PAGES 256
+/*
+Keys are (tenant_id, id) pairs encoded so that memcmp sorts them correctly:
+the tenant then the id, each big-endian with the sign bit flipped
+*/
+#define KEY_SIZE 12
 #define INVALID_PAGE_NUM UINT32_MAX
+// Number of bytes needed for a bitmap with one bit per page
+#define PAGE_BITMAP_SIZE(pages) (((pages) + 7) / 8)
+// Shadow paging keeps two header slots plus room for three versions of every
+// page: the current map's, the previous map's, kept for readers, and the one
+// the running commit writes
+#define SHADOW_HEADER_SLOTS 2
+#define SHADOW_MAX_SLOTS (SHADOW_HEADER_SLOTS + 3 * SHADOW_MAX_PAGES)
+#define SHADOW_SLOT_BITMAP_SIZE ((SHADOW_MAX_SLOTS + 7) / 8)
+
+/*
+SplitPolicy: Where a full leaf is split when a row is inserted into it.
+*/
+
+typedef enum {
+  SPLIT_MIDPOINT,  // Always in the middle
+  SPLIT_APPEND,    // After the fill factor's share of the rows when appending past the last row
+  SPLIT_ADAPTIVE   // At the insertion point while inserts run in key order, up or down
+} SplitPolicy;
+
+/*
+DurabilityMode: When a committed statement reaches the disk in a shadow-paged file.
+*/
+
+typedef enum {
+  DURABILITY_SYNC,   // Synced before the statement returns
+  DURABILITY_GROUP,  // The statement waits for a sync shared with other commits
+  DURABILITY_ASYNC   // The statement returns at once and a background thread syncs it
+} DurabilityMode;
+
+#define DURABILITY_MODES 3
+const char* DURABILITY_MODE_NAMES[DURABILITY_MODES] = {"sync", "group", "async"};
+
+const char* WORKLOAD_CLASS_NAMES[WORKLOAD_CLASSES] = {"interactive", "report"};
 
 /*
-Pager: A structure to manage the pages of the database file.
+Workload: The limits on the statements of one workload class, and what they
+ran into. A limit of 0 means none.
 */
 
 typedef struct {
-  int file_descriptor;          // File descriptor for the database file.
-  uint32_t file_length;         // Total length of the file in bytes.
-  uint32_t num_pages;           // Number of pages currently in the file.
-  void* pages[TABLE_MAX_PAGES]; // Array of pointers to the pages loaded into memory.
-} Pager;
+  uint32_t max_running;     // Statements of the class the server runs at once; others queue
+  uint64_t max_pages_read;  // Pages a statement may read from disk
+  uint64_t max_cpu_us;      // CPU time a statement may use
+  uint64_t max_memory;      // Bytes a statement may hold for sorting or aggregating
+  uint64_t statements;      // Statements run
+  uint64_t queued;          // Statements that waited for admission
+  uint64_t aborted;         // Statements stopped for exceeding a budget
+} Workload;
+
+// Longest a group commit waits for more commits to join before syncing
+const uint64_t GROUP_COMMIT_MAX_WAIT_US = 10000;
+// How long an asynchronous commit may stay unsynced, and so be lost by a crash
+const uint64_t ASYNC_COMMIT_MAX_DELAY_US = 100000;
 
 /*
-Table: A structure representing a table in the database.
+CommitStats: Commit latencies in one durability mode, measured from the end of
+the statement until its changes are durable.
 */
 
 typedef struct {
-  Pager* pager;             // Pointer to the Pager managing this table's pages.
-  uint32_t root_page_num;   // The page number of the root page in the B-tree.
-} Table;
+  uint64_t count;            // Commits made durable
+  uint64_t total_us;         // Sum of their latencies
+  uint64_t max_us;           // Longest latency
+  uint32_t pending;          // Commits waiting for the next sync
+  uint64_t pending_sum_us;   // Sum of the times the pending commits were made
+  uint64_t pending_first_us; // Time the oldest pending commit was made
+} CommitStats;
 
 /*
-Cursor: A structure for navigating through the table.
+PagerOptions: How a database file should be opened, taken from the command line.
 */
 
 typedef struct {
-  Table* table;       // Pointer to the table to navigate.
-  uint32_t page_num;  // Current page number in the table.
-  uint32_t cell_num;  // Current cell number on the current page.
-  bool end_of_table;  // Boolean flag indicating if the cursor is past the last element in the table.
-} Cursor;
+  bool is_replica;      // Open read-only and follow the primary's replication log
+  bool shadow_paging;   // Create a new database with copy-on-write commits
+  SplitPolicy split_policy;  // How full leaves are split
+  uint32_t fill_factor;      // Percentage of a leaf filled by the bulk loader and sequential splits, 0 to keep the file's
+  DurabilityMode durability; // When commits are synced
+  uint32_t cache_pages;      // Most pages cached between statements, 0 for no limit
+  CachePolicy cache_policy;  // Which pages the cache drops first
+  bool pin_internal;         // Drop internal nodes from the cache only when no leaf can go
+  Workload workloads[WORKLOAD_CLASSES];  // Budgets and limits per workload class
+} PagerOptions;
+
+// Parts of the page cache with a latch of their own; page N is in part N % PAGE_CACHE_SHARDS
+#define PAGE_CACHE_SHARDS 8
+
+// Dropped pages a shard holds for readers that may still use them; once full it drops no more
+#define PAGE_RETIRE_LIMIT 64
 
+/*
+PageCacheCounts: How often get_page found its page cached, and how many pages
+were dropped to stay within the limit.
+*/
 
+typedef struct {
+  uint64_t hits;       // get_page calls finding the page cached
+  uint64_t misses;     // get_page calls reading the page
+  uint64_t evictions;  // Pages dropped to stay within the limit
+} PageCacheCounts;
 
-/**
- * Function to print a database row.
- * @param row Pointer to the Row structure to be printed.
- * @return void.
- */
+/*
+PageShard: The cache lists of the pages of one shard, under the shard's latch.
+A page dropped while statements read concurrently is retired rather than
+freed, since a reader may still hold it; retired pages are freed once no
+statement reads.
+*/
 
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+typedef struct {
+  pthread_mutex_t latch;
+  PageList lists[CACHE_LISTS];
+  uint32_t capacity;                 // This shard's part of the limit, for 2Q's proportions
+  void* retired[PAGE_RETIRE_LIMIT];  // Dropped pages not freed yet
+  uint32_t num_retired;
+  PageCacheCounts counts;            // hits is counted without the latch
+} PageShard;
 
 /*
-NodeType: Enumeration representing the type of a node in a B-tree.
+PageCache: The replacement state of the pager's cache, split into shards so
+that statements reading concurrently do not contend on one latch. A cached
+page is found without any latch. The lists are only kept while there is a
+limit, which is enforced between statements and between the rows of a scan,
+where the statement holds no pointer into a page. Pages changed since last
+written to the file are never dropped.
 */
 
-typedef enum { 
-  NODE_INTERNAL,  // Represents an internal node of the B-tree
-  NODE_LEAF       // Represents a leaf node of the B-tree
-  } NodeType;
+typedef struct {
+  CachePolicy policy;
+  uint32_t capacity;               // Most pages kept cached, 0 for no limit
+  bool pin_internal;               // Internal nodes are only dropped when no leaf can be
+  uint8_t* list;                   // CacheList each page is on, under its shard's latch
+  uint32_t* prev;                  // Next more recently used page on the same list
+  uint32_t* next;                  // Next less recently used page on the same list
+  uint32_t cached;                 // Pages on the cached lists of every shard
+  uint32_t next_trim;              // Shard the next trim starts with
+  bool drain_wanted;               // A shard's retired pages are full: readers should pause
+  PageShard shards[PAGE_CACHE_SHARDS];
+} PageCache;
 
 /*
- * Common Node Header Layout
- */
-const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);  // Size of the node type field
-const uint32_t NODE_TYPE_OFFSET = 0;  // Offset of the node type field in the node
-const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);  // Size of the 'is root' field
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE; // Offset of the 'is root' field in the node
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);  // Size of the parent pointer field
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE; // Offset of the parent pointer in the node
-const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;  // Total size of the common node header
+StatementUndo: The contents a statement's pages had before it changed them,
+kept while a statement that may run out of pages midway runs, so that it can
+be undone as a whole.
+*/
+
+typedef struct {
+  bool active;                              // True while the statement runs
+  uint32_t num_pages;                       // Pages in the file before the statement
+  bool statement_changed;                   // The Pager's statement_changed before it
+  uint8_t* commit_pages;                    // The Pager's commit_pages before it
+  uint8_t* recorded;                        // Pages whose contents are kept
+  uint32_t* changed;                        // Those pages, in the order they were changed
+  uint32_t num_changed;
+  void** images;                            // Their contents, or NULL for pages the statement added
+} StatementUndo;
 
 /*
- * Internal Node Header Layout
- */
-const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);  // Size of the 'number of keys' field
-const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE; // Offset of the 'number of keys' field
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t); // Size of the right child pointer field
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
-    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;  // Offset of the right child pointer
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                           INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;  // Total size of the internal node header
+LeafSummary: The range of dictionary codes held by a leaf, a zone map that lets
+filtered scans skip the leaf without reading it. Summaries are kept in memory,
+built for every leaf when the table is opened and again when a scan reads the
+leaf, and widened as rows are inserted. A summary may cover codes the leaf no
+longer holds, but never misses one it does.
+*/
+
+typedef struct {
+  uint32_t min_username_code;  // Smallest username code in the leaf
+  uint32_t max_username_code;  // Largest username code in the leaf
+  uint32_t min_domain_code;    // Smallest domain code in the leaf
+  uint32_t max_domain_code;    // Largest domain code in the leaf
+} LeafSummary;
 
 /*
- * Internal Node Body Layout
- */
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t); // Size of the key field in an internal node
-const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t); // Size of the child pointer field
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;  // Total size of a cell in an internal node
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_KEYS = 3;  // Maximum number of keys in an internal node (for testing)
+Pager: A structure to manage the pages of the database file. Its per-page
+arrays and bitmaps have room for page_capacity pages, and grow as the file does.
+*/
+
+typedef struct {
+  int file_descriptor;          // File descriptor for the database file.
+  char* path;                   // Path of the database file, which checkpoints replace.
+  char* checkpoint_path;        // Path of the copy a checkpoint writes before renaming it.
+  uint32_t file_length;         // Total length of the file in bytes.
+  uint32_t num_pages;           // Number of pages currently in the file.
+  uint32_t max_pages;           // Most pages the file may hold.
+  uint32_t page_capacity;       // Pages the per-page arrays have room for.
+  void** pages;                 // Array of pointers to the pages loaded into memory.
+  char* hot_pages_path;         // Path of the sidecar file holding warm-cache hints.
+  char* changed_pages_path;     // Path of the sidecar file persisting changed_pages.
+  uint8_t* changed_pages;       // Bitmap of pages modified since the last backup.
+  uint8_t* backup_pages;        // Pages being copied by the running backup, if any.
+  pid_t backup_pid;             // Process writing the running backup, or 0 if none.
+  uint8_t* commit_pages;        // Pages modified since the last commit.
+  uint8_t* summarized_pages;    // Leaves whose leaf summary is up to date.
+  LeafSummary* leaf_summaries;  // Valid for summarized_pages.
+  bool is_replica;              // True if this process follows a primary and is read-only.
+  char* log_path;               // Path of the replication log sidecar.
+  int log_fd;                   // File descriptor of the replication log, or -1.
+  uint64_t log_generation;      // Generation of the log being written or followed.
+  uint64_t log_sequence;        // Sequence number of the last commit written or applied.
+  off_t log_offset;             // Where the next commit record is written, or read by a replica.
+  uint64_t log_applied_time;    // Replica only: primary's timestamp of the last applied commit.
+  bool is_shadow;               // True if the file uses shadow paging instead of in-place writes.
+  uint64_t shadow_generation;   // Generation of the last published shadow header.
+  uint32_t page_map[SHADOW_MAX_PAGES];           // Physical slot of each page as of the last commit.
+  uint32_t previous_page_map[SHADOW_MAX_PAGES];  // Slots of the commit before, kept for readers.
+  uint8_t slots_in_use[SHADOW_SLOT_BITMAP_SIZE];  // Slots referenced by either map.
+  DurabilityMode durability;    // When the next commits are synced.
+  bool statement_changed;       // True if pages changed since the last commit request.
+  pthread_mutex_t commit_lock;  // Held while a statement runs or deferred commits are synced.
+  pthread_cond_t commit_cond;   // Signalled when commits become pending or durable.
+  pthread_cond_t latch_cond;    // Signalled when the last reader or a waiting writer takes its turn.
+  pthread_t flusher;            // Thread syncing group and async commits.
+  bool has_flusher;             // True once the flusher thread is running.
+  bool stop_flusher;            // Asks the flusher thread to exit.
+  uint32_t connections;         // Connections that can join a group commit.
+  uint32_t latch_waiters;       // Statements waiting for the statement latch, so scans know to yield.
+  uint64_t latch_acquisitions;  // Times a statement took the statement latch.
+  uint32_t latch_readers;       // Statements holding the latch shared, without commit_lock.
+  uint32_t latch_writers;       // Statements, or the flusher, waiting for the readers to finish.
+  uint32_t commit_waiters;      // Connections waiting for a group commit.
+  uint64_t commits_requested;   // Commits made so far, durable or not.
+  uint64_t commits_durable;     // Commits synced so far.
+  uint64_t flushes;             // Syncs performed for commits.
+  CommitStats commit_stats[DURABILITY_MODES];  // Latencies per durability mode.
+  uint8_t* dirty_pages;         // Pages changed since last written to the file, never evicted.
+  uint64_t pages_evicted;       // Pages scans evicted from the cache.
+  uint32_t pages_prefetched;    // Pages the warm-cache hints had read ahead at open.
+  PageCache cache;              // Which pages to drop once the cache is full.
+  char* spill_path;             // Path of the sidecar file holding changed pages dropped from the cache.
+  int spill_fd;                 // File descriptor of the spill file, or -1 until a page is spilled.
+  uint8_t* spilled_pages;       // Pages whose latest contents are in the spill file.
+  bool spill_failed;            // True once the disk refused a spilled page.
+  StatementUndo undo;           // Contents to restore if the running statement runs out of pages.
+} Pager;
+
+// Suffix appended to the database filename to name the warm-cache hints sidecar
+#define HOT_PAGES_SUFFIX "-hot"
+// Magic number at the start of the hints sidecar ("HOTP")
+const uint32_t HOT_PAGES_MAGIC = 0x484F5450;
+// Suffix appended to the database filename to name the file of pages spilled from the cache
+#define SPILL_SUFFIX "-spill"
+// Suffix appended to the database filename to name the copy a checkpoint writes
+#define CHECKPOINT_SUFFIX "-checkpoint"
+// Suffix appended to the database filename to name the changed-page bitmap sidecar
+#define CHANGED_PAGES_SUFFIX "-changes"
+// Magic number at the start of the changed-page bitmap sidecar ("CHGP")
+const uint32_t CHANGED_PAGES_MAGIC = 0x43484750;
+// Suffix appended to the database filename to name the replication log
+#define LOG_SUFFIX "-log"
+// Size past which the primary checkpoints the replication log and starts it afresh
+#define LOG_CHECKPOINT_SIZE (4 * 1024 * 1024)
+// A checkpoint copies the whole file, so the log also grows to this fraction of it first
+#define LOG_CHECKPOINT_FILE_DIVISOR 4
+// Magic number at the start of the replication log ("BLOG")
+const uint32_t LOG_FILE_MAGIC = 0x424C4F47;
+// Magic number at the start of every commit record in the log ("CMIT")
+const uint32_t LOG_COMMIT_MAGIC = 0x434D4954;
 
 /*
- * Leaf Node Header Layout
- */
-const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t); // Size of the 'number of cells' field
-const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;  // Offset of the 'number of cells' field
-const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t); // Size of the next leaf pointer field
-const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
-    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;  // Offset of the next leaf pointer
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;  // Total size of the leaf node header
+LogFileHeader: The header at the start of the replication log.
+The primary starts a new generation whenever the database file on disk becomes
+the new starting point (at open, and after flushing at close). Replicas that see
+a new generation drop their cache and start again from the database file.
+*/
+
+typedef struct {
+  uint32_t magic;       // LOG_FILE_MAGIC
+  uint32_t reserved;    // Keeps the generation 8-byte aligned
+  uint64_t generation;  // Identifies this run of the log
+} LogFileHeader;
 
 /*
- * Leaf Node Body Layout
- */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t); // Size of the key field in a leaf node
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;   // Offset of the key field in a leaf node cell
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE; // Size of the value field in a leaf node
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;  // Offset of the value field in a leaf node cell
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE; // Total size of a cell in a leaf node
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE; // Available space for cells in a leaf node
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;  // Maximum number of cells in a leaf node
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2; // Number of cells to keep in the right node after splitting
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;  // Number of cells to keep in the left node after splitting
+LogCommitHeader: The header of one commit record in the replication log.
+It is followed by page_count entries, each a page number and a full page image.
+*/
 
-/**
- * Get the node type from a given node.
- * @param node Pointer to the node from which the type is to be retrieved.
- * @return NodeType of the node.
- */
+typedef struct {
+  uint32_t magic;         // LOG_COMMIT_MAGIC
+  uint32_t page_count;    // Number of page images that follow
+  uint64_t generation;    // Generation the record belongs to
+  uint64_t sequence;      // Commit sequence number within the generation
+  uint64_t timestamp;     // Time of the commit on the primary, in microseconds
+  uint32_t num_pages;     // Number of pages in the database after the commit
+  uint32_t reserved;      // Keeps the header a multiple of 8 bytes
+} LogCommitHeader;
 
-NodeType get_node_type(void* node) {
-  // Dereference the node type after offsetting by NODE_TYPE_OFFSET
-  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
-  return (NodeType)value;
-}
+// Size of one page entry in a commit record: page number plus page image
+#define LOG_ENTRY_SIZE (sizeof(uint32_t) + PAGE_SIZE)
 
-/**
- * Set the node type for a given node.
- * @param node Pointer to the node for which the type is to be set.
- * @param type NodeType value to set for the node.
- */
+// Magic number at the start of a shadow-paged file's header slots ("SHDW")
+const uint32_t SHADOW_MAGIC = 0x57444853;
 
-void set_node_type(void* node, NodeType type) {
-  uint8_t value = type; // Cast NodeType to uint8_t
-  // Set the node type after offsetting by NODE_TYPE_OFFSET
-  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
-}
+/*
+ShadowHeader: The header of a shadow-paged database file.
+In shadow paging mode a page is never rewritten where it lives. A commit writes
+modified pages into free slots of the file, syncs them, then publishes a new
+header whose page map points at them. Two header slots are used alternately and
+each carries a checksum, so a torn header write leaves the previous commit in
+place: the header write is the single atomic step of a commit.
+*/
 
-/**
- * Check if a given node is the root of the tree.
- * @param node Pointer to the node to check.
- * @return True if the node is the root, false otherwise.
- */
+typedef struct {
+  uint32_t magic;         // SHADOW_MAGIC
+  uint32_t checksum;      // Checksum of everything after this field
+  uint64_t generation;    // Incremented by every commit; the newer valid slot wins
+  uint32_t num_pages;     // Number of pages in the database
+  uint32_t page_map[SHADOW_MAX_PAGES];                   // Physical slot of each page
+  uint8_t changed_pages[PAGE_BITMAP_SIZE(SHADOW_MAX_PAGES)];  // Pages changed since the last backup
+} ShadowHeader;
 
-bool is_node_root(void* node) {
-  // Dereference the 'is root' value after offsetting by IS_ROOT_OFFSET
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return (bool)value;
-}
+/*
+Dictionary: The table's string dictionary, mapping low-cardinality strings
+(usernames and email domains) to integer codes stored in the leaves instead.
+It lives in a chain of pages starting at DICTIONARY_PAGE_NUM, laid out like
+overflow pages, whose data is a sequence of entries: a length byte and the
+string. An entry's code is its position in the chain. The in-memory copy adds
+a hash table from string to code.
+*/
 
-/**
- * Set the given node as a root or non-root node.
- * @param node Pointer to the node to set as root or non-root.
- * @param is_root Boolean indicating whether the node is a root node or not.
- */
+typedef struct {
+  uint32_t num_entries;     // Number of codes assigned so far
+  uint32_t capacity;        // Capacity of the entries array
+  char** entries;           // String of each code
+  uint32_t hash_capacity;   // Number of hash slots, a power of two
+  uint32_t* hash_slots;     // Code + 1 of the string hashed there, 0 if empty
+  uint32_t last_page_num;   // Dictionary page that receives new entries
+} Dictionary;
 
-void set_node_root(void* node, bool is_root) {
-  uint8_t value = is_root; // Cast bool to uint8_t
-// Set the 'is root' value after offsetting by IS_ROOT_OFFSET
+/*
+FileHeader: The start of the page after the root, naming the layout of the
+file's pages. A file without it, or with another version, is refused rather
+than misread. It also keeps the settings that shape the tree, so that every
+open of the file grows it the same way.
+*/
 
-  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
-}
+typedef struct {
+  uint32_t magic;           // FILE_HEADER_MAGIC
+  uint32_t format_version;  // FILE_FORMAT_VERSION of the build that created the file
+  uint32_t fill_factor;     // Percentage of a leaf filled by the bulk loader and sequential splits
+} FileHeader;
 
-/**
- * Retrieves the parent pointer from a given node.
- * @param node Pointer to the node from which to get the parent pointer.
- * @return Pointer to the parent pointer field in the node.
- */
+#define FILE_HEADER_MAGIC 0x46424442  // "BDBF"
+#define FILE_FORMAT_VERSION 2
 
-uint32_t* node_parent(void* node) { 
-  // Return the address of the parent pointer in the node
-  return node + PARENT_POINTER_OFFSET; 
-}
+// Page holding the FileHeader; page 0 is the root
+#define FILE_HEADER_PAGE_NUM 1
+// Page holding the start of the dictionary
+#define DICTIONARY_PAGE_NUM 2
 
-/**
- * Retrieves the number of keys in an internal node.
- * @param node Pointer to the internal node.
- * @return Pointer to the number of keys field in the node.
- */
+/*
+LockMode: How a transaction holds a row lock.
+*/
 
-uint32_t* internal_node_num_keys(void* node) {
-  // Return the address of the number of keys field in the internal node
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
+typedef enum {
+  LOCK_SHARED,    // Any number of transactions may read the row
+  LOCK_EXCLUSIVE  // A single transaction may write the row
+} LockMode;
 
-/**
- * Retrieves the right child of an internal node.
- * @param node Pointer to the internal node.
- * @return Pointer to the right child field in the node.
- */
+/*
+LockResult: The outcome of asking for a row lock.
+*/
 
-uint32_t* internal_node_right_child(void* node) {
-  // Return the address of the right child field in the internal node
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
-}
+typedef enum {
+  LOCK_GRANTED,  // The lock is held
+  LOCK_DIED,     // An older transaction holds the row, so the requester must roll back
+  LOCK_WAIT      // Only younger transactions hold the row; the requester's waiter is woken on release
+} LockResult;
 
-/**
- * Retrieves a specific cell from an internal node.
- * @param node Pointer to the internal node.
- * @param cell_num Cell number to retrieve.
- * @return Pointer to the specified cell in the node.
- */
+/*
+RowLock: The transactions holding one row.
+*/
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  // Return the address of the specified cell in the internal node
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
-}
+typedef struct {
+  uint8_t key[KEY_SIZE];   // Key of the row
+  LockMode mode;           // Mode of every holder
+  uint64_t* holders;       // Ids of the holding transactions
+  uint32_t num_holders;    // Number of holders
+  uint32_t holders_capacity;
+  void** waiters;          // Waiters of the transactions parked on the row
+  uint32_t num_waiters;    // Number of waiters
+  uint32_t waiters_capacity;
+} RowLock;
+
+// Number of independently latched parts of the lock table
+#define LOCK_SHARDS 64
 
-/**
- * Retrieves a specific child pointer from an internal node.
- * @param node Pointer to the internal node.
- * @param child_num The index of the child to retrieve.
- * @return Pointer to the specified child in the node.
- */
+/*
+LockShard: The row locks whose keys hash to one shard, under their own latch.
+*/
+
+typedef struct {
+  pthread_mutex_t latch;     // Protects the locks of this shard
+  pthread_cond_t released;   // Signalled when a lock of this shard is released
+  RowLock* locks;            // Locks with at least one holder
+  uint32_t num_locks;
+  uint32_t capacity;
+} LockShard;
+
+/*
+LockManager: Row locks of a table, keyed by (tenant, id). Conflicts are
+resolved with wait-die: an older transaction waits for a younger holder, a
+younger one rolls back, so no cycle of waiting transactions can form. A
+transaction with a waiter does not block while it waits: the waiter is parked
+on the row and handed to wake when a holder releases it.
+*/
+
+typedef struct {
+  LockShard shards[LOCK_SHARDS];
+  uint64_t next_transaction_id;  // Transaction ids grow with age, so they order transactions
+  void (*wake)(void* waiter);    // Set by the server: runs a parked waiter's statement again
+} LockManager;
+
+/*
+Transaction: The row locks and buffered inserts of a connection's transaction.
+Inserts are applied to the tree only at commit, so pages are never latched for
+longer than one statement.
+*/
+
+typedef struct {
+  uint64_t id;                        // Wait-die age: lower ids are older
+  bool active;                        // True between begin and commit or rollback
+  void* waiter;                       // Parked on a row instead of blocking, if not NULL
+  bool waiting;                       // True while parked; the statement keeps the id when it runs again
+  uint8_t waiting_key[KEY_SIZE];      // Key of the row parked on
+  uint8_t (*locked_keys)[KEY_SIZE];   // Keys of the rows locked by this transaction
+  uint32_t num_locked_keys;
+  uint32_t locked_keys_capacity;
+  Row* rows;                          // Inserts applied at commit
+  uint32_t num_rows;
+  uint32_t rows_capacity;
+} Transaction;
+
+/*
+Table: A structure representing a table in the database.
+*/
+
+typedef struct {
+  Pager* pager;             // Pointer to the Pager managing this table's pages.
+  uint32_t root_page_num;   // The page number of the root page in the B-tree.
+  Dictionary dictionary;    // Codes of the dictionary-encoded string columns.
+  SplitPolicy split_policy;       // How full leaves are split.
+  uint32_t fill_factor;           // Percentage of a leaf filled by the bulk loader and sequential splits.
+  uint32_t last_insert_page_num;  // Leaf that received the last single-row insert, for SPLIT_ADAPTIVE.
+  uint32_t last_insert_cell_num;  // Cell that received it.
+  LockManager locks;              // Row locks of the running transactions.
+  Workload workloads[WORKLOAD_CLASSES];  // Budgets and limits per workload class.
+} Table;
+
+/*
+WireFrameType: The frames of the server's protocol. Every frame starts with a
+WireHeader and its payload is padded to a multiple of 8 bytes, so the columns
+of a batch can be read in place from the receive buffer.
+*/
+
+typedef enum {
+  WIRE_PAD = 0,        // Fills the end of a shared ring, so that no frame wraps around
+  WIRE_STATEMENT = 1,  // Client to server: the text of one statement
+  WIRE_ROWS = 2,       // Server to client: a WireBatchHeader, then the columns of the rows
+  WIRE_DONE = 3,       // Server to client: the statement finished; on error the payload is the message
+  WIRE_SHM_ATTACH = 4  // Client to server: move to shared memory; the WIRE_DONE reply carries its descriptor
+} WireFrameType;
+
+/*
+WireHeader: The start of every frame. Integers are little-endian.
+*/
+
+typedef struct {
+  uint32_t length;    // Bytes of payload after the header
+  uint8_t type;       // WireFrameType
+  uint8_t status;     // WIRE_DONE: 0 on success, 1 on error
+  uint16_t reserved;  // Zero
+} WireHeader;
+
+/*
+WireBatchHeader: The start of a WIRE_ROWS payload. It is followed by the ids
+(int64_t), the tenants (int32_t), num_rows + 1 offsets (uint32_t) into each of
+the username, email and payload bytes, and those bytes.
+*/
+
+typedef struct {
+  uint32_t num_rows;        // Rows in the batch
+  uint32_t username_bytes;  // Bytes of username text
+  uint32_t email_bytes;     // Bytes of email text
+  uint32_t payload_bytes;   // Bytes of payload text
+} WireBatchHeader;
+
+// Largest frame a client may send
+#define WIRE_MAX_FRAME_SIZE (1 << 24)
+// Bytes read from a client at once
+#define WIRE_READ_SIZE (1 << 16)
+// Room for the message of a failed statement
+#define ERROR_MESSAGE_SIZE 512
+// Bytes of each ring of a shared-memory connection, a power of two
+#define SHM_RING_SIZE (1u << 22)
+// Polls of a shared ring before its reader goes to sleep, with more than one CPU
+#define SHM_SPIN_ITERATIONS 20000
+
+/*
+ShmRegion: The start of the memory shared with a client: the request ring
+(client to server) and the response ring (server to client), whose frames
+follow this header.
+*/
+
+typedef struct {
+  ShmRingHeader requests;   // Statements sent by the client
+  ShmRingHeader responses;  // Rows and results written by the server
+} ShmRegion;
+
+#define SHM_REGION_SIZE (sizeof(ShmRegion) + 2 * (size_t)SHM_RING_SIZE)
+
+/*
+Connection: A client of the server: its unparsed input, unsent output and
+transaction. Between statements it is parked in the event loop with no buffers
+of its own, so idle clients cost little more than their socket.
+*/
+
+typedef struct Connection {
+  struct Server* server;     // Server the client is connected to
+  int fd;                    // Socket of the client
+  bool hung_up;              // True once the client closed its end
+  ByteBuffer in;             // Bytes received and not yet handled
+  size_t in_position;        // Start of the next frame in in
+  WireOutput out;            // Where responses go
+  size_t out_position;       // Bytes of out already written to the socket
+  ResultBatch* result;       // Rows of the running SELECT, the batch of the thread running it
+  Transaction transaction;   // The client's transaction
+  Statement* suspended;      // SELECT stopped early to let other clients run, or NULL
+  bool admitted;             // True while a statement holds a running slot of its class
+  WorkloadClass workload;    // Class of the statement holding or waiting for a slot
+  bool refused;              // True when the next statement must wait for a slot
+  bool lock_waiting;         // True when the next statement must wait for a row lock
+  bool lock_parked;          // Set while parked for that lock, under the server's lock
+  bool lock_released;        // Set when the lock was released before the connection parked
+  struct Connection* next_ready;  // Next connection in the server's ready queue, or its class's wait queue
+  ShmRegion* shm;            // Memory shared with the client, or NULL
+  ShmRing requests;          // The request ring in shm
+  ShmRing responses;         // The response ring in shm
+} Connection;
+
+// Statements a worker runs for one connection before serving the next one
+#define WORKER_QUANTUM 64
+// Most workers the server starts, whatever the number of cores
+#define SERVER_MAX_WORKERS 64
+// Buffers the server keeps for the connections that wake up, when idle ones give theirs back
+#define SERVER_SPARE_BUFFERS 64
+// Longest the event loop sleeps before checking whether the server must stop
+#define SERVER_POLL_TIMEOUT_MS 100
+// Rows a scan reads between checks for statements waiting for the latch
+#define SCAN_YIELD_ROWS 256
+
+/*
+Server: The event loop's state, shared with the workers. Connections whose
+input holds a complete statement wait in the ready queue for a worker; those
+whose workload class has no free slot wait in the class's queue first.
+*/
+
+typedef struct Server {
+  Table* table;
+  int epoll_fd;
+  int listen_fd;
+  pthread_mutex_t lock;          // Guards the fields below
+  pthread_cond_t ready_cond;     // Signalled when a connection is queued or the server stops
+  Connection* ready_head;        // Oldest ready connection
+  Connection* ready_tail;        // Newest ready connection
+  uint32_t num_ready;            // Connections in the queue, read by scans without the lock
+  uint32_t num_workers;          // Threads running statements
+  uint32_t num_connections;      // Clients connected
+  uint32_t shm_threads;          // Threads serving shared-memory clients
+  pthread_cond_t shm_cond;       // Signalled when one of them exits
+  pthread_cond_t slot_cond;      // Signalled when a slot or a row lock goes to a shared-memory client, or on stop
+  ByteBuffer spare_buffers[SERVER_SPARE_BUFFERS];  // Buffers given back by idle connections
+  uint32_t num_spare_buffers;
+  uint32_t running[WORKLOAD_CLASSES];         // Statements of each class holding a slot
+  Connection* waiting_head[WORKLOAD_CLASSES];  // Oldest connection waiting for a slot of each class
+  Connection* waiting_tail[WORKLOAD_CLASSES];  // Newest one
+} Server;
+
+/*
+Cursor: A structure for navigating through the table.
+*/
+
+typedef struct {
+  Table* table;       // Pointer to the table to navigate.
+  uint32_t page_num;  // Current page number in the table.
+  uint32_t cell_num;  // Current cell number on the current page.
+  bool end_of_table;  // Boolean flag indicating if the cursor is past the last element in the table.
+} Cursor;
+
+/*
+ColumnarColumn: The columns of a columnar snapshot, each stored in its own chunks.
+*/
+
+typedef enum {
+  COLUMNAR_TENANT,      // Tenant owning the row
+  COLUMNAR_ID,          // Identifier of the row within its tenant
+  COLUMNAR_USERNAME,    // Dictionary code of the username
+  COLUMNAR_EMAIL,       // Email up to its domain
+  COLUMNAR_DOMAIN,      // Dictionary code of the email domain
+  COLUMNAR_NUM_COLUMNS
+} ColumnarColumn;
+
+// Names of the columns, as given to .scan
+const char* COLUMNAR_COLUMN_NAMES[COLUMNAR_NUM_COLUMNS] = {"tenant", "id", "username", "email", "domain"};
+
+/*
+ColumnarEncoding: How the values of a column chunk are stored.
+*/
+
+typedef enum {
+  COLUMNAR_ENCODING_PLAIN,  // Strings: a length byte and the bytes of each value
+  COLUMNAR_ENCODING_RLE,    // Integers: (value, run length) pairs
+  COLUMNAR_ENCODING_FOR     // Integers: the minimum, a byte width, then each value minus the minimum
+} ColumnarEncoding;
+
+/*
+ColumnarHeader: The header of a columnar snapshot written by .export.
+The file holds the header, the column chunks, the dictionary (a length byte
+and the string of each code) and the directory: one ColumnChunk per chunk and
+column, chunk after chunk. Rows are cut into chunks of COLUMNAR_CHUNK_ROWS in
+key order, so the tenant and id zone maps of successive chunks do not overlap.
+*/
+
+typedef struct {
+  char magic[8];                    // COLUMNAR_MAGIC
+  uint32_t num_rows;                // Number of rows in the snapshot
+  uint32_t num_chunks;              // Number of row chunks
+  uint32_t num_dictionary_entries;  // Number of dictionary codes
+  uint64_t dictionary_offset;       // Position of the dictionary in the file
+  uint64_t directory_offset;        // Position of the directory in the file
+} ColumnarHeader;
+
+/*
+ColumnChunk: Where the values of one column of one chunk are, and their zone map.
+*/
+
+typedef struct {
+  uint64_t offset;      // Position of the encoded values in the file
+  uint32_t length;      // Number of bytes of the encoded values
+  uint32_t encoding;    // ColumnarEncoding of the values
+  uint32_t num_values;  // Number of rows in the chunk
+  int64_t min;          // Smallest value, integer columns only
+  int64_t max;          // Largest value, integer columns only
+} ColumnChunk;
+
+#define COLUMNAR_MAGIC "DBCOLS1"
+#define COLUMNAR_CHUNK_ROWS 1024
+// Room for the largest encoded chunk: every email of a chunk at its full length
+#define COLUMNAR_CHUNK_BUFFER_SIZE (COLUMNAR_CHUNK_ROWS * (COLUMN_EMAIL_SIZE + 1))
 
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if (child_num > num_keys) {
-    // Error handling for accessing an out-of-bounds child
 
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
-  } else if (child_num == num_keys) {
-    // Handle case when child_num is equal to num_keys (accessing the rightmost child)
-    uint32_t* right_child = internal_node_right_child(node);
-    if (*right_child == INVALID_PAGE_NUM) {
-      printf("Tried to access right child of node, but was invalid page\n");
-      exit(EXIT_FAILURE);
-    }
-    return right_child;
-  } else {
-    // Normal case for accessing a child within the bounds
-    uint32_t* child = internal_node_cell(node, child_num);
-    if (*child == INVALID_PAGE_NUM) {
-      printf("Tried to access child %d of node, but was invalid page\n", child_num);
-      exit(EXIT_FAILURE);
-    }
-    return child;
-  }
-}
 
 /**
- * Retrieves a specific key from an internal node.
- * @param node Pointer to the internal node.
- * @param key_num The index of the key to retrieve.
- * @return Pointer to the specified key in the node.
+ * Encodes a (tenant_id, id) pair into a key that compares correctly with memcmp.
+ * @param tenant_id Tenant of the row.
+ * @param id Identifier of the row within its tenant.
+ * @param key Buffer of KEY_SIZE bytes receiving the key.
  */
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  // Calculate and return the address of the specified key
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+void encode_key(int32_t tenant_id, int64_t id, uint8_t* key) {
+  // Flipping the sign bit puts negative values before positive ones
+  uint32_t tenant_bits = (uint32_t)tenant_id ^ 0x80000000u;
+  uint64_t id_bits = (uint64_t)id ^ 0x8000000000000000ull;
+  for (uint32_t i = 0; i < 4; i++) {
+    key[i] = tenant_bits >> (24 - 8 * i);
+  }
+  for (uint32_t i = 0; i < 8; i++) {
+    key[4 + i] = id_bits >> (56 - 8 * i);
+  }
 }
 
 /**
- * Retrieves the number of cells in a leaf node.
- * @param node Pointer to the leaf node.
- * @return Pointer to the number of cells field in the leaf node.
+ * Reads the tenant part of a key as an unsigned integer that sorts like it.
+ * @param key Key of KEY_SIZE bytes.
+ * @return The tenant with its sign bit flipped.
  */
 
-uint32_t* leaf_node_num_cells(void* node) {
-  // Return the address of the number of cells field in the leaf node
-  return (uint32_t*)(node + LEAF_NODE_NUM_CELLS_OFFSET);
+uint32_t key_tenant_bits(const uint8_t* key) {
+  uint32_t tenant_bits;
+  memcpy(&tenant_bits, key, sizeof(uint32_t));
+  return be32toh(tenant_bits);
 }
 
 /**
- * Retrieves the pointer to the next leaf node.
- * @param node Pointer to the current leaf node.
- * @return Pointer to the next leaf field in the node.
+ * Reads the id part of a key as an unsigned integer that sorts like it.
+ * @param key Key of KEY_SIZE bytes.
+ * @return The id with its sign bit flipped.
  */
 
-uint32_t* leaf_node_next_leaf(void* node) {
-  // Return the address of the next leaf pointer field in the leaf node
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+uint64_t key_id_bits(const uint8_t* key) {
+  uint64_t id_bits;
+  memcpy(&id_bits, key + 4, sizeof(uint64_t));
+  return be64toh(id_bits);
 }
 
 /**
- * Retrieves a specific cell from a leaf node.
- * @param node Pointer to the leaf node.
- * @param cell_num Cell number to retrieve.
- * @return Pointer to the specified cell in the leaf node.
+ * Decodes a key made by encode_key.
+ * @param key Key of KEY_SIZE bytes.
+ * @param tenant_id Set to the tenant of the key.
+ * @param id Set to the id of the key.
  */
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  // Calculate and return the address of the specified cell in the leaf node
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+void decode_key(const uint8_t* key, int32_t* tenant_id, int64_t* id) {
+  *tenant_id = (int32_t)(key_tenant_bits(key) ^ 0x80000000u);
+  *id = (int64_t)(key_id_bits(key) ^ 0x8000000000000000ull);
 }
 
 /**
- * Retrieves the key at a specific cell in a leaf node.
- * @param node Pointer to the leaf node.
- * @param cell_num Cell number to retrieve the key from.
- * @return Pointer to the key in the specified cell.
+ * Tells whether a key sorts before another key given by its parts, without
+ * branching, so searches built on it have no unpredictable jumps.
+ * @param key Key of KEY_SIZE bytes.
+ * @param tenant_bits key_tenant_bits of the other key.
+ * @param id_bits key_id_bits of the other key.
+ * @return 1 if key is smaller, 0 otherwise.
  */
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  // Return the address of the key in the specified cell
-  return leaf_node_cell(node, cell_num);
+uint32_t key_less(const uint8_t* key, uint32_t tenant_bits, uint64_t id_bits) {
+  uint32_t key_tenant = key_tenant_bits(key);
+  uint64_t key_id = key_id_bits(key);
+  return (key_tenant < tenant_bits) | ((key_tenant == tenant_bits) & (key_id < id_bits));
 }
 
 /**
- * Retrieves the value at a specific cell in a leaf node.
- * @param node Pointer to the leaf node.
- * @param cell_num Cell number to retrieve the value from.
- * @return Pointer to the value in the specified cell.
+ * Compares two keys.
+ * @param a The first key.
+ * @param b The second key.
+ * @return Negative, zero or positive like strcmp.
  */
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  // Calculate and return the address of the value in the specified cell
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+int compare_keys(const uint8_t* a, const uint8_t* b) {
+  return memcmp(a, b, KEY_SIZE);
 }
 
 /**
- * Retrieves a specific page from the pager.
- * @param pager Pointer to the Pager structure.
- * @param page_num The page number to retrieve.
- * @return Pointer to the requested page.
+ * Prints an id the way it is typed: "id", or "tenant:id" for a non-zero tenant.
+ * @param tenant_id Tenant of the row.
+ * @param id Identifier of the row within its tenant.
  */
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  // Check for out-of-bounds page number
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+void print_id(int32_t tenant_id, int64_t id) {
+  if (tenant_id != 0) {
+    printf("%" PRId32 ":", tenant_id);
   }
-  // Handle cache miss
-  if (pager->pages[page_num] == NULL) {
-    // Allocate memory for the page
-    void* page = malloc(PAGE_SIZE);
-    // Calculate the number of pages in the file
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-    // Load the page from the file if it exists
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+  printf("%" PRId64, id);
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
-    // Update the pager's pages array and page count
-    pager->pages[page_num] = page;
+/**
+ * Function to print a database row.
+ * @param row Pointer to the Row structure to be printed.
+ * @return void.
+ */
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
-  }
-  // Return the requested page
-  return pager->pages[page_num];
+void print_row(Row* row) {
+  printf("(");
+  print_id(row->tenant_id, row->id);
+  printf(", %s, %s)\n", row->username, row->email);
 }
 
 /**
- * Gets the maximum key from a node.
- * @param pager Pointer to the Pager structure.
- * @param node Pointer to the node.
- * @return The maximum key in the node.
+ * Initializes an empty lock table.
+ * @param manager Pointer to the LockManager to initialize.
  */
 
-uint32_t get_node_max_key(Pager* pager, void* node) {
-  // Handle leaf nodes
-  if (get_node_type(node) == NODE_LEAF) {
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+void lock_manager_init(LockManager* manager) {
+  for (uint32_t i = 0; i < LOCK_SHARDS; i++) {
+    LockShard* shard = &manager->shards[i];
+    pthread_mutex_init(&shard->latch, NULL);
+    pthread_cond_init(&shard->released, NULL);
+    shard->locks = NULL;
+    shard->num_locks = 0;
+    shard->capacity = 0;
   }
-  // Recursively call on the right child for internal nodes
-  void* right_child = get_page(pager,*internal_node_right_child(node));
-  return get_node_max_key(pager, right_child);
+  manager->next_transaction_id = 1;
+  manager->wake = NULL;
 }
 
 /**
- * Prints constant values used in the database.
+ * Gives a transaction a new id, making it younger than every earlier one.
+ * @param manager Pointer to the LockManager.
+ * @param transaction Pointer to the Transaction to start.
  */
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void lock_start_transaction(LockManager* manager, Transaction* transaction) {
+  transaction->id = __atomic_fetch_add(&manager->next_transaction_id, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Indents the output based on the specified indentation level.
- * @param level The level of indentation.
+ * Picks the shard of a row lock by mixing both halves of the key.
+ * @param manager Pointer to the LockManager.
+ * @param key Key of the row.
+ * @return Pointer to the shard holding the row's lock.
  */
 
-void indent(uint32_t level) {
-  // Print spaces for indentation
-  for (uint32_t i = 0; i < level; i++) {
-    printf("  ");
-  }
+LockShard* lock_shard(LockManager* manager, const uint8_t* key) {
+  uint64_t hash = (key_id_bits(key) ^ ((uint64_t)key_tenant_bits(key) << 32)) *
+                  0x9E3779B97F4A7C15ull;
+  return &manager->shards[hash >> 58];  // The top 6 bits, LOCK_SHARDS being 64
 }
 
 /**
- * Prints the B-tree starting from a specific page.
- * @param pager Pointer to the Pager structure.
- * @param page_num The starting page number of the B-tree to print.
- * @param indentation_level Current level of indentation for pretty printing.
+ * Locks a row for a transaction. A request conflicting with the holders waits
+ * while every conflicting holder is younger than the requester, and dies as
+ * soon as one is older. A transaction with a waiter is parked on the row
+ * rather than blocking. A lock already held in shared mode is upgraded.
+ * @param manager Pointer to the LockManager.
+ * @param transaction Pointer to the requesting Transaction.
+ * @param key Key of the row.
+ * @param mode Mode wanted.
+ * @return LOCK_GRANTED, LOCK_DIED if the transaction must roll back, or
+ * LOCK_WAIT if it was parked and must ask again once woken.
  */
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
-  // Handle different node types
-  switch (get_node_type(node)) {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
+LockResult lock_acquire(LockManager* manager, Transaction* transaction,
+                        const uint8_t* key, LockMode mode) {
+  LockShard* shard = lock_shard(manager, key);
+  pthread_mutex_lock(&shard->latch);
+  RowLock* lock;
+  while (true) {
+    lock = NULL;
+    for (uint32_t i = 0; i < shard->num_locks; i++) {
+      if (compare_keys(shard->locks[i].key, key) == 0) {
+        lock = &shard->locks[i];
+        break;
+      }
+    }
+    if (lock == NULL) {
+      // First holder of the row
+      if (shard->num_locks == shard->capacity) {
+        shard->capacity = shard->capacity ? shard->capacity * 2 : 8;
+        shard->locks = realloc(shard->locks, shard->capacity * sizeof(RowLock));
       }
+      lock = &shard->locks[shard->num_locks++];
+      memcpy(lock->key, key, KEY_SIZE);
+      lock->num_holders = 0;
+      lock->holders_capacity = 4;
+      lock->holders = malloc(lock->holders_capacity * sizeof(uint64_t));
+      lock->waiters = NULL;
+      lock->num_waiters = 0;
+      lock->waiters_capacity = 0;
       break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      // Print child nodes and keys
-      if (num_keys > 0) {
-        for (uint32_t i = 0; i < num_keys; i++) {
-          child = *internal_node_child(node, i);
-          print_tree(pager, child, indentation_level + 1);
+    }
 
-          indent(indentation_level + 1);
-          printf("- key %d\n", *internal_node_key(node, i));
+    bool holds = false;
+    bool must_die = false;
+    bool conflict = false;
+    for (uint32_t i = 0; i < lock->num_holders; i++) {
+      if (lock->holders[i] == transaction->id) {
+        holds = true;
+      } else if (mode == LOCK_EXCLUSIVE || lock->mode == LOCK_EXCLUSIVE) {
+        conflict = true;
+        must_die |= lock->holders[i] < transaction->id;
+      }
+    }
+    if (!conflict) {
+      if (holds) {
+        if (mode == LOCK_EXCLUSIVE) {
+          lock->mode = LOCK_EXCLUSIVE;  // Sole holder, so upgrading is safe
         }
-        // Handle the rightmost child
-        child = *internal_node_right_child(node);
-        print_tree(pager, child, indentation_level + 1);
+        pthread_mutex_unlock(&shard->latch);
+        return LOCK_GRANTED;
       }
       break;
-  }
+    }
+    if (must_die) {
+      pthread_mutex_unlock(&shard->latch);
+      return LOCK_DIED;
+    }
+    if (transaction->waiter != NULL) {
+      if (lock->num_waiters == lock->waiters_capacity) {
+        lock->waiters_capacity = lock->waiters_capacity ? lock->waiters_capacity * 2 : 4;
+        lock->waiters = realloc(lock->waiters, lock->waiters_capacity * sizeof(void*));
+      }
+      lock->waiters[lock->num_waiters++] = transaction->waiter;
+      transaction->waiting = true;
+      memcpy(transaction->waiting_key, key, KEY_SIZE);
+      pthread_mutex_unlock(&shard->latch);
+      return LOCK_WAIT;
+    }
+    pthread_cond_wait(&shard->released, &shard->latch);
+  }
+
+  // Join the holders of a row nobody conflicting holds
+  if (lock->num_holders == lock->holders_capacity) {
+    lock->holders_capacity *= 2;
+    lock->holders = realloc(lock->holders, lock->holders_capacity * sizeof(uint64_t));
+  }
+  lock->holders[lock->num_holders++] = transaction->id;
+  lock->mode = mode;
+  pthread_mutex_unlock(&shard->latch);
+
+  if (transaction->num_locked_keys == transaction->locked_keys_capacity) {
+    transaction->locked_keys_capacity = transaction->locked_keys_capacity
+                                            ? transaction->locked_keys_capacity * 2 : 8;
+    transaction->locked_keys = realloc(transaction->locked_keys,
+                                       transaction->locked_keys_capacity * KEY_SIZE);
+  }
+  memcpy(transaction->locked_keys[transaction->num_locked_keys++], key, KEY_SIZE);
+  return LOCK_GRANTED;
+}
+
+/**
+ * Takes a parked transaction's waiter off its row, if it is still there.
+ * @param manager Pointer to the LockManager.
+ * @param transaction Pointer to the Transaction.
+ */
+
+void lock_cancel_wait(LockManager* manager, Transaction* transaction) {
+  if (!transaction->waiting) {
+    return;
+  }
+  transaction->waiting = false;
+  LockShard* shard = lock_shard(manager, transaction->waiting_key);
+  pthread_mutex_lock(&shard->latch);
+  for (uint32_t i = 0; i < shard->num_locks; i++) {
+    RowLock* lock = &shard->locks[i];
+    if (compare_keys(lock->key, transaction->waiting_key) != 0) {
+      continue;
+    }
+    for (uint32_t w = 0; w < lock->num_waiters; w++) {
+      if (lock->waiters[w] == transaction->waiter) {
+        lock->waiters[w] = lock->waiters[--lock->num_waiters];
+        break;
+      }
+    }
+    break;
+  }
+  pthread_mutex_unlock(&shard->latch);
+}
+
+/**
+ * Releases every row lock of a transaction and wakes the transactions waiting
+ * in the shards concerned. Waiters parked on a released row are handed to
+ * wake, under the shard's latch so lock_cancel_wait cannot free them first;
+ * they ask for the row again, and wait or die as wait-die says.
+ * @param manager Pointer to the LockManager.
+ * @param transaction Pointer to the Transaction ending.
+ */
+
+void lock_release_all(LockManager* manager, Transaction* transaction) {
+  for (uint32_t k = 0; k < transaction->num_locked_keys; k++) {
+    const uint8_t* key = transaction->locked_keys[k];
+    LockShard* shard = lock_shard(manager, key);
+    pthread_mutex_lock(&shard->latch);
+    for (uint32_t i = 0; i < shard->num_locks; i++) {
+      RowLock* lock = &shard->locks[i];
+      if (compare_keys(lock->key, key) != 0) {
+        continue;
+      }
+      for (uint32_t h = 0; h < lock->num_holders; h++) {
+        if (lock->holders[h] == transaction->id) {
+          lock->holders[h] = lock->holders[--lock->num_holders];
+          break;
+        }
+      }
+      for (uint32_t w = 0; w < lock->num_waiters; w++) {
+        manager->wake(lock->waiters[w]);
+      }
+      lock->num_waiters = 0;
+      if (lock->num_holders == 0) {
+        free(lock->holders);
+        free(lock->waiters);
+        *lock = shard->locks[--shard->num_locks];
+      }
+      break;
+    }
+    pthread_cond_broadcast(&shard->released);
+    pthread_mutex_unlock(&shard->latch);
+  }
+  transaction->num_locked_keys = 0;
+}
+
+/*
+NodeType: Enumeration representing the type of a node in a B-tree.
+*/
+
+typedef enum { 
+  NODE_INTERNAL,  // Represents an internal node of the B-tree
+  NODE_LEAF       // Represents a leaf node of the B-tree
+  } NodeType;
+
+/*
+ * Common Node Header Layout
+ */
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);  // Size of the node type field
+const uint32_t NODE_TYPE_OFFSET = 0;  // Offset of the node type field in the node
+const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);  // Size of the 'is root' field
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE; // Offset of the 'is root' field in the node
+const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);  // Size of the parent pointer field
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE; // Offset of the parent pointer in the node
+const uint8_t COMMON_NODE_HEADER_SIZE =
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;  // Total size of the common node header
+
+/*
+ * Internal Node Header Layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);  // Size of the 'number of keys' field
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE; // Offset of the 'number of keys' field
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t); // Size of the right child pointer field
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;  // Offset of the right child pointer
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                           INTERNAL_NODE_NUM_KEYS_SIZE +
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;  // Total size of the internal node header
+
+/*
+ * Internal Node Body Layout
+ */
+const uint32_t INTERNAL_NODE_KEY_SIZE = KEY_SIZE; // Size of the key field in an internal node
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t); // Size of the child pointer field
+const uint32_t INTERNAL_NODE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;  // Total size of a cell in an internal node
+/* Keep this small for testing */
+const uint32_t INTERNAL_NODE_MAX_KEYS = 3;  // Maximum number of keys in an internal node (for testing)
+
+/*
+ * Leaf Node Header Layout
+ */
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t); // Size of the 'number of cells' field
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;  // Offset of the 'number of cells' field
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t); // Size of the next leaf pointer field
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;  // Offset of the next leaf pointer
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                       LEAF_NODE_NUM_CELLS_SIZE +
+                                       LEAF_NODE_NEXT_LEAF_SIZE;  // Total size of the leaf node header
+
+/*
+ * Leaf Node Body Layout
+ * The body is a slot array followed by LEAF_NODE_MAX_CELLS fixed-size cell
+ * frames. Slot i holds the frame of the i-th cell in key order, so inserting
+ * a cell shifts one-byte slots instead of whole cells.
+ */
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint8_t); // Size of a slot, the frame number of a cell
+const uint32_t LEAF_NODE_SLOTS_OFFSET = LEAF_NODE_HEADER_SIZE; // Offset of the slot array
+const uint32_t LEAF_NODE_KEY_SIZE = KEY_SIZE; // Size of the key field in a leaf node
+const uint32_t LEAF_NODE_KEY_OFFSET = 0;   // Offset of the key field in a leaf node cell
+const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE; // Size of the value field in a leaf node
+const uint32_t LEAF_NODE_VALUE_OFFSET =
+    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;  // Offset of the value field in a leaf node cell
+const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE; // Total size of a cell in a leaf node
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE; // Available space for cells in a leaf node
+const uint32_t LEAF_NODE_MAX_CELLS =
+    LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + LEAF_NODE_CELL_SIZE);  // Maximum number of cells in a leaf node
+const uint32_t LEAF_NODE_FRAMES_OFFSET =
+    LEAF_NODE_SLOTS_OFFSET + LEAF_NODE_MAX_CELLS * LEAF_NODE_SLOT_SIZE;  // Offset of the first cell frame
+const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2; // Number of cells to keep in the right node after splitting
+const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
+    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;  // Number of cells to keep in the left node after splitting
+
+/*
+ * Overflow Page Layout
+ * The part of a payload that does not fit in its cell is kept in a chain of
+ * overflow pages, each holding the next page number, a byte count and data.
+ */
+const uint32_t OVERFLOW_PAGE_NEXT_SIZE = sizeof(uint32_t); // Size of the next page field
+const uint32_t OVERFLOW_PAGE_NEXT_OFFSET = 0;  // Offset of the next page field
+const uint32_t OVERFLOW_PAGE_USED_SIZE = sizeof(uint32_t); // Size of the field counting data bytes
+const uint32_t OVERFLOW_PAGE_USED_OFFSET =
+    OVERFLOW_PAGE_NEXT_OFFSET + OVERFLOW_PAGE_NEXT_SIZE;  // Offset of the field counting data bytes
+const uint32_t OVERFLOW_PAGE_HEADER_SIZE =
+    OVERFLOW_PAGE_NEXT_SIZE + OVERFLOW_PAGE_USED_SIZE;  // Total size of the overflow page header
+const uint32_t OVERFLOW_PAGE_SPACE_FOR_DATA =
+    PAGE_SIZE - OVERFLOW_PAGE_HEADER_SIZE;  // Payload bytes held by one overflow page
+
+/**
+ * Get the node type from a given node.
+ * @param node Pointer to the node from which the type is to be retrieved.
+ * @return NodeType of the node.
+ */
+
+NodeType get_node_type(void* node) {
+  // Dereference the node type after offsetting by NODE_TYPE_OFFSET
+  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+  return (NodeType)value;
+}
+
+/**
+ * Set the node type for a given node.
+ * @param node Pointer to the node for which the type is to be set.
+ * @param type NodeType value to set for the node.
+ */
+
+void set_node_type(void* node, NodeType type) {
+  uint8_t value = type; // Cast NodeType to uint8_t
+  // Set the node type after offsetting by NODE_TYPE_OFFSET
+  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+/**
+ * Check if a given node is the root of the tree.
+ * @param node Pointer to the node to check.
+ * @return True if the node is the root, false otherwise.
+ */
+
+bool is_node_root(void* node) {
+  // Dereference the 'is root' value after offsetting by IS_ROOT_OFFSET
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
+
+/**
+ * Set the given node as a root or non-root node.
+ * @param node Pointer to the node to set as root or non-root.
+ * @param is_root Boolean indicating whether the node is a root node or not.
+ */
+
+void set_node_root(void* node, bool is_root) {
+  uint8_t value = is_root; // Cast bool to uint8_t
+// Set the 'is root' value after offsetting by IS_ROOT_OFFSET
+
+  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+/**
+ * Retrieves the parent pointer from a given node.
+ * @param node Pointer to the node from which to get the parent pointer.
+ * @return Pointer to the parent pointer field in the node.
+ */
+
+uint32_t* node_parent(void* node) { 
+  // Return the address of the parent pointer in the node
+  return node + PARENT_POINTER_OFFSET; 
+}
+
+/**
+ * Retrieves the number of keys in an internal node.
+ * @param node Pointer to the internal node.
+ * @return Pointer to the number of keys field in the node.
+ */
+
+uint32_t* internal_node_num_keys(void* node) {
+  // Return the address of the number of keys field in the internal node
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+/**
+ * Retrieves the right child of an internal node.
+ * @param node Pointer to the internal node.
+ * @return Pointer to the right child field in the node.
+ */
+
+uint32_t* internal_node_right_child(void* node) {
+  // Return the address of the right child field in the internal node
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+/**
+ * Retrieves a specific cell from an internal node.
+ * @param node Pointer to the internal node.
+ * @param cell_num Cell number to retrieve.
+ * @return Pointer to the specified cell in the node.
+ */
+
+uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
+  // Return the address of the specified cell in the internal node
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+/**
+ * Retrieves a specific child pointer from an internal node.
+ * @param node Pointer to the internal node.
+ * @param child_num The index of the child to retrieve.
+ * @return Pointer to the specified child in the node.
+ */
+
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    // Error handling for accessing an out-of-bounds child
+
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  } else if (child_num == num_keys) {
+    // Handle case when child_num is equal to num_keys (accessing the rightmost child)
+    uint32_t* right_child = internal_node_right_child(node);
+    if (*right_child == INVALID_PAGE_NUM) {
+      printf("Tried to access right child of node, but was invalid page\n");
+      exit(EXIT_FAILURE);
+    }
+    return right_child;
+  } else {
+    // Normal case for accessing a child within the bounds
+    uint32_t* child = internal_node_cell(node, child_num);
+    if (*child == INVALID_PAGE_NUM) {
+      printf("Tried to access child %d of node, but was invalid page\n", child_num);
+      exit(EXIT_FAILURE);
+    }
+    return child;
+  }
+}
+
+/**
+ * Retrieves a specific key from an internal node.
+ * @param node Pointer to the internal node.
+ * @param key_num The index of the key to retrieve.
+ * @return Pointer to the specified key in the node.
+ */
+
+uint8_t* internal_node_key(void* node, uint32_t key_num) {
+  // Calculate and return the address of the specified key
+  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+/**
+ * Retrieves the number of cells in a leaf node.
+ * @param node Pointer to the leaf node.
+ * @return Pointer to the number of cells field in the leaf node.
+ */
+
+uint32_t* leaf_node_num_cells(void* node) {
+  // Return the address of the number of cells field in the leaf node
+  return (uint32_t*)(node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+/**
+ * Retrieves the pointer to the next leaf node.
+ * @param node Pointer to the current leaf node.
+ * @return Pointer to the next leaf field in the node.
+ */
+
+uint32_t* leaf_node_next_leaf(void* node) {
+  // Return the address of the next leaf pointer field in the leaf node
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+/**
+ * Retrieves the slot array of a leaf node.
+ * @param node Pointer to the leaf node.
+ * @return Pointer to the slots, one frame number per cell in key order.
+ */
+
+uint8_t* leaf_node_slots(void* node) {
+  return node + LEAF_NODE_SLOTS_OFFSET;
+}
+
+/**
+ * Retrieves a specific cell from a leaf node.
+ * @param node Pointer to the leaf node.
+ * @param cell_num Cell number to retrieve.
+ * @return Pointer to the specified cell in the leaf node.
+ */
+
+void* leaf_node_cell(void* node, uint32_t cell_num) {
+  // Look up the frame holding the cell, then its address
+  return node + LEAF_NODE_FRAMES_OFFSET + leaf_node_slots(node)[cell_num] * LEAF_NODE_CELL_SIZE;
+}
+
+/**
+ * Retrieves the key at a specific cell in a leaf node.
+ * @param node Pointer to the leaf node.
+ * @param cell_num Cell number to retrieve the key from.
+ * @return Pointer to the key in the specified cell.
+ */
+
+uint8_t* leaf_node_key(void* node, uint32_t cell_num) {
+  // Return the address of the key in the specified cell
+  return leaf_node_cell(node, cell_num);
+}
+
+/**
+ * Retrieves the value at a specific cell in a leaf node.
+ * @param node Pointer to the leaf node.
+ * @param cell_num Cell number to retrieve the value from.
+ * @return Pointer to the value in the specified cell.
+ */
+
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  // Calculate and return the address of the value in the specified cell
+  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+/**
+ * Makes room for a new cell in a leaf node that is not full. Only the slots
+ * after the new cell move, by one byte each; the cell itself goes into a free
+ * frame wherever it is.
+ * @param node Pointer to the leaf node.
+ * @param cell_num Position of the new cell in key order.
+ * @return Pointer to the new cell, to be filled in by the caller.
+ */
+
+void* leaf_node_insert_cell(void* node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint8_t* slots = leaf_node_slots(node);
+  // Find a frame no slot refers to; a leaf may have more frames than a word has bits
+  bool frame_in_use[LEAF_NODE_MAX_CELLS];
+  memset(frame_in_use, 0, sizeof(frame_in_use));
+  for (uint32_t i = 0; i < num_cells; i++) {
+    frame_in_use[slots[i]] = true;
+  }
+  uint8_t frame = 0;
+  while (frame_in_use[frame]) {
+    frame++;
+  }
+  memmove(slots + cell_num + 1, slots + cell_num, (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  slots[cell_num] = frame;
+  *leaf_node_num_cells(node) = num_cells + 1;
+  return leaf_node_cell(node, cell_num);
+}
+
+/**
+ * Replaces the cells of a leaf node, packing them into the first frames.
+ * @param node Pointer to the leaf node.
+ * @param cells Consecutive cells of LEAF_NODE_CELL_SIZE bytes, in key order.
+ * @param num_cells Number of cells, at most LEAF_NODE_MAX_CELLS.
+ */
+
+void leaf_node_set_cells(void* node, void* cells, uint32_t num_cells) {
+  uint8_t* slots = leaf_node_slots(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    slots[i] = i;
+  }
+  memcpy(node + LEAF_NODE_FRAMES_OFFSET, cells, num_cells * LEAF_NODE_CELL_SIZE);
+  *leaf_node_num_cells(node) = num_cells;
+}
+
+/**
+ * Retrieves the page number of the next page in an overflow chain.
+ * @param page Pointer to the overflow page.
+ * @return Pointer to the next page field, INVALID_PAGE_NUM at the end of the chain.
+ */
+
+uint32_t* overflow_page_next(void* page) {
+  return page + OVERFLOW_PAGE_NEXT_OFFSET;
+}
+
+/**
+ * Retrieves the number of payload bytes held by an overflow page.
+ * @param page Pointer to the overflow page.
+ * @return Pointer to the byte count field.
+ */
+
+uint32_t* overflow_page_used(void* page) {
+  return page + OVERFLOW_PAGE_USED_OFFSET;
+}
+
+/**
+ * Retrieves the payload bytes of an overflow page.
+ * @param page Pointer to the overflow page.
+ * @return Pointer to the first payload byte.
+ */
+
+void* overflow_page_data(void* page) {
+  return page + OVERFLOW_PAGE_HEADER_SIZE;
+}
+
+/**
+ * Returns how many payload bytes to read from an overflow page. The count
+ * stored in the page is not trusted: it is clamped to what a page holds and to
+ * what the payload still lacks.
+ * @param page Pointer to the overflow page.
+ * @param remaining Payload bytes not read yet.
+ * @param corrupt Set to true if the stored count had to be clamped.
+ * @return The number of bytes, at least 1 unless the page is corrupt.
+ */
+
+uint32_t overflow_page_bytes(void* page, uint32_t remaining, bool* corrupt) {
+  uint32_t used = *overflow_page_used(page);
+  uint32_t limit = remaining < OVERFLOW_PAGE_SPACE_FOR_DATA ? remaining : OVERFLOW_PAGE_SPACE_FOR_DATA;
+  if (used == 0 || used > limit) {
+    *corrupt = true;
+    return used == 0 ? 0 : limit;
+  }
+  return used;
+}
+
+/**
+ * Sets the bit for a page in a page bitmap.
+ * @param bitmap Pointer to a page bitmap.
+ * @param page_num The page number whose bit is set.
+ */
+
+void bitmap_set(uint8_t* bitmap, uint32_t page_num) {
+  bitmap[page_num / 8] |= (uint8_t)(1 << (page_num % 8));
+}
+
+/**
+ * Tests the bit for a page in a page bitmap.
+ * @param bitmap Pointer to a page bitmap.
+ * @param page_num The page number whose bit is tested.
+ * @return True if the bit is set.
+ */
+
+bool bitmap_test(uint8_t* bitmap, uint32_t page_num) {
+  return (bitmap[page_num / 8] >> (page_num % 8)) & 1;
+}
+
+/**
+ * Clears the bit for a page in a page bitmap.
+ * @param bitmap Pointer to a page bitmap.
+ * @param page_num The page number whose bit is cleared.
+ */
+
+void bitmap_clear(uint8_t* bitmap, uint32_t page_num) {
+  bitmap[page_num / 8] &= (uint8_t)~(1 << (page_num % 8));
+}
+
+/**
+ * Allocates a zeroed page buffer aligned to CACHE_LINE_SIZE, so a node's
+ * header and first cells share one cache line.
+ * @return The page buffer, released with free.
+ */
+
+void* pager_allocate_page() {
+  void* page;
+  if (posix_memalign(&page, CACHE_LINE_SIZE, PAGE_SIZE) != 0) {
+    printf("Unable to allocate a page.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(page, 0, PAGE_SIZE);
+  return page;
+}
+
+/**
+ * Reads the stored version of a page from the database file.
+ * In shadow paging mode the page map says which slot of the file holds the
+ * page; otherwise page N lives at offset N * PAGE_SIZE, unless it was changed
+ * and spilled from the cache since, in which case the spill file holds it at
+ * the same offset.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number to read.
+ * @param page Buffer of PAGE_SIZE bytes receiving the page.
+ * @return Number of bytes read, 0 if the page is not in the file yet, -1 on error.
+ */
+
+ssize_t pager_read_page(Pager* pager, uint32_t page_num, void* page) {
+  if (bitmap_test(pager->spilled_pages, page_num)) {
+    return pread(pager->spill_fd, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+  }
+  uint32_t slot = page_num;
+  if (pager->is_shadow) {
+    slot = pager->page_map[page_num];
+    if (slot == INVALID_PAGE_NUM) {
+      return 0;
+    }
+  } else if (page_num >= pager->file_length / PAGE_SIZE) {
+    return 0;
+  }
+  return pread(pager->file_descriptor, page, PAGE_SIZE, (off_t)slot * PAGE_SIZE);
+}
+
+// Counter of the disk reads of the statement running on this thread, or NULL
+__thread uint64_t* statement_pages_read = NULL;
+// Ring of the scan running on this thread, or NULL
+__thread ScanRing* statement_scan_ring = NULL;
+
+/**
+ * Finds the shard of the cache a page belongs to.
+ * @param cache Pointer to the PageCache.
+ * @param page_num The page number.
+ * @return Pointer to the PageShard.
+ */
+
+PageShard* page_shard(PageCache* cache, uint32_t page_num) {
+  return &cache->shards[page_num % PAGE_CACHE_SHARDS];
+}
+
+/**
+ * Takes a page off the cache list it is on. Must be called with the page's
+ * shard latch held.
+ * @param cache Pointer to the PageCache.
+ * @param page_num The page number.
+ */
+
+void page_cache_unlink(PageCache* cache, uint32_t page_num) {
+  CacheList list = cache->list[page_num];
+  if (list == CACHE_LIST_NONE) {
+    return;
+  }
+  PageList* pages = &page_shard(cache, page_num)->lists[list];
+  uint32_t prev = cache->prev[page_num];
+  uint32_t next = cache->next[page_num];
+  if (prev == INVALID_PAGE_NUM) {
+    pages->head = next;
+  } else {
+    cache->next[prev] = next;
+  }
+  if (next == INVALID_PAGE_NUM) {
+    pages->tail = prev;
+  } else {
+    cache->prev[next] = prev;
+  }
+  pages->length--;
+  if (list != CACHE_LIST_GHOST) {
+    __atomic_sub_fetch(&cache->cached, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&cache->list[page_num], CACHE_LIST_NONE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Moves a page to the head of a cache list, as its most recently used page.
+ * Must be called with the page's shard latch held.
+ * @param cache Pointer to the PageCache.
+ * @param list The list to put the page on.
+ * @param page_num The page number.
+ */
+
+void page_cache_push(PageCache* cache, CacheList list, uint32_t page_num) {
+  page_cache_unlink(cache, page_num);
+  PageList* pages = &page_shard(cache, page_num)->lists[list];
+  __atomic_store_n(&cache->prev[page_num], INVALID_PAGE_NUM, __ATOMIC_RELAXED);
+  cache->next[page_num] = pages->head;
+  if (pages->head == INVALID_PAGE_NUM) {
+    pages->tail = page_num;
+  } else {
+    __atomic_store_n(&cache->prev[pages->head], page_num, __ATOMIC_RELAXED);
+  }
+  pages->head = page_num;
+  pages->length++;
+  if (list != CACHE_LIST_GHOST) {
+    __atomic_add_fetch(&cache->cached, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&cache->list[page_num], list, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a use of a page on the cache lists. Must be called with the page's
+ * shard latch held.
+ * @param cache Pointer to the PageCache.
+ * @param page_num The page number.
+ * @param hit True if the page was cached, false if it was just read.
+ */
+
+void page_cache_access(PageCache* cache, uint32_t page_num, bool hit) {
+  CacheList list = cache->list[page_num];
+  if (cache->policy == CACHE_POLICY_LRU) {
+    page_cache_push(cache, CACHE_LIST_RECENT, page_num);
+  } else if (!hit) {
+    // A page read again soon after being dropped is worth keeping
+    page_cache_push(cache, list == CACHE_LIST_GHOST ? CACHE_LIST_FREQUENT : CACHE_LIST_RECENT, page_num);
+  } else if (list != CACHE_LIST_RECENT) {
+    // Uses while on CACHE_LIST_RECENT tend to come from the statement that read
+    // the page, like a scan's, and do not promote it
+    page_cache_push(cache, list == CACHE_LIST_FREQUENT ? CACHE_LIST_FREQUENT : CACHE_LIST_RECENT, page_num);
+  }
+}
+
+/**
+ * Tells whether a hit on a cached page changes the cache lists, without taking
+ * the shard latch. A page already at the head of its list, such as the root,
+ * stays there, and 2Q leaves pages on CACHE_LIST_RECENT where they are.
+ * @param cache Pointer to the PageCache.
+ * @param page_num The page number.
+ * @return True if the hit must be recorded under the latch.
+ */
+
+bool page_cache_hit_moves(PageCache* cache, uint32_t page_num) {
+  if (cache->capacity == 0 ||
+      __atomic_load_n(&cache->prev[page_num], __ATOMIC_RELAXED) == INVALID_PAGE_NUM) {
+    return false;
+  }
+  return cache->policy == CACHE_POLICY_LRU ||
+         __atomic_load_n(&cache->list[page_num], __ATOMIC_RELAXED) != CACHE_LIST_RECENT;
+}
+
+/**
+ * Adds up the counters of the shards of the cache.
+ * @param cache Pointer to the PageCache.
+ * @return The totals.
+ */
+
+PageCacheCounts page_cache_counts(PageCache* cache) {
+  PageCacheCounts total = {0, 0, 0};
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    PageCacheCounts* counts = &cache->shards[i].counts;
+    total.hits += __atomic_load_n(&counts->hits, __ATOMIC_RELAXED);
+    total.misses += __atomic_load_n(&counts->misses, __ATOMIC_RELAXED);
+    total.evictions += __atomic_load_n(&counts->evictions, __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/**
+ * Writes a changed page to the spill file, so that it can be dropped from the
+ * cache. The spill file is created by the first page spilled. Must be called
+ * with the page's shard latch held.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number.
+ * @return False if the disk refused the page; no page is spilled after that.
+ */
+
+bool pager_spill_page(Pager* pager, uint32_t page_num) {
+  int fd = __atomic_load_n(&pager->spill_fd, __ATOMIC_ACQUIRE);
+  if (fd == -1) {
+    // Readers trimming different shards may both get here first
+    fd = open(pager->spill_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    int expected = -1;
+    if (fd != -1 && !__atomic_compare_exchange_n(&pager->spill_fd, &expected, fd, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      close(fd);
+      fd = expected;
+    }
+  }
+  if (fd == -1 || pwrite(fd, pager->pages[page_num], PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != PAGE_SIZE) {
+    __atomic_store_n(&pager->spill_failed, true, __ATOMIC_RELAXED);
+    return false;
+  }
+  // Bits of pages of other shards share the byte
+  __atomic_or_fetch(&pager->spilled_pages[page_num / 8], (uint8_t)(1 << (page_num % 8)), __ATOMIC_RELEASE);
+  __atomic_and_fetch(&pager->dirty_pages[page_num / 8], (uint8_t)~(1 << (page_num % 8)), __ATOMIC_RELAXED);
+  return true;
+}
+
+/**
+ * Tells whether a cached page can be dropped: the file must hold the same
+ * bytes, so that it can be read again. Without shadow paging, a page changed
+ * by an earlier statement can be spilled instead, until the disk is full.
+ * Replicas keep every page, as theirs come from the log.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number.
+ * @return True if the page can be dropped.
+ */
+
+bool pager_can_evict(Pager* pager, uint32_t page_num) {
+  if (pager->is_replica || pager->pages[page_num] == NULL) {
+    return false;
+  }
+  if (!bitmap_test(pager->dirty_pages, page_num)) {
+    return true;
+  }
+  return !pager->is_shadow && !bitmap_test(pager->commit_pages, page_num) &&
+         !__atomic_load_n(&pager->spill_failed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops a page from the cache, spilling it first if it changed since last
+ * written. Must be called with the page's shard latch held. While statements
+ * read under the shared statement latch, one of them may be using the page:
+ * it is retired, to be freed once they are done.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number, which pager_can_evict allows to drop.
+ * @return False if the page stays, as its shard cannot retire more pages or
+ * the spill file is full.
+ */
+
+bool pager_evict_page(Pager* pager, uint32_t page_num) {
+  PageShard* shard = page_shard(&pager->cache, page_num);
+  void* page = pager->pages[page_num];
+  // The exclusive latch holder is the only statement running, and readers
+  // only join while holding commit_lock
+  bool retire = __atomic_load_n(&pager->latch_readers, __ATOMIC_RELAXED) != 0;
+  if (retire && shard->num_retired == PAGE_RETIRE_LIMIT) {
+    __atomic_store_n(&pager->cache.drain_wanted, true, __ATOMIC_RELAXED);
+    return false;
+  }
+  if (bitmap_test(pager->dirty_pages, page_num) && !pager_spill_page(pager, page_num)) {
+    return false;
+  }
+  if (retire) {
+    shard->retired[shard->num_retired++] = page;
+  } else {
+    free(page);
+  }
+  __atomic_store_n(&pager->pages[page_num], NULL, __ATOMIC_RELEASE);
+  page_cache_unlink(&pager->cache, page_num);
+  return true;
+}
+
+/**
+ * Frees the pages retired by readers. Must be called with commit_lock held
+ * and no statement holding the latch shared.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_free_retired(Pager* pager) {
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    PageShard* shard = &pager->cache.shards[i];
+    pthread_mutex_lock(&shard->latch);
+    for (uint32_t j = 0; j < shard->num_retired; j++) {
+      free(shard->retired[j]);
+    }
+    shard->num_retired = 0;
+    pthread_mutex_unlock(&shard->latch);
+  }
+  pager->cache.drain_wanted = false;
+}
+
+/**
+ * Finds the least recently used page of a shard's cache list that can be
+ * dropped. Must be called with the shard's latch held.
+ * @param pager Pointer to the Pager structure.
+ * @param shard The shard.
+ * @param list The list to search.
+ * @param spare_internal True to pass over internal nodes.
+ * @return The page number, or INVALID_PAGE_NUM if none can be dropped.
+ */
+
+uint32_t page_cache_victim(Pager* pager, PageShard* shard, CacheList list, bool spare_internal) {
+  PageCache* cache = &pager->cache;
+  for (uint32_t page_num = shard->lists[list].tail; page_num != INVALID_PAGE_NUM;
+       page_num = cache->prev[page_num]) {
+    if (pager_can_evict(pager, page_num) &&
+        !(spare_internal && get_node_type(pager->pages[page_num]) == NODE_INTERNAL)) {
+      return page_num;
+    }
+  }
+  return INVALID_PAGE_NUM;
+}
+
+/**
+ * Drops pages of one shard until it holds no more than its share of the
+ * cache, or the whole cache is within its limit. Must be called with the
+ * shard's latch held.
+ * @param pager Pointer to the Pager structure.
+ * @param shard The shard.
+ * @param share Pages the shard may keep while the cache is over its limit.
+ */
+
+void page_shard_trim(Pager* pager, PageShard* shard, uint32_t share) {
+  PageCache* cache = &pager->cache;
+  // 2Q gives a quarter of the cache to pages used once, and remembers as many
+  // dropped ones as half the cache holds
+  uint32_t recent_share = shard->capacity / 4 > 0 ? shard->capacity / 4 : 1;
+  while (shard->lists[CACHE_LIST_RECENT].length + shard->lists[CACHE_LIST_FREQUENT].length > share &&
+         __atomic_load_n(&cache->cached, __ATOMIC_RELAXED) > cache->capacity) {
+    CacheList first = CACHE_LIST_RECENT;
+    if (cache->policy == CACHE_POLICY_2Q && shard->lists[CACHE_LIST_RECENT].length <= recent_share) {
+      first = CACHE_LIST_FREQUENT;
+    }
+    CacheList second = first == CACHE_LIST_RECENT ? CACHE_LIST_FREQUENT : CACHE_LIST_RECENT;
+    uint32_t victim = INVALID_PAGE_NUM;
+    // Internal nodes go last when pinned: every lookup reads them
+    for (int spare_internal = cache->pin_internal; spare_internal >= 0 && victim == INVALID_PAGE_NUM;
+         spare_internal--) {
+      victim = page_cache_victim(pager, shard, first, spare_internal);
+      if (victim == INVALID_PAGE_NUM) {
+        victim = page_cache_victim(pager, shard, second, spare_internal);
+      }
+    }
+    if (victim == INVALID_PAGE_NUM) {
+      return;  // The rest are changed by the statement, or since last written and the disk is full
+    }
+    bool was_recent = cache->list[victim] == CACHE_LIST_RECENT;
+    if (!pager_evict_page(pager, victim)) {
+      return;  // Readers must drain first, or the spill file is full
+    }
+    shard->counts.evictions++;
+    if (cache->policy == CACHE_POLICY_2Q && was_recent) {
+      page_cache_push(cache, CACHE_LIST_GHOST, victim);
+      if (shard->lists[CACHE_LIST_GHOST].length > shard->capacity / 2) {
+        page_cache_unlink(cache, shard->lists[CACHE_LIST_GHOST].tail);
+      }
+    }
+  }
+}
+
+/**
+ * Drops pages until the cache is within its limit, or nothing more can be
+ * dropped. Only called where the statement holds no pointer into a page:
+ * between statements, and between the rows of a scan. Nothing is dropped
+ * while a backup runs, as it reads uncached pages from the file.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_trim_cache(Pager* pager) {
+  PageCache* cache = &pager->cache;
+  if (cache->capacity == 0 || __atomic_load_n(&cache->cached, __ATOMIC_RELAXED) <= cache->capacity ||
+      __atomic_load_n(&pager->backup_pid, __ATOMIC_RELAXED) != 0) {
+    return;
+  }
+  // The shards take turns to give up pages, down to an even part of the limit
+  uint32_t share = cache->capacity / PAGE_CACHE_SHARDS;
+  uint32_t first = __atomic_fetch_add(&cache->next_trim, 1, __ATOMIC_RELAXED);
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS &&
+                       __atomic_load_n(&cache->cached, __ATOMIC_RELAXED) > cache->capacity; i++) {
+    PageShard* shard = &cache->shards[(first + i) % PAGE_CACHE_SHARDS];
+    pthread_mutex_lock(&shard->latch);
+    page_shard_trim(pager, shard, share);
+    pthread_mutex_unlock(&shard->latch);
+  }
+}
+
+/**
+ * Rebuilds the cache lists from the pages cached, all on CACHE_LIST_RECENT.
+ * Must be called with the statement latch held exclusively.
+ * @param pager Pointer to the Pager structure.
+ * @param drop True to drop every page that can be, starting cold.
+ */
+
+void pager_reset_cache(Pager* pager, bool drop) {
+  PageCache* cache = &pager->cache;
+  memset(cache->list, CACHE_LIST_NONE, pager->page_capacity);
+  cache->cached = 0;
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    PageShard* shard = &cache->shards[i];
+    for (uint32_t list = 0; list < CACHE_LISTS; list++) {
+      shard->lists[list] = (PageList){INVALID_PAGE_NUM, INVALID_PAGE_NUM, 0};
+    }
+    shard->capacity = (cache->capacity + PAGE_CACHE_SHARDS - 1) / PAGE_CACHE_SHARDS;
+  }
+  for (uint32_t i = 0; i < pager->page_capacity; i++) {
+    if (drop && pager_can_evict(pager, i)) {
+      pager_evict_page(pager, i);
+    } else if (pager->pages[i] != NULL && cache->capacity != 0) {
+      page_cache_push(cache, CACHE_LIST_RECENT, i);
+    }
+  }
+}
+
+/**
+ * Records a page a scan read from disk in its ring, evicting the oldest page
+ * of the ring once it is full.
+ * @param pager Pointer to the Pager structure.
+ * @param ring The scan's ScanRing.
+ * @param page_num The page just read.
+ */
+
+void scan_ring_add(Pager* pager, ScanRing* ring, uint32_t page_num) {
+  if (ring->num_pages < SCAN_RING_PAGES) {
+    ring->pages[ring->num_pages++] = page_num;
+    return;
+  }
+  uint32_t victim = ring->pages[ring->next];
+  PageShard* shard = page_shard(&pager->cache, victim);
+  pthread_mutex_lock(&shard->latch);
+  if (victim != page_num && pager_can_evict(pager, victim) &&
+      __atomic_load_n(&pager->backup_pid, __ATOMIC_RELAXED) == 0 && pager_evict_page(pager, victim)) {
+    __atomic_add_fetch(&pager->pages_evicted, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&shard->latch);
+  ring->pages[ring->next] = page_num;
+  ring->next = (ring->next + 1) % SCAN_RING_PAGES;
+}
+
+/**
+ * Resizes a per-page array of the Pager, zeroing the room it gains.
+ * @param array The array, or NULL.
+ * @param old_size Its size in bytes.
+ * @param new_size The size it should have.
+ * @return The resized array.
+ */
+
+void* pager_resize_array(void* array, size_t old_size, size_t new_size) {
+  array = realloc(array, new_size);
+  if (array == NULL) {
+    printf("Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset((uint8_t*)array + old_size, 0, new_size - old_size);
+  return array;
+}
+
+/**
+ * Gives the per-page arrays and bitmaps of the Pager room for a number of
+ * pages, at least doubling them so a growing file rarely resizes them. Only
+ * called while no other statement runs, as readers use the arrays unlatched.
+ * @param pager Pointer to the Pager structure.
+ * @param num_pages Pages the arrays must have room for, at most max_pages.
+ */
+
+void pager_grow(Pager* pager, uint32_t num_pages) {
+  uint32_t old = pager->page_capacity;
+  if (num_pages <= old) {
+    return;
+  }
+  uint32_t capacity = old * 2 > num_pages ? old * 2 : num_pages;
+  capacity = capacity > pager->max_pages ? pager->max_pages : capacity;
+  size_t old_bitmap = PAGE_BITMAP_SIZE(old);
+  size_t bitmap = PAGE_BITMAP_SIZE(capacity);
+  pager->pages = pager_resize_array(pager->pages, old * sizeof(void*), capacity * sizeof(void*));
+  pager->changed_pages = pager_resize_array(pager->changed_pages, old_bitmap, bitmap);
+  pager->backup_pages = pager_resize_array(pager->backup_pages, old_bitmap, bitmap);
+  pager->commit_pages = pager_resize_array(pager->commit_pages, old_bitmap, bitmap);
+  pager->summarized_pages = pager_resize_array(pager->summarized_pages, old_bitmap, bitmap);
+  pager->leaf_summaries = pager_resize_array(pager->leaf_summaries, old * sizeof(LeafSummary),
+                                             capacity * sizeof(LeafSummary));
+  pager->dirty_pages = pager_resize_array(pager->dirty_pages, old_bitmap, bitmap);
+  pager->spilled_pages = pager_resize_array(pager->spilled_pages, old_bitmap, bitmap);
+  // CACHE_LIST_NONE is 0, so the new pages are on no list
+  PageCache* cache = &pager->cache;
+  cache->list = pager_resize_array(cache->list, old, capacity);
+  cache->prev = pager_resize_array(cache->prev, old * sizeof(uint32_t), capacity * sizeof(uint32_t));
+  cache->next = pager_resize_array(cache->next, old * sizeof(uint32_t), capacity * sizeof(uint32_t));
+  StatementUndo* undo = &pager->undo;
+  undo->commit_pages = pager_resize_array(undo->commit_pages, old_bitmap, bitmap);
+  undo->recorded = pager_resize_array(undo->recorded, old_bitmap, bitmap);
+  undo->changed = pager_resize_array(undo->changed, old * sizeof(uint32_t), capacity * sizeof(uint32_t));
+  undo->images = pager_resize_array(undo->images, old * sizeof(void*), capacity * sizeof(void*));
+  pager->page_capacity = capacity;
+}
+
+/**
+ * Retrieves a specific page from the pager. A cached page is found without
+ * taking a latch; a page is read from the file outside its shard's latch,
+ * and the first reader to finish puts its copy in the cache.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number to retrieve.
+ * @return Pointer to the requested page.
+ */
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  // Check for out-of-bounds page number; statements reserve their pages
+  // with pager_reserve_pages, so only a bug gets here
+  if (page_num >= pager->max_pages) {
+    printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num,
+           pager->max_pages);
+    exit(EXIT_FAILURE);
+  }
+  // Only writers reach past the end, with no reader running
+  if (page_num >= pager->page_capacity) {
+    pager_grow(pager, page_num + 1);
+  }
+  PageCache* cache = &pager->cache;
+  PageShard* shard = page_shard(cache, page_num);
+  void* page = __atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE);
+  if (page != NULL) {
+    __atomic_add_fetch(&shard->counts.hits, 1, __ATOMIC_RELAXED);
+    if (page_cache_hit_moves(cache, page_num)) {
+      pthread_mutex_lock(&shard->latch);
+      if (pager->pages[page_num] == page) {
+        page_cache_access(cache, page_num, true);
+      }
+      pthread_mutex_unlock(&shard->latch);
+    }
+    return page;
+  }
+  // Handle cache miss: allocate memory for the page, zeroed so a page past the
+  // end of the file never carries stale bytes that look like valid child pointers
+  page = pager_allocate_page();
+  // Load the page from the file if it exists
+  if (pager_read_page(pager, page_num, page) == -1) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_lock(&shard->latch);
+  void* cached = pager->pages[page_num];
+  if (cached != NULL) {
+    // Another reader read it meanwhile
+    pthread_mutex_unlock(&shard->latch);
+    __atomic_add_fetch(&shard->counts.hits, 1, __ATOMIC_RELAXED);
+    free(page);
+    return cached;
+  }
+  // Update the pager's pages array and page count
+  __atomic_store_n(&pager->pages[page_num], page, __ATOMIC_RELEASE);
+  shard->counts.misses++;
+  if (cache->capacity != 0) {
+    page_cache_access(cache, page_num, false);
+  }
+  pthread_mutex_unlock(&shard->latch);
+
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;  // Only writers reach past the end
+  }
+  // Charge the read to the running statement, and to its scan's ring.
+  // Internal nodes are few and every lookup goes through them: they stay.
+  if (statement_pages_read != NULL) {
+    (*statement_pages_read)++;
+  }
+  if (statement_scan_ring != NULL && get_node_type(page) != NODE_INTERNAL) {
+    scan_ring_add(pager, statement_scan_ring, page_num);
+  }
+  return page;
+}
+
+/**
+ * Records that a page is about to be modified.
+ * Every function that writes into a page calls this first, so the pager knows
+ * which pages differ from the last backup and which ones the next commit ships,
+ * and so that a statement that can be undone keeps the page's contents.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The page number being modified.
+ */
+
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  StatementUndo* undo = &pager->undo;
+  if (undo->active && !bitmap_test(undo->recorded, page_num)) {
+    bitmap_set(undo->recorded, page_num);
+    undo->changed[undo->num_changed++] = page_num;
+    undo->images[page_num] = NULL;
+    if (page_num < undo->num_pages) {
+      undo->images[page_num] = malloc(PAGE_SIZE);
+      memcpy(undo->images[page_num], get_page(pager, page_num), PAGE_SIZE);
+    }
+  }
+  bitmap_set(pager->dirty_pages, page_num);
+  bitmap_set(pager->changed_pages, page_num);
+  bitmap_set(pager->commit_pages, page_num);
+  pager->statement_changed = true;
+}
+
+/**
+ * Starts keeping the contents of the pages the running statement changes, so
+ * that it can be undone if it runs out of pages midway.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_begin_undo(Pager* pager) {
+  StatementUndo* undo = &pager->undo;
+  undo->active = true;
+  undo->num_pages = pager->num_pages;
+  undo->statement_changed = pager->statement_changed;
+  memcpy(undo->commit_pages, pager->commit_pages, PAGE_BITMAP_SIZE(pager->page_capacity));
+  undo->num_changed = 0;
+}
+
+/**
+ * Stops keeping page contents, first restoring them if the statement is
+ * undone. The pages the statement added are then dropped: none of them was
+ * written anywhere, as they are all part of its commit.
+ * @param pager Pointer to the Pager structure.
+ * @param rollback True to undo the statement's changes.
+ */
+
+void pager_end_undo(Pager* pager, bool rollback) {
+  StatementUndo* undo = &pager->undo;
+  for (uint32_t i = 0; i < undo->num_changed; i++) {
+    uint32_t page_num = undo->changed[i];
+    bitmap_clear(undo->recorded, page_num);
+    if (rollback && undo->images[page_num] != NULL) {
+      memcpy(pager->pages[page_num], undo->images[page_num], PAGE_SIZE);
+    }
+    free(undo->images[page_num]);
+  }
+  undo->active = false;
+  if (!rollback) {
+    return;
+  }
+  for (uint32_t page_num = undo->num_pages; page_num < pager->num_pages; page_num++) {
+    if (pager->pages[page_num] != NULL) {
+      PageShard* shard = page_shard(&pager->cache, page_num);
+      pthread_mutex_lock(&shard->latch);
+      page_cache_unlink(&pager->cache, page_num);
+      pthread_mutex_unlock(&shard->latch);
+      free(pager->pages[page_num]);
+      pager->pages[page_num] = NULL;
+    }
+    bitmap_clear(pager->dirty_pages, page_num);
+    bitmap_clear(pager->changed_pages, page_num);
+  }
+  pager->num_pages = undo->num_pages;
+  memcpy(pager->commit_pages, undo->commit_pages, PAGE_BITMAP_SIZE(pager->page_capacity));
+  pager->statement_changed = undo->statement_changed;
+}
+
+/**
+ * Checks, before a statement changes anything more, that it can add the pages
+ * it may need: the file must have room for them, and once the disk refused a
+ * spilled page, so must the cache. Only called where the statement holds no
+ * pointer into a page.
+ * @param pager Pointer to the Pager structure.
+ * @param pages Most pages the statement may add.
+ * @return EXECUTE_TABLE_FULL or EXECUTE_DISK_FULL if the pages may not fit,
+ * EXECUTE_SUCCESS otherwise.
+ */
+
+ExecuteResult pager_reserve_pages(Pager* pager, uint32_t pages) {
+  if (pager->num_pages + pages > pager->max_pages) {
+    return EXECUTE_TABLE_FULL;
+  }
+  PageCache* cache = &pager->cache;
+  if (cache->capacity != 0 && __atomic_load_n(&pager->spill_failed, __ATOMIC_RELAXED)) {
+    // Space may have been freed on the disk since
+    __atomic_store_n(&pager->spill_failed, false, __ATOMIC_RELAXED);
+    pager_trim_cache(pager);
+    if (__atomic_load_n(&pager->spill_failed, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&cache->cached, __ATOMIC_RELAXED) + pages > cache->capacity) {
+      return EXECUTE_DISK_FULL;
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/**
+ * Gets the maximum key from a node.
+ * @param pager Pointer to the Pager structure.
+ * @param node Pointer to the node.
+ * @param max_key Buffer of KEY_SIZE bytes receiving the maximum key in the node.
+ */
+
+void get_node_max_key(Pager* pager, void* node, uint8_t* max_key) {
+  // Handle leaf nodes
+  if (get_node_type(node) == NODE_LEAF) {
+    memcpy(max_key, leaf_node_key(node, *leaf_node_num_cells(node) - 1), KEY_SIZE);
+    return;
+  }
+  // Recursively call on the right child for internal nodes
+  void* right_child = get_page(pager,*internal_node_right_child(node));
+  get_node_max_key(pager, right_child, max_key);
+}
+
+/**
+ * Prints constant values used in the database.
+ */
+
+void print_constants() {
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+/**
+ * Indents the output based on the specified indentation level.
+ * @param level The level of indentation.
+ */
+
+void indent(uint32_t level) {
+  // Print spaces for indentation
+  for (uint32_t i = 0; i < level; i++) {
+    printf("  ");
+  }
+}
+
+/**
+ * Prints the B-tree starting from a specific page.
+ * @param pager Pointer to the Pager structure.
+ * @param page_num The starting page number of the B-tree to print.
+ * @param indentation_level Current level of indentation for pretty printing.
+ */
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+  int32_t tenant_id;
+  int64_t id;
+  // Handle different node types
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        decode_key(leaf_node_key(node, i), &tenant_id, &id);
+        printf("- ");
+        print_id(tenant_id, id);
+        printf("\n");
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      // Print child nodes and keys
+      if (num_keys > 0) {
+        for (uint32_t i = 0; i < num_keys; i++) {
+          child = *internal_node_child(node, i);
+          print_tree(pager, child, indentation_level + 1);
+
+          indent(indentation_level + 1);
+          decode_key(internal_node_key(node, i), &tenant_id, &id);
+          printf("- key ");
+          print_id(tenant_id, id);
+          printf("\n");
+        }
+        // Handle the rightmost child
+        child = *internal_node_right_child(node);
+        print_tree(pager, child, indentation_level + 1);
+      }
+      break;
+  }
+}
+
+/**
+ * Finds the domain part of an email address.
+ * @param email The email address.
+ * @return Pointer to the last '@' of the email, or NULL if it has none.
+ */
+
+char* email_domain(char* email) {
+  return strrchr(email, '@');
+}
+
+/**
+ * Serializes a Row structure into a byte array.
+ * @param source Pointer to the Row structure to be serialized.
+ * @param destination Pointer to the destination byte array where the serialized data will be stored.
+ */
+
+void serialize_row(Row* source, void* destination) {
+  // Copy the tenant ID from the source to the destination at the TENANT_ID_OFFSET
+  memcpy(destination + TENANT_ID_OFFSET, &(source->tenant_id), TENANT_ID_SIZE);
+  // Copy the ID from the source to the destination at the ID_OFFSET
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  // Copy the username's dictionary code; dictionary_encode_row assigned it
+  memcpy(destination + USERNAME_CODE_OFFSET, &(source->username_code), USERNAME_CODE_SIZE);
+  // Copy the email without its domain, which is stored as a dictionary code,
+  // unless the local part is too long and has a code of its own
+  uint32_t local_length = strlen(source->email);
+  if (source->domain_code != NO_DICTIONARY_CODE) {
+    local_length = email_domain(source->email) - source->email;
+  }
+  memset(destination + EMAIL_OFFSET, 0, EMAIL_SIZE);
+  if (source->local_code == NO_DICTIONARY_CODE) {
+    memcpy(destination + EMAIL_OFFSET, &(source->email), local_length);
+  }
+  memcpy(destination + DOMAIN_CODE_OFFSET, &(source->domain_code), DOMAIN_CODE_SIZE);
+  memcpy(destination + LOCAL_CODE_OFFSET, &(source->local_code), LOCAL_CODE_SIZE);
+  // Copy the payload reference; the payload itself is written by pager_write_overflow
+  memcpy(destination + PAYLOAD_LENGTH_OFFSET, &(source->payload_length), PAYLOAD_LENGTH_SIZE);
+  memcpy(destination + PAYLOAD_PAGE_OFFSET, &(source->payload_page), PAYLOAD_PAGE_SIZE);
+  memcpy(destination + PAYLOAD_PREFIX_OFFSET, &(source->payload_prefix), PAYLOAD_PREFIX_SIZE);
+}
+
+/**
+ * Deserializes a byte array into a Row structure.
+ * @param source Pointer to the byte array containing the serialized data.
+ * @param destination Pointer to the Row structure where the deserialized data will be stored.
+ */
+
+void deserialize_row(void* source, Row* destination) {
+  // Copy the tenant ID from the source to the destination at the TENANT_ID_OFFSET
+  memcpy(&(destination->tenant_id), source + TENANT_ID_OFFSET, TENANT_ID_SIZE);
+  // Copy the ID from the source to the destination at the ID_OFFSET
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  // Copy the dictionary codes; dictionary_decode_row turns them back into text
+  memcpy(&(destination->username_code), source + USERNAME_CODE_OFFSET, USERNAME_CODE_SIZE);
+  destination->username[0] = '\0';
+  // Copy the email up to its domain; a local part filling the field has no terminator
+  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+  destination->email[EMAIL_SIZE] = '\0';
+  memcpy(&(destination->domain_code), source + DOMAIN_CODE_OFFSET, DOMAIN_CODE_SIZE);
+  memcpy(&(destination->local_code), source + LOCAL_CODE_OFFSET, LOCAL_CODE_SIZE);
+  // Copy the payload reference; print_payload streams the rest from the overflow pages
+  memcpy(&(destination->payload_length), source + PAYLOAD_LENGTH_OFFSET, PAYLOAD_LENGTH_SIZE);
+  memcpy(&(destination->payload_page), source + PAYLOAD_PAGE_OFFSET, PAYLOAD_PAGE_SIZE);
+  memcpy(&(destination->payload_prefix), source + PAYLOAD_PREFIX_OFFSET, PAYLOAD_PREFIX_SIZE);
+  destination->payload = NULL;
+}
+
+/**
+ * Initializes a node as a leaf node.
+ * @param node Pointer to the node to be initialized.
+ */
+
+void initialize_leaf_node(void* node) {
+  // Set the node type to NODE_LEAF
+  set_node_type(node, NODE_LEAF);
+  // Set the node as non-root
+  set_node_root(node, false);
+  // Initialize the number of cells to 0
+  *leaf_node_num_cells(node) = 0;
+  // Set the next leaf pointer to 0 (no sibling)
+  *leaf_node_next_leaf(node) = 0;
+}
+
+/**
+ * Initializes a node as an internal node.
+ * @param node Pointer to the node to be initialized.
+ */
+
+void initialize_internal_node(void* node) {
+  // Set the node type to NODE_INTERNAL
+  set_node_type(node, NODE_INTERNAL);
+  // Set the node as non-root
+  set_node_root(node, false);
+  // Initialize the number of keys to 0
+  *internal_node_num_keys(node) = 0;
+  /*
+  Necessary because the root page number is 0; by not initializing an internal 
+  node's right child to an invalid page number when initializing the node, we may
+  end up with 0 as the node's right child, which makes the node a parent of the root
+  */
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+/**
+ * Tells whether the key of a leaf cell sorts before a key given by its parts.
+ * @param node Pointer to the leaf node.
+ * @param cell_num The cell whose key is compared.
+ * @param tenant_bits key_tenant_bits of the other key.
+ * @param id_bits key_id_bits of the other key.
+ * @return 1 if the cell's key is smaller, 0 otherwise.
+ */
+
+uint32_t leaf_node_key_less(void* node, uint32_t cell_num, uint32_t tenant_bits, uint64_t id_bits) {
+  return key_less(leaf_node_key(node, cell_num), tenant_bits, id_bits);
+}
+
+/**
+ * Finds the first cell of a range whose key is not smaller than a given key.
+ * The range halves every step whatever the comparison says, and the choice
+ * between halves is a conditional move, not a branch.
+ * @param node Pointer to the leaf node.
+ * @param begin First cell of the range.
+ * @param end One past the last cell of the range.
+ * @param key The key searched for.
+ * @return The cell number, end if every key in the range is smaller.
+ */
+
+uint32_t leaf_node_lower_bound(void* node, uint32_t begin, uint32_t end, const uint8_t* key) {
+  uint32_t tenant_bits = key_tenant_bits(key);
+  uint64_t id_bits = key_id_bits(key);
+  if (begin == end) {
+    return begin;
+  }
+  uint32_t base = begin;
+  uint32_t length = end - begin;
+  while (length > 1) {
+    uint32_t half = length / 2;
+    base += leaf_node_key_less(node, base + half - 1, tenant_bits, id_bits) * half;
+    length -= half;
+  }
+  return base + leaf_node_key_less(node, base, tenant_bits, id_bits);
+}
+
+/**
+ * Finds a particular key within a leaf node and returns a cursor pointing to it.
+ * @param table Pointer to the Table structure.
+ * @param page_num The page number of the leaf node.
+ * @param key The key to find in the leaf node.
+ * @return Cursor pointing to the location of the key, or where the key should be if it's not present.
+ */
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, const uint8_t* key) {
+  void* node = get_page(table->pager, page_num);  // Retrieve the specified page
+  // Allocate and initialize a new cursor
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->end_of_table = false;
+
+  // The key if found, or the position where it should be inserted
+  cursor->cell_num = leaf_node_lower_bound(node, 0, *leaf_node_num_cells(node), key);
+  return cursor;
+}
+
+/**
+ * Finds the child index in an internal node that should contain the given key.
+ * @param node Pointer to the internal node.
+ * @param key The key to find.
+ * @return The index of the child that should contain the key.
+ */
+
+uint32_t internal_node_find_child(void* node, const uint8_t* key) {
+  /*
+  Return the index of the child which should contain
+  the given key.
+  */
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t tenant_bits = key_tenant_bits(key);
+  uint64_t id_bits = key_id_bits(key);
+
+  /*
+  Branchless lower bound: the first key not smaller than the given one.
+  Pages are aligned to CACHE_LINE_SIZE, and the header and
+  INTERNAL_NODE_MAX_KEYS cells fit in the first line, so every probe hits it.
+  */
+  uint32_t base = 0;
+  uint32_t length = num_keys + 1; /* there is one more child than key */
+  while (length > 1) {
+    uint32_t half = length / 2;
+    base += key_less(internal_node_key(node, base + half - 1), tenant_bits, id_bits) * half;
+    length -= half;
+  }
+  return base; // Return the index of the child that should contain the key
+}
+
+/**
+ * Finds a key within an internal node and returns a cursor pointing to it.
+ * @param table Pointer to the Table structure.
+ * @param page_num The page number of the internal node.
+ * @param key The key to find in the internal node.
+ * @return Cursor pointing to the location of the key.
+ */
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, const uint8_t* key) {
+  void* node = get_page(table->pager, page_num);  // Retrieve the specified page
+  // Find the child that should contain the key
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  void* child = get_page(table->pager, child_num);
+  // Recursively find the key in the child node
+  switch (get_node_type(child)) {
+    case NODE_LEAF:
+      return leaf_node_find(table, child_num, key);
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_num, key);
+  }
+}
+
+/**
+ * Finds the position of a given key in the table. If the key is not present, returns the position where it should be inserted.
+ * @param table Pointer to the Table structure.
+ * @param key The key to find.
+ * @return Cursor pointing to the location of the key or where it should be inserted.
+ */
+
+Cursor* table_find(Table* table, const uint8_t* key) {
+  uint32_t root_page_num = table->root_page_num;
+  void* root_node = get_page(table->pager, root_page_num);
+  // Determine the type of the root node and find the key accordingly
+  if (get_node_type(root_node) == NODE_LEAF) {
+    return leaf_node_find(table, root_page_num, key);
+  } else {
+    return internal_node_find(table, root_page_num, key);
+  }
+}
+
+/**
+ * Descends to the leaf that should contain a key and reports the largest key
+ * that leaf can hold, so a batch can send every key up to that bound there.
+ * @param table Pointer to the Table structure.
+ * @param key The key to find.
+ * @param upper_bound Set to the largest key routed to the same leaf.
+ * @param has_upper_bound Set to false if the leaf is the rightmost one.
+ * @return The page number of the leaf.
+ */
+
+uint32_t table_find_leaf(Table* table, const uint8_t* key, uint8_t* upper_bound,
+                         bool* has_upper_bound) {
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  *has_upper_bound = false;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, key);
+    // Child i holds keys up to key i; deeper bounds are always tighter
+    if (child_index < *internal_node_num_keys(node)) {
+      memcpy(upper_bound, internal_node_key(node, child_index), KEY_SIZE);
+      *has_upper_bound = true;
+    }
+    page_num = *internal_node_child(node, child_index);
+    node = get_page(table->pager, page_num);
+  }
+  return page_num;
+}
+
+/**
+ * Returns a cursor to the start of the table.
+ * @param table Pointer to the Table structure.
+ * @return Cursor positioned at the start of the table.
+ */
+
+Cursor* table_start(Table* table) {
+  uint8_t smallest_key[KEY_SIZE] = {0};  // Encodes the smallest tenant and id
+  Cursor* cursor = table_find(table, smallest_key);  // Find the first position in the table
+
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);  // Set end_of_table if the table is empty
+
+  return cursor;
+}
+
+/**
+ * Returns a cursor to the first row whose key is at least the given key.
+ * @param table Pointer to the Table structure.
+ * @param key The key to seek to.
+ * @return Cursor positioned at that row, or at the end of the table.
+ */
+
+Cursor* table_seek(Table* table, const uint8_t* key) {
+  Cursor* cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    // The key is past this leaf's last cell; the next row starts the next leaf
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+    } else {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+  return cursor;
+}
+
+/**
+ * Retrieves the value at the cursor's current position.
+ * @param cursor Pointer to the Cursor structure.
+ * @return Pointer to the value at the cursor's current position.
+ */
+
+void* cursor_value(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(cursor->table->pager, page_num);
+  return leaf_node_value(page, cursor->cell_num); // Return the value at the cursor's position
+}
+
+/**
+ * Advances the cursor to the next position in the table.
+ * @param cursor Pointer to the Cursor structure to advance.
+ */
+
+void cursor_advance(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+
+  cursor->cell_num += 1;  // Move to the next cell
+  // Check if we need to move to the next leaf node
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    } else {
+      // Move to the next leaf node
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+}
+
+/**
+ * Compares two page numbers, used to sort warm-cache hints with qsort.
+ * @param a Pointer to the first page number.
+ * @param b Pointer to the second page number.
+ * @return Negative, zero or positive like strcmp.
+ */
+
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t left = *(const uint32_t*)a;
+  uint32_t right = *(const uint32_t*)b;
+  return (left > right) - (left < right);
+}
+
+/**
+ * Asks the operating system to start reading a run of pages in the background.
+ * The call returns immediately, so queries keep running while the kernel fills
+ * its page cache and later get_page reads no longer wait on the disk.
+ * @param pager Pointer to the Pager structure.
+ * @param first_page First page number of the run.
+ * @param num_pages Number of consecutive pages in the run.
+ */
+
+void pager_advise_willneed(Pager* pager, uint32_t first_page, uint32_t num_pages) {
+  off_t offset = (off_t)first_page * PAGE_SIZE;
+  off_t length = (off_t)num_pages * PAGE_SIZE;
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  // macOS has no posix_fadvise, but offers the same readahead through fcntl
+  struct radvisory advice;
+  advice.ra_offset = offset;
+  advice.ra_count = (int)length;
+  fcntl(pager->file_descriptor, F_RDADVISE, &advice);
+#else
+  (void)offset;
+  (void)length;
+#endif
+}
+
+/**
+ * Reads the warm-cache hints left by the previous run and prefetches those pages.
+ * Hints are sorted and coalesced into runs of consecutive pages so the disk sees a
+ * few large sequential reads instead of one 4 KB read per page fault. A missing or
+ * malformed sidecar only means a cold start, so errors here are silently ignored.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_prefetch_hot_pages(Pager* pager) {
+  int fd = open(pager->hot_pages_path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+
+  uint32_t header[2];  // Magic number followed by the number of hints
+  if (read(fd, header, sizeof(header)) != sizeof(header) ||
+      header[0] != HOT_PAGES_MAGIC || header[1] > pager->max_pages) {
+    close(fd);
+    return;
+  }
+
+  uint32_t* hints = malloc(header[1] * sizeof(uint32_t));
+  ssize_t bytes_read = read(fd, hints, header[1] * sizeof(uint32_t));
+  close(fd);
+  if (bytes_read != (ssize_t)(header[1] * sizeof(uint32_t))) {
+    free(hints);
+    return;
+  }
+
+  // Hints name pages; readahead works on where they sit in the file
+  uint32_t file_pages = pager->file_length / PAGE_SIZE;
+  for (uint32_t i = 0; i < header[1]; i++) {
+    if (pager->is_shadow) {
+      hints[i] = hints[i] < SHADOW_MAX_PAGES ? pager->page_map[hints[i]] : INVALID_PAGE_NUM;
+    }
+  }
+  qsort(hints, header[1], sizeof(uint32_t), compare_page_nums);
+
+  // Walk the sorted hints and issue one request per run of consecutive pages
+  uint32_t run_start = 0;
+  uint32_t run_length = 0;
+  for (uint32_t i = 0; i < header[1]; i++) {
+    uint32_t page_num = hints[i];
+    if (page_num >= file_pages) {
+      break;  // Sorted, so every remaining hint is past the end of the file too
+    }
+    if (run_length > 0 && page_num < run_start + run_length) {
+      continue;  // Duplicate hint
+    }
+    if (run_length > 0 && page_num == run_start + run_length) {
+      run_length++;
+      continue;
+    }
+    if (run_length > 0) {
+      pager_advise_willneed(pager, run_start, run_length);
+      pager->pages_prefetched += run_length;
+    }
+    run_start = page_num;
+    run_length = 1;
+  }
+  if (run_length > 0) {
+    pager_advise_willneed(pager, run_start, run_length);
+    pager->pages_prefetched += run_length;
+  }
+  free(hints);
+}
+
+/**
+ * Records which pages are resident in the cache so the next run can warm up.
+ * Written at shutdown, and at every checkpoint so that a run that never shuts
+ * down cleanly still leaves recent hints; the pages cached then are the hot set.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_save_hot_pages(Pager* pager) {
+  uint32_t* hints = malloc(pager->page_capacity * sizeof(uint32_t));
+  uint32_t num_hints = 0;
+  for (uint32_t i = 0; i < pager->page_capacity; i++) {
+    if (pager->pages[i] != NULL) {
+      hints[num_hints++] = i;
+    }
+  }
+
+  int fd = open(pager->hot_pages_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    free(hints);
+    return;  // Hints are only an optimization; never fail a close over them
+  }
+  uint32_t header[2] = {HOT_PAGES_MAGIC, num_hints};
+  if (write(fd, header, sizeof(header)) == sizeof(header)) {
+    write(fd, hints, num_hints * sizeof(uint32_t));
+  }
+  close(fd);
+  free(hints);
+}
+
+/**
+ * Loads the changed-page bitmap saved by the previous run.
+ * Without a valid sidecar there is no way to know what the last backup holds,
+ * so every page is treated as changed and the next incremental copies it all.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_load_changed_pages(Pager* pager) {
+  memset(pager->changed_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  int fd = open(pager->changed_pages_path, O_RDONLY);
+  if (fd != -1) {
+    uint32_t header[2];  // Magic number followed by the bitmap size
+    bool valid = read(fd, header, sizeof(header)) == sizeof(header) &&
+                 header[0] == CHANGED_PAGES_MAGIC &&
+                 header[1] <= PAGE_BITMAP_SIZE(pager->page_capacity) &&
+                 read(fd, pager->changed_pages, header[1]) == header[1];
+    close(fd);
+    if (valid) {
+      return;
+    }
+    memset(pager->changed_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  }
+  for (uint32_t i = 0; i < pager->num_pages && i < pager->page_capacity; i++) {
+    bitmap_set(pager->changed_pages, i);
+  }
+}
+
+/**
+ * Persists the changed-page bitmap. Called before pages are flushed, and synced,
+ * so a crash can only leave the bitmap claiming more changes than the file has.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_save_changed_pages(Pager* pager) {
+  int fd = open(pager->changed_pages_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to save changed pages: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  // The bitmap covers the pages of the file; the arrays may have more room
+  uint32_t header[2] = {CHANGED_PAGES_MAGIC, PAGE_BITMAP_SIZE(pager->num_pages)};
+  if (write(fd, header, sizeof(header)) != sizeof(header) ||
+      write(fd, pager->changed_pages, header[1]) != header[1] ||
+      fsync(fd) == -1) {
+    printf("Error writing changed pages: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+/**
+ * Builds the path of a sidecar file that lives next to the database file.
+ * @param filename Name of the database file.
+ * @param suffix Suffix identifying the sidecar.
+ * @return Newly allocated path, owned by the caller.
+ */
+
+char* sidecar_path(const char* filename, const char* suffix) {
+  char* path = malloc(strlen(filename) + strlen(suffix) + 1);
+  strcpy(path, filename);
+  strcat(path, suffix);
+  return path;
+}
+
+/**
+ * Returns the time on a clock that never jumps, in microseconds. Durations,
+ * deadlines and the replication lag are measured on it; replicas share the
+ * primary's host, and so its clock.
+ * @return Microseconds since an arbitrary point, such as boot.
+ */
+
+uint64_t now_microseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Returns the CPU time used by the calling thread in microseconds.
+ * @return Microseconds of CPU time.
+ */
+
+uint64_t thread_cpu_microseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Starts a new generation of the replication log, discarding all records.
+ * Only valid when the database file itself holds every committed change.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void log_reset(Pager* pager) {
+  LogFileHeader header;
+  header.magic = LOG_FILE_MAGIC;
+  header.reserved = 0;
+  // Generations must differ across reboots too, so they come from the wall clock
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  header.generation = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  if (header.generation <= pager->log_generation) {
+    header.generation = pager->log_generation + 1;
+  }
+
+  if (ftruncate(pager->log_fd, 0) == -1 ||
+      pwrite(pager->log_fd, &header, sizeof(header), 0) != sizeof(header)) {
+    printf("Error resetting replication log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->log_generation = header.generation;
+  pager->log_sequence = 0;
+  pager->log_offset = sizeof(header);
+}
+
+/**
+ * Opens the replication log of a primary and starts a new generation.
+ * Records left by an earlier run may describe commits that never reached the
+ * database file (the process died before flushing), so they are discarded.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void log_open(Pager* pager) {
+  pager->log_fd = open(pager->log_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (pager->log_fd == -1) {
+    printf("Unable to open replication log\n");
+    exit(EXIT_FAILURE);
+  }
+  // Make sure the new generation differs from the one replicas may be following
+  LogFileHeader old_header;
+  pager->log_generation = 0;
+  if (pread(pager->log_fd, &old_header, sizeof(old_header), 0) == sizeof(old_header) &&
+      old_header.magic == LOG_FILE_MAGIC) {
+    pager->log_generation = old_header.generation;
+  }
+  log_reset(pager);
+}
+
+/**
+ * Computes the checksum protecting a shadow header (FNV-1a over its contents).
+ * @param header Pointer to the header.
+ * @return The checksum of every byte after the checksum field.
+ */
+
+uint32_t shadow_header_checksum(ShadowHeader* header) {
+  uint8_t* bytes = (uint8_t*)&header->generation;
+  size_t length = sizeof(ShadowHeader) - offsetof(ShadowHeader, generation);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Rebuilds the set of file slots that must not be overwritten: the header
+ * slots and every slot used by the last two commits.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void shadow_rebuild_slots_in_use(Pager* pager) {
+  memset(pager->slots_in_use, 0, SHADOW_SLOT_BITMAP_SIZE);
+  for (uint32_t slot = 0; slot < SHADOW_HEADER_SLOTS; slot++) {
+    bitmap_set(pager->slots_in_use, slot);
+  }
+  for (uint32_t i = 0; i < SHADOW_MAX_PAGES; i++) {
+    if (pager->page_map[i] != INVALID_PAGE_NUM) {
+      bitmap_set(pager->slots_in_use, pager->page_map[i]);
+    }
+    if (pager->previous_page_map[i] != INVALID_PAGE_NUM) {
+      bitmap_set(pager->slots_in_use, pager->previous_page_map[i]);
+    }
+  }
+}
+
+/**
+ * Loads the newest valid header of a shadow-paged file.
+ * @param pager Pointer to the Pager structure.
+ * @return True if a valid header was found.
+ */
+
+bool shadow_load_header(Pager* pager) {
+  ShadowHeader* newest = NULL;
+  ShadowHeader headers[SHADOW_HEADER_SLOTS];
+  for (uint32_t slot = 0; slot < SHADOW_HEADER_SLOTS; slot++) {
+    ShadowHeader* header = &headers[slot];
+    if (pread(pager->file_descriptor, header, sizeof(ShadowHeader),
+              (off_t)slot * PAGE_SIZE) != sizeof(ShadowHeader) ||
+        header->magic != SHADOW_MAGIC ||
+        header->checksum != shadow_header_checksum(header)) {
+      continue;  // Never written, or torn by a crash during the commit
+    }
+    if (newest == NULL || header->generation > newest->generation) {
+      newest = header;
+    }
+  }
+  if (newest == NULL || newest->num_pages > SHADOW_MAX_PAGES) {
+    return false;
+  }
+  for (uint32_t i = 0; i < SHADOW_MAX_PAGES; i++) {
+    if (newest->page_map[i] != INVALID_PAGE_NUM && newest->page_map[i] >= SHADOW_MAX_SLOTS) {
+      return false;
+    }
+  }
+
+  pager->shadow_generation = newest->generation;
+  pager->num_pages = newest->num_pages;
+  memcpy(pager->page_map, newest->page_map, sizeof(pager->page_map));
+  memcpy(pager->previous_page_map, newest->page_map, sizeof(pager->page_map));
+  memcpy(pager->changed_pages, newest->changed_pages, sizeof(newest->changed_pages));
+  shadow_rebuild_slots_in_use(pager);
+  return true;
+}
+
+/**
+ * Publishes a new shadow header in the slot not holding the current one, and
+ * syncs it. Until this returns the previous commit remains the valid one.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void shadow_write_header(Pager* pager) {
+  ShadowHeader* header = calloc(1, PAGE_SIZE);
+  header->magic = SHADOW_MAGIC;
+  header->generation = pager->shadow_generation + 1;
+  header->num_pages = pager->num_pages;
+  memcpy(header->page_map, pager->page_map, sizeof(pager->page_map));
+  memcpy(header->changed_pages, pager->changed_pages, sizeof(header->changed_pages));
+  header->checksum = shadow_header_checksum(header);
+
+  off_t offset = (off_t)(header->generation % SHADOW_HEADER_SLOTS) * PAGE_SIZE;
+  if (pwrite(pager->file_descriptor, header, PAGE_SIZE, offset) != PAGE_SIZE ||
+      fsync(pager->file_descriptor) == -1) {
+    printf("Error writing shadow header: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->shadow_generation = header->generation;
+  free(header);
+}
+
+/**
+ * Makes the pages modified since the last commit durable without touching the
+ * pages the previous commit points at. Each modified page goes to a free slot,
+ * the data is synced once, and the new page map is published by one header
+ * write. Slots that only the commit before the previous one used become free
+ * again, so readers still holding the previous header keep a consistent tree.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void shadow_commit(Pager* pager) {
+  uint32_t new_map[SHADOW_MAX_PAGES];
+  memcpy(new_map, pager->page_map, sizeof(new_map));
+
+  uint32_t slot = SHADOW_HEADER_SLOTS;
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (!bitmap_test(pager->commit_pages, i)) {
+      continue;
+    }
+    // Take the lowest slot no reader can be looking at
+    while (slot < SHADOW_MAX_SLOTS && bitmap_test(pager->slots_in_use, slot)) {
+      slot++;
+    }
+    if (slot == SHADOW_MAX_SLOTS) {
+      printf("No free shadow slot. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (pwrite(pager->file_descriptor, pager->pages[i], PAGE_SIZE,
+               (off_t)slot * PAGE_SIZE) != PAGE_SIZE) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    bitmap_set(pager->slots_in_use, slot);
+    bitmap_clear(pager->dirty_pages, i);
+    new_map[i] = slot;
+  }
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(pager->previous_page_map, pager->page_map, sizeof(new_map));
+  memcpy(pager->page_map, new_map, sizeof(new_map));
+  shadow_write_header(pager);
+  shadow_rebuild_slots_in_use(pager);
+  pager->file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+}
+
+void pager_set_durability(Pager* pager, DurabilityMode mode);
+
+/**
+ * Opens the database file and initializes a Pager structure.
+ * Opening stays lazy: no pages are read here, only readahead is requested for
+ * the pages that were hot when the database was last closed.
+ * @param filename Name of the database file to open.
+ * @param options How to open the file.
+ * @return Pointer to the initialized Pager structure.
+ */
+
+Pager* pager_open(const char* filename, PagerOptions* options) {
+  bool is_replica = options->is_replica;
+// Open the database file with read/write permissions; create if it doesn't exist
+  int fd = open(filename,
+                is_replica ? O_RDONLY :  // Replicas never write the primary's file
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+  // Determine the length of the file
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  // Allocate and initialize the Pager structure
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->path = sidecar_path(filename, "");
+  pager->checkpoint_path = sidecar_path(filename, CHECKPOINT_SUFFIX);
+  if (!is_replica) {
+    // A copy left by a crashed checkpoint was never renamed over the file
+    unlink(pager->checkpoint_path);
+  }
+  pager->file_length = file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+  // Check for file corruption: file length should be a multiple of PAGE_SIZE
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (file_length / PAGE_SIZE > TABLE_MAX_PAGES) {
+    printf("Db file is larger than %d pages.\n", TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+  // Start the per-page arrays empty, with room for the pages in the file
+  pager->max_pages = TABLE_MAX_PAGES;
+  pager->page_capacity = 0;
+  pager->pages = NULL;
+  pager->changed_pages = NULL;
+  pager->backup_pages = NULL;
+  pager->commit_pages = NULL;
+  pager->summarized_pages = NULL;
+  pager->leaf_summaries = NULL;
+  pager->dirty_pages = NULL;
+  pager->spilled_pages = NULL;
+  pager->cache.list = NULL;
+  pager->cache.prev = NULL;
+  pager->cache.next = NULL;
+  memset(&pager->undo, 0, sizeof(pager->undo));
+  pager_grow(pager, pager->num_pages > PAGER_INITIAL_PAGES ? pager->num_pages : PAGER_INITIAL_PAGES);
+  pager->backup_pid = 0;
+  pager->is_replica = is_replica;
+  pager->durability = options->durability;
+  pager->statement_changed = false;
+  pthread_mutex_init(&pager->commit_lock, NULL);
+  // The flusher's deadlines are on the monotonic clock of now_microseconds
+  pthread_condattr_t commit_cond_attr;
+  pthread_condattr_init(&commit_cond_attr);
+  pthread_condattr_setclock(&commit_cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pager->commit_cond, &commit_cond_attr);
+  pthread_condattr_destroy(&commit_cond_attr);
+  pthread_cond_init(&pager->latch_cond, NULL);
+  pager->has_flusher = false;
+  pager->stop_flusher = false;
+  pager->connections = 1;  // The REPL
+  pager->latch_waiters = 0;
+  pager->latch_acquisitions = 0;
+  pager->latch_readers = 0;
+  pager->latch_writers = 0;
+  pager->pages_evicted = 0;
+  pager->cache.policy = options->cache_policy;
+  pager->cache.capacity = options->cache_pages;
+  pager->cache.pin_internal = options->pin_internal;
+  pager->cache.next_trim = 0;
+  pager->cache.drain_wanted = false;
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&pager->cache.shards[i].latch, NULL);
+    pager->cache.shards[i].num_retired = 0;
+    pager->cache.shards[i].counts = (PageCacheCounts){0, 0, 0};
+  }
+  pager_reset_cache(pager, false);
+  pager->commit_waiters = 0;
+  pager->commits_requested = 0;
+  pager->commits_durable = 0;
+  pager->flushes = 0;
+  memset(pager->commit_stats, 0, sizeof(pager->commit_stats));
+  pager->log_path = sidecar_path(filename, LOG_SUFFIX);
+  if (is_replica) {
+    // Opened by replica_catch_up once the primary has created it
+    pager->log_fd = -1;
+    pager->log_generation = 0;
+    pager->log_sequence = 0;
+    pager->log_offset = 0;
+    pager->log_applied_time = 0;
+  } else {
+    log_open(pager);
+  }
+  pager->changed_pages_path = sidecar_path(filename, CHANGED_PAGES_SUFFIX);
+  // A shadow-paged file starts with its header slots, which no tree page can look like
+  pager->is_shadow = file_length == 0 && options->shadow_paging && !is_replica;
+  for (uint32_t slot = 0; slot < SHADOW_HEADER_SLOTS; slot++) {
+    uint32_t magic = 0;
+    if (pread(fd, &magic, sizeof(magic), (off_t)slot * PAGE_SIZE) == sizeof(magic) &&
+        magic == SHADOW_MAGIC) {
+      pager->is_shadow = true;
+    }
+  }
+  if (options->shadow_paging && !pager->is_shadow) {
+    printf("Database file is not shadow-paged.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pager->is_shadow) {
+    // The header maps every page, which bounds the file
+    pager->max_pages = SHADOW_MAX_PAGES;
+    pager_grow(pager, SHADOW_MAX_PAGES);
+    pager->shadow_generation = 0;
+    pager->num_pages = 0;
+    for (uint32_t i = 0; i < SHADOW_MAX_PAGES; i++) {
+      pager->page_map[i] = INVALID_PAGE_NUM;
+      pager->previous_page_map[i] = INVALID_PAGE_NUM;
+    }
+    shadow_rebuild_slots_in_use(pager);
+    if (file_length == 0) {
+      shadow_write_header(pager);  // Marks the new file as shadow-paged
+    } else if (!shadow_load_header(pager)) {
+      printf("No valid shadow header. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    pager_set_durability(pager, options->durability);
+  } else {
+    // The shadow header holds the bitmap of a shadow-paged file
+    pager_load_changed_pages(pager);
+  }
+  // The spill file is created by the first page spilled. One left by a crash
+  // holds nothing the file or the log needs.
+  pager->spill_path = sidecar_path(filename, SPILL_SUFFIX);
+  pager->spill_fd = -1;
+  pager->spill_failed = false;
+  if (!is_replica) {
+    truncate(pager->spill_path, 0);
+  }
+  // Start warming the cache in the background
+  pager->hot_pages_path = sidecar_path(filename, HOT_PAGES_SUFFIX);
+  pager->pages_prefetched = 0;
+  pager_prefetch_hot_pages(pager);
+
+  return pager;
+}
+
+void pager_wait_backup(Pager* pager);
+
+/**
+ * Syncs the directory holding a file, so a rename within it survives a crash.
+ * @param path Path of the file.
+ * @return True if the directory was synced.
+ */
+
+bool fsync_parent_directory(const char* path) {
+  char* directory = sidecar_path(path, "");
+  char* slash = strrchr(directory, '/');
+  if (slash == NULL) {
+    strcpy(directory, ".");
+  } else if (slash == directory) {
+    slash[1] = '\0';  // The file is in the root directory
+  } else {
+    *slash = '\0';
+  }
+  int fd = open(directory, O_RDONLY);
+  free(directory);
+  if (fd == -1) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+}
+
+/**
+ * Writes the latest version of every page into a copy of the database file,
+ * then renames the copy over the file. No page is overwritten in place, so a
+ * crash leaves either the old file or the new one, never a mix of both, and a
+ * replica that has not seen the checkpoint yet keeps reading the old file
+ * through its descriptor until it reloads.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void pager_replace_file(Pager* pager) {
+  int fd = open(pager->checkpoint_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to open checkpoint file\n");
+    exit(EXIT_FAILURE);
+  }
+  void* buffer = pager_allocate_page();
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    // A cached page is the latest version; otherwise the spill file or the
+    // old file holds it, and a page never written yet is all zeros
+    void* page = pager->pages[i];
+    if (page == NULL) {
+      page = buffer;
+      ssize_t bytes_read = pager_read_page(pager, i, buffer);
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      memset((char*)buffer + bytes_read, 0, PAGE_SIZE - bytes_read);
+    }
+    if (pwrite(fd, page, PAGE_SIZE, (off_t)i * PAGE_SIZE) != PAGE_SIZE) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(buffer);
+  if (fsync(fd) == -1 || rename(pager->checkpoint_path, pager->path) == -1 ||
+      !fsync_parent_directory(pager->path)) {
+    printf("Error replacing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  close(pager->file_descriptor);
+  pager->file_descriptor = fd;
+  pager->file_length = (off_t)pager->num_pages * PAGE_SIZE;
+  memset(pager->dirty_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  memset(pager->spilled_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+}
+
+/**
+ * Writes every committed change into the database file, then starts a new
+ * generation of the replication log, so the log only holds the commits since
+ * the last checkpoint. Replicas see the new generation and restart from the
+ * new file. A shadow-paged file already holds every commit made durable. The
+ * warm-cache hints are refreshed too. Must be called with no other statement
+ * running.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void pager_checkpoint(Pager* pager) {
+  pager_save_hot_pages(pager);
+  if (!pager->is_shadow) {
+    // Let a running backup finish first, as it reads pages from the file
+    pager_wait_backup(pager);
+    pager_save_changed_pages(pager);
+    pager_replace_file(pager);
+  }
+  // Only now may replicas restart, from the new file
+  log_reset(pager);
+}
+
+/**
+ * Commits the pages modified since the last commit: in shadow paging mode they
+ * are made durable, and their images are appended to the replication log as one
+ * record. The record may cover several statements when their commits were
+ * deferred, so a replica always applies whole statements.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void pager_flush_commits(Pager* pager) {
+  if (pager->is_replica) {
+    return;
+  }
+  pager->statement_changed = false;
+  uint32_t page_count = 0;
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (bitmap_test(pager->commit_pages, i)) {
+      page_count++;
+    }
+  }
+  if (page_count == 0) {
+    return;  // Nothing changed, e.g. a rejected duplicate key
+  }
+  // In shadow paging mode the commit is durable before replicas hear of it
+  if (pager->is_shadow) {
+    shadow_commit(pager);
+  }
+
+  // Build the whole record so it reaches the log with a single write
+  size_t record_size = sizeof(LogCommitHeader) + page_count * LOG_ENTRY_SIZE;
+  void* record = malloc(record_size);
+  LogCommitHeader* header = record;
+  header->magic = LOG_COMMIT_MAGIC;
+  header->page_count = page_count;
+  header->generation = pager->log_generation;
+  header->sequence = pager->log_sequence + 1;
+  header->timestamp = now_microseconds();
+  header->num_pages = pager->num_pages;
+  header->reserved = 0;
+
+  void* entry = record + sizeof(LogCommitHeader);
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (bitmap_test(pager->commit_pages, i)) {
+      memcpy(entry, &i, sizeof(uint32_t));
+      memcpy(entry + sizeof(uint32_t), pager->pages[i], PAGE_SIZE);
+      entry += LOG_ENTRY_SIZE;
+    }
+  }
+
+  if (pwrite(pager->log_fd, record, record_size, pager->log_offset) != (ssize_t)record_size) {
+    printf("Error writing replication log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->log_offset += record_size;
+  pager->log_sequence = header->sequence;
+  memset(pager->commit_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  free(record);
+  if (pager->log_offset >= LOG_CHECKPOINT_SIZE &&
+      pager->log_offset >= pager->file_length / LOG_CHECKPOINT_FILE_DIVISOR) {
+    pager_checkpoint(pager);
+  }
+
+  // Every pending commit is durable now
+  uint64_t now = now_microseconds();
+  for (uint32_t mode = 0; mode < DURABILITY_MODES; mode++) {
+    CommitStats* stats = &pager->commit_stats[mode];
+    if (stats->pending == 0) {
+      continue;
+    }
+    stats->count += stats->pending;
+    stats->total_us += stats->pending * now - stats->pending_sum_us;
+    if (now - stats->pending_first_us > stats->max_us) {
+      stats->max_us = now - stats->pending_first_us;
+    }
+    stats->pending = 0;
+    stats->pending_sum_us = 0;
+  }
+  pager->commits_durable = pager->commits_requested;
+  if (pager->is_shadow) {
+    pager->flushes++;
+  }
+}
+
+/**
+ * Waits until no statement holds the statement latch shared. Readers arriving
+ * meanwhile wait for the caller. Must be called with commit_lock held, which
+ * the wait releases.
+ * @param pager Pointer to the Pager structure.
+ * @return True if there were readers to wait for.
+ */
+
+bool pager_wait_readers(Pager* pager) {
+  if (pager->latch_readers == 0) {
+    return false;
+  }
+  pager->latch_writers++;
+  while (pager->latch_readers > 0) {
+    pthread_cond_wait(&pager->latch_cond, &pager->commit_lock);
+  }
+  pager->latch_writers--;
+  if (pager->latch_writers == 0) {
+    // Waiting readers go on to wait for commit_lock
+    pthread_cond_broadcast(&pager->latch_cond);
+  }
+  return true;
+}
+
+/**
+ * Runs in the background, syncing deferred commits. A group commit is synced
+ * once every connection is waiting for it or the oldest one has waited
+ * GROUP_COMMIT_MAX_WAIT_US. Asynchronous commits are synced once the oldest is
+ * ASYNC_COMMIT_MAX_DELAY_US old.
+ * @param arg Pointer to the Pager structure of the primary.
+ * @return Always NULL.
+ */
+
+void* pager_flusher(void* arg) {
+  Pager* pager = arg;
+  pthread_mutex_lock(&pager->commit_lock);
+  while (!pager->stop_flusher) {
+    if (pager->commits_durable == pager->commits_requested) {
+      pthread_cond_wait(&pager->commit_cond, &pager->commit_lock);
+      continue;
+    }
+    // Sync when the oldest pending commit must not wait any longer
+    uint64_t deadline = UINT64_MAX;
+    const CommitStats* group = &pager->commit_stats[DURABILITY_GROUP];
+    const CommitStats* async = &pager->commit_stats[DURABILITY_ASYNC];
+    if (group->pending > 0) {
+      deadline = group->pending_first_us + GROUP_COMMIT_MAX_WAIT_US;
+      if (pager->commit_waiters >= pager->connections) {
+        deadline = 0;  // Nobody else can join
+      }
+    }
+    if (async->pending > 0 && async->pending_first_us + ASYNC_COMMIT_MAX_DELAY_US < deadline) {
+      deadline = async->pending_first_us + ASYNC_COMMIT_MAX_DELAY_US;
+    }
+    if (deadline != UINT64_MAX && now_microseconds() < deadline) {
+      struct timespec until = {deadline / 1000000, (deadline % 1000000) * 1000};
+      pthread_cond_timedwait(&pager->commit_cond, &pager->commit_lock, &until);
+      continue;
+    }
+    // The flush moves pages readers may be reading from the file
+    if (pager_wait_readers(pager)) {
+      continue;
+    }
+    pager_flush_commits(pager);
+    pthread_cond_broadcast(&pager->commit_cond);
+  }
+  pthread_mutex_unlock(&pager->commit_lock);
+  return NULL;
+}
+
+/**
+ * Commits the statement that just ran, in the current durability mode. Files
+ * without shadow paging are only made durable by .exit, so every commit there
+ * goes straight to the replication log. Must be called with commit_lock held.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void pager_commit(Pager* pager) {
+  if (pager->is_replica || !pager->statement_changed) {
+    return;  // Nothing changed, e.g. a rejected duplicate key
+  }
+  pager->statement_changed = false;
+  CommitStats* stats = &pager->commit_stats[pager->durability];
+  uint64_t now = now_microseconds();
+  if (stats->pending == 0) {
+    stats->pending_first_us = now;
+  }
+  stats->pending++;
+  stats->pending_sum_us += now;
+  uint64_t commit = ++pager->commits_requested;
+
+  if (!pager->is_shadow || pager->durability == DURABILITY_SYNC) {
+    pager_flush_commits(pager);
+    return;
+  }
+  pthread_cond_broadcast(&pager->commit_cond);
+  if (pager->durability == DURABILITY_GROUP) {
+    pager->commit_waiters++;
+    while (pager->commits_durable < commit) {
+      pthread_cond_wait(&pager->commit_cond, &pager->commit_lock);
+    }
+    pager->commit_waiters--;
+  }
+}
+
+/**
+ * Switches the durability mode of the following commits, starting the flusher
+ * thread the first time commits are deferred.
+ * @param pager Pointer to the Pager structure of the primary.
+ * @param mode The new durability mode.
+ */
+
+void pager_set_durability(Pager* pager, DurabilityMode mode) {
+  pager->durability = mode;
+  if (mode != DURABILITY_SYNC && !pager->has_flusher) {
+    if (pthread_create(&pager->flusher, NULL, pager_flusher, pager) != 0) {
+      printf("Error starting commit flusher.\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->has_flusher = true;
+  }
+}
+
+/**
+ * Stops the flusher thread, if any. Commits it had not synced yet stay pending.
+ * Must be called with commit_lock held.
+ * @param pager Pointer to the Pager structure of the primary.
+ */
+
+void pager_stop_flusher(Pager* pager) {
+  if (!pager->has_flusher) {
+    return;
+  }
+  pager->stop_flusher = true;
+  pthread_cond_broadcast(&pager->commit_cond);
+  pthread_mutex_unlock(&pager->commit_lock);
+  pthread_join(pager->flusher, NULL);
+  pthread_mutex_lock(&pager->commit_lock);
+  pager->has_flusher = false;
+}
+
+bool pager_backup_running(Pager* pager);
+
+/**
+ * Takes the statement latch exclusively, for a statement that may change
+ * pages: commit_lock, once the statements holding it shared are done. Counts
+ * the wait so that a long scan holding it knows to yield.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void statement_latch_lock(Pager* pager) {
+  __atomic_add_fetch(&pager->latch_waiters, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&pager->commit_lock);
+  pager_wait_readers(pager);
+  __atomic_sub_fetch(&pager->latch_waiters, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pager->latch_acquisitions, 1, __ATOMIC_RELEASE);
+  pager_backup_running(pager);  // Reaps a finished backup, so pages can be dropped again
+}
+
+/**
+ * Releases the statement latch taken exclusively.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void statement_latch_unlock(Pager* pager) {
+  pthread_mutex_unlock(&pager->commit_lock);
+}
+
+/**
+ * Takes the statement latch shared, for a statement that only reads pages.
+ * Readers run alongside each other without holding commit_lock; one arriving
+ * while a writer waits for them lets the writer go first.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void statement_latch_lock_shared(Pager* pager) {
+  __atomic_add_fetch(&pager->latch_waiters, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&pager->commit_lock);
+  while (pager->latch_writers > 0 || pager->cache.drain_wanted) {
+    pthread_cond_wait(&pager->latch_cond, &pager->commit_lock);
+  }
+  pager->latch_readers++;
+  __atomic_sub_fetch(&pager->latch_waiters, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pager->latch_acquisitions, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pager->commit_lock);
+}
+
+/**
+ * Releases the statement latch taken shared. The last reader out frees the
+ * pages dropped while they read, and lets the writers waiting go.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void statement_latch_unlock_shared(Pager* pager) {
+  pthread_mutex_lock(&pager->commit_lock);
+  pager->latch_readers--;
+  if (pager->latch_readers == 0) {
+    pager_free_retired(pager);
+    pager_backup_running(pager);
+    pthread_cond_broadcast(&pager->latch_cond);
+  }
+  pthread_mutex_unlock(&pager->commit_lock);
+}
+
+/**
+ * Lets the statements waiting for the latch run, if any, and takes it back.
+ * The caller must not keep pointers into pages across the call. A reader only
+ * steps aside for writers, or for retired pages waiting to be freed. A mutex
+ * may hand itself straight back to the thread releasing it, so a writer waits
+ * until another statement has actually taken the latch.
+ * @param pager Pointer to the Pager structure.
+ * @param shared True if the caller holds the latch shared.
+ * @return True if the latch was released meanwhile.
+ */
+
+bool statement_latch_yield(Pager* pager, bool shared) {
+  if (shared) {
+    if (__atomic_load_n(&pager->latch_writers, __ATOMIC_RELAXED) == 0 &&
+        !__atomic_load_n(&pager->cache.drain_wanted, __ATOMIC_RELAXED)) {
+      return false;
+    }
+    statement_latch_unlock_shared(pager);
+    statement_latch_lock_shared(pager);
+    return true;
+  }
+  if (__atomic_load_n(&pager->latch_waiters, __ATOMIC_RELAXED) == 0) {
+    return false;
+  }
+  uint64_t acquisitions = __atomic_load_n(&pager->latch_acquisitions, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&pager->commit_lock);
+  while (__atomic_load_n(&pager->latch_acquisitions, __ATOMIC_ACQUIRE) == acquisitions &&
+         __atomic_load_n(&pager->latch_waiters, __ATOMIC_RELAXED) > 0) {
+    sched_yield();
+  }
+  statement_latch_lock(pager);
+  return true;
+}
+
+/**
+ * Prints the current durability mode and the commit latencies of each mode.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void print_durability_status(Pager* pager) {
+  printf("Durability: %s\n", DURABILITY_MODE_NAMES[pager->durability]);
+  for (uint32_t mode = 0; mode < DURABILITY_MODES; mode++) {
+    const CommitStats* stats = &pager->commit_stats[mode];
+    printf("%s: %llu commits, avg %llu us, max %llu us, %u pending\n",
+           DURABILITY_MODE_NAMES[mode], (unsigned long long)stats->count,
+           (unsigned long long)(stats->count ? stats->total_us / stats->count : 0),
+           (unsigned long long)stats->max_us, stats->pending);
+  }
+  printf("Syncs: %llu\n", (unsigned long long)pager->flushes);
+}
+
+/**
+ * Drops a replica's cache and restarts it from the database file, at the start
+ * of a new log generation.
+ * @param pager Pointer to the Pager structure of the replica.
+ * @param generation The log generation to follow from now on.
+ */
+
+void replica_reload(Pager* pager, uint64_t generation) {
+  for (uint32_t i = 0; i < pager->page_capacity; i++) {
+    free(pager->pages[i]);
+    pager->pages[i] = NULL;
+  }
+  pager_reset_cache(pager, false);
+  memset(pager->summarized_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  // The checkpoint that started the generation renamed a new file into place;
+  // the old descriptor still reads the file as it was before
+  int fd = open(pager->path, O_RDONLY);
+  if (fd != -1) {
+    close(pager->file_descriptor);
+    pager->file_descriptor = fd;
+  }
+  off_t file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+  pager->file_length = file_length;
+  pager->num_pages = file_length / PAGE_SIZE;
+  pager_grow(pager, pager->num_pages);
+  if (pager->is_shadow) {
+    shadow_load_header(pager);
+  }
+  pager->log_generation = generation;
+  pager->log_sequence = 0;
+  pager->log_offset = sizeof(LogFileHeader);
+}
+
+/**
+ * Applies every complete commit record the primary has appended since the last
+ * call. Each record replaces whole pages in the cache, so pages changed during
+ * the current generation are always served from the log, never from a database
+ * file the primary may be rewriting. A record still being written is left for
+ * the next call.
+ * @param pager Pointer to the Pager structure of the replica.
+ */
+
+void replica_catch_up(Pager* pager) {
+  if (pager->log_fd == -1) {
+    pager->log_fd = open(pager->log_path, O_RDONLY);
+  }
+  LogFileHeader file_header;
+  if (pager->log_fd != -1 &&
+      pread(pager->log_fd, &file_header, sizeof(file_header), 0) == sizeof(file_header) &&
+      file_header.magic == LOG_FILE_MAGIC) {
+    if (file_header.generation != pager->log_generation) {
+      replica_reload(pager, file_header.generation);
+    }
+
+    LogCommitHeader header;
+    while (pread(pager->log_fd, &header, sizeof(header), pager->log_offset) == sizeof(header)) {
+      if (header.magic != LOG_COMMIT_MAGIC || header.generation != pager->log_generation) {
+        break;  // The primary reset the log; the next call reloads
+      }
+      if (header.page_count > pager->max_pages || header.num_pages > pager->max_pages) {
+        break;  // A corrupt record: nothing past it can be applied
+      }
+      size_t body_size = header.page_count * LOG_ENTRY_SIZE;
+      void* body = malloc(body_size);
+      if (pread(pager->log_fd, body, body_size, pager->log_offset + sizeof(header)) !=
+          (ssize_t)body_size) {
+        free(body);
+        break;  // The primary is still writing this record
+      }
+      bool valid = true;
+      for (uint32_t i = 0; i < header.page_count && valid; i++) {
+        uint32_t page_num;
+        memcpy(&page_num, body + i * LOG_ENTRY_SIZE, sizeof(uint32_t));
+        valid = page_num < header.num_pages;
+      }
+      if (!valid) {
+        free(body);
+        break;  // A corrupt record: apply none of it, nor anything past it
+      }
+
+      pager_grow(pager, header.num_pages);
+      for (uint32_t i = 0; i < header.page_count; i++) {
+        void* entry = body + i * LOG_ENTRY_SIZE;
+        uint32_t page_num;
+        memcpy(&page_num, entry, sizeof(uint32_t));
+        if (pager->pages[page_num] == NULL) {
+          pager->pages[page_num] = pager_allocate_page();
+        }
+        memcpy(pager->pages[page_num], entry + sizeof(uint32_t), PAGE_SIZE);
+        bitmap_clear(pager->summarized_pages, page_num);
+      }
+      free(body);
+
+      pager->num_pages = header.num_pages;
+      pager->log_offset += sizeof(header) + body_size;
+      pager->log_sequence = header.sequence;
+      pager->log_applied_time = header.timestamp;
+    }
+  }
+
+  if (pager->num_pages == 0) {
+    // The primary has not created the root yet; serve an empty table meanwhile
+    void* root_node = get_page(pager, 0);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+  }
+}
+
+/**
+ * Prints replication status. A replica reports how far behind the primary it
+ * is: the commits appended to the log that it has not applied yet, and how long
+ * ago the oldest of them was committed.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void print_replication_status(Pager* pager) {
+  if (!pager->is_replica) {
+    printf("Primary at commit %llu.\n", (unsigned long long)pager->log_sequence);
+    return;
+  }
+
+  uint32_t pending_commits = 0;
+  uint64_t oldest_pending_time = 0;
+  off_t offset = pager->log_offset;
+  LogCommitHeader header;
+  while (pager->log_fd != -1 &&
+         pread(pager->log_fd, &header, sizeof(header), offset) == sizeof(header) &&
+         header.magic == LOG_COMMIT_MAGIC && header.generation == pager->log_generation) {
+    if (pending_commits == 0) {
+      oldest_pending_time = header.timestamp;
+    }
+    pending_commits++;
+    offset += sizeof(header) + header.page_count * LOG_ENTRY_SIZE;
+  }
+
+  uint64_t lag_ms = 0;
+  if (pending_commits > 0) {
+    lag_ms = (now_microseconds() - oldest_pending_time) / 1000;
+  }
+  printf("Replica at commit %llu, lag %d commits (%llu ms).\n",
+         (unsigned long long)pager->log_sequence, pending_commits,
+         (unsigned long long)lag_ms);
+}
+
+void dictionary_load(Table* table);
+void dictionary_free(Dictionary* dictionary);
+
+/**
+ * Tells whether a file's header page names the format this build reads.
+ * @param pager Pointer to the Pager structure.
+ * @return False for a file of another version, or of none.
+ */
+
+bool file_header_valid(Pager* pager) {
+  if (pager->num_pages <= FILE_HEADER_PAGE_NUM) {
+    return false;
+  }
+  FileHeader* file_header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  return file_header->magic == FILE_HEADER_MAGIC &&
+         file_header->format_version == FILE_FORMAT_VERSION && file_header->fill_factor >= 1 &&
+         file_header->fill_factor <= 100;
+}
+
+void leaf_summary_build(Table* table, uint32_t page_num, void* node);
+
+/**
+ * Summarizes every leaf, following the leaf chain, so that filtered scans can
+ * skip leaves from the first statement on. Leaves not cached yet are read into
+ * a buffer of the walk's own, so opening the table leaves the cache as it was.
+ * @param table Pointer to the Table structure.
+ */
+
+void table_summarize_leaves(Table* table) {
+  Pager* pager = table->pager;
+  Cursor* cursor = table_start(table);
+  uint32_t page_num = cursor->page_num;
+  free(cursor);
+  void* buffer = pager_allocate_page();
+  // A corrupt chain may loop: no table has more leaves than pages
+  for (uint32_t i = 0; i < pager->num_pages && page_num < pager->num_pages; i++) {
+    void* node = pager->pages[page_num];
+    if (node == NULL) {
+      if (pager_read_page(pager, page_num, buffer) != PAGE_SIZE) {
+        break;  // Left to be summarized when a scan reads it
+      }
+      node = buffer;
+    }
+    leaf_summary_build(table, page_num, node);
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0) {
+      break;
+    }
+  }
+  free(buffer);
+}
+
+/**
+ * Opens a database file and initializes a Table structure.
+ * @param filename Name of the database file to open.
+ * @param options How to open the file.
+ * @return Pointer to the initialized Table structure.
+ */
+
+Table* db_open(const char* filename, PagerOptions* options) {
+  // Open the pager for the database file
+  Pager* pager = pager_open(filename, options);
+  // Allocate and initialize the Table structure
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->root_page_num = 0;
+  memset(&table->dictionary, 0, sizeof(Dictionary));
+  table->split_policy = options->split_policy;
+  table->last_insert_page_num = INVALID_PAGE_NUM;
+  table->last_insert_cell_num = 0;
+  lock_manager_init(&table->locks);
+  memcpy(table->workloads, options->workloads, sizeof(table->workloads));
+
+  if (options->is_replica) {
+    replica_catch_up(pager);
+  } else if (pager->num_pages == 0) {
+    // New database file. Initialize page 0 as leaf node.
+    void* root_node = get_page(pager, 0);
+    pager_mark_dirty(pager, 0);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    // Page 1 names the format
+    FileHeader* file_header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+    file_header->magic = FILE_HEADER_MAGIC;
+    file_header->format_version = FILE_FORMAT_VERSION;
+    file_header->fill_factor = options->fill_factor != 0 ? options->fill_factor : 100;
+    // Page 2 starts the empty dictionary
+    void* dictionary_page = get_page(pager, DICTIONARY_PAGE_NUM);
+    pager_mark_dirty(pager, DICTIONARY_PAGE_NUM);
+    *overflow_page_next(dictionary_page) = INVALID_PAGE_NUM;
+    *overflow_page_used(dictionary_page) = 0;
+    pager_flush_commits(pager);
+  }
+  // A replica may open before the primary has created the file, and serves
+  // an empty root meanwhile
+  bool created = !options->is_replica || pager->num_pages > FILE_HEADER_PAGE_NUM;
+  if (created && !file_header_valid(pager)) {
+    printf("Db file is not in format version %d.\n", FILE_FORMAT_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  table->fill_factor = 100;
+  if (created) {
+    // A fill factor given when opening the file replaces the one it keeps
+    FileHeader* file_header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    if (options->fill_factor != 0 && options->fill_factor != file_header->fill_factor &&
+        !options->is_replica) {
+      pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+      file_header->fill_factor = options->fill_factor;
+      pager_flush_commits(pager);
+    }
+    table->fill_factor = file_header->fill_factor;
+    table_summarize_leaves(table);
+  }
+  dictionary_load(table);
+
+  return table;
+}
+
+#define MAX_QUERY_LEN 1024  // Define the maximum length for the query string
+
+/**
+ * Executes the Python script to convert natural language input to a database query.
+ * 
+ * @param user_input The natural language input from the user.
+ * @return A string containing the translated database query.
+ */
+char* get_db_query(const char* user_input) {
+    char command[MAX_QUERY_LEN];
+    sprintf(command, "python3 model_old/lora.py \"%s\"", user_input);
+    printf("Executing command: %s\n", command);  // Debug print
+
+    FILE* fp = popen(command, "r");
+    if (fp == NULL) {
+        printf("Failed to run command\n");
+        exit(1);
+    }
+
+    static char translated_query[MAX_QUERY_LEN];
+    if (fgets(translated_query, sizeof(translated_query), fp) == NULL) {
+        printf("Failed to read output\n");  // Debug print
+    }
+    printf("Script output before trimming: '%s'\n", translated_query);  // Debug print
+
+    // Trim newline character
+    char* newline = strchr(translated_query, '\n');
+    if (newline) {
+        *newline = '\0';  // Replace newline with null terminator
+    }
+
+    printf("Script output after trimming: '%s'\n", translated_query);  // Debug print
+
+    pclose(fp);
+    return translated_query;
+}
+
+/**
+ * Creates a new input buffer for user input.
+ * @return Pointer to the initialized InputBuffer structure.
+ */
+
+InputBuffer* new_input_buffer() {
+// Allocate and initialize the InputBuffer structure  
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+/**
+ * Prints the database prompt.
+ */
+
+void print_prompt() { printf("db > "); }
+
+/**
+ * Reads user input into an InputBuffer.
+ * @param input_buffer Pointer to the InputBuffer structure.
+ */
+
+void read_input(InputBuffer* input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+  // Error handling for getline failure
+  if (bytes_read <= 0) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Ignore trailing newline
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+/**
+ * Reads the next chunk of input in batch mode, after the unfinished line left
+ * by the previous one. A single read takes whatever is available, up to
+ * BATCH_CHUNK_SIZE bytes, so statements start running before the input ends.
+ * @param reader Pointer to the BatchReader.
+ * @return False once the input is exhausted and every line was returned.
+ */
+
+bool batch_fill(BatchReader* reader) {
+  if (reader->at_end) {
+    return false;
+  }
+  size_t remaining = reader->length - reader->position;
+  memmove(reader->data, reader->data + reader->position, remaining);
+  reader->length = remaining;
+  reader->position = 0;
+  if (reader->capacity < remaining + BATCH_CHUNK_SIZE) {
+    reader->capacity = remaining + BATCH_CHUNK_SIZE;  // A line longer than a chunk
+    reader->data = realloc(reader->data, reader->capacity);
+  }
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(STDIN_FILENO, reader->data + reader->length, BATCH_CHUNK_SIZE);
+  } while (bytes_read == -1 && errno == EINTR);
+  if (bytes_read == -1) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+  reader->length += bytes_read;
+  reader->at_end = bytes_read == 0;
+  return !reader->at_end || reader->length > 0;
+}
+
+/**
+ * Copies the next complete line of the chunk into an InputBuffer. At the end of
+ * the input a last line without a newline counts as complete.
+ * @param reader Pointer to the BatchReader.
+ * @param input_buffer Pointer to the InputBuffer receiving the line.
+ * @return False if the chunk holds no further complete line.
+ */
+
+bool batch_read_line(BatchReader* reader, InputBuffer* input_buffer) {
+  char* line = reader->data + reader->position;
+  size_t available = reader->length - reader->position;
+  char* newline = memchr(line, '\n', available);
+  if (newline == NULL && (!reader->at_end || available == 0)) {
+    return false;
+  }
+  size_t line_length = newline ? (size_t)(newline - line) : available;
+  if (input_buffer->buffer_length < line_length + 1) {
+    input_buffer->buffer_length = line_length + 1;
+    input_buffer->buffer = realloc(input_buffer->buffer, input_buffer->buffer_length);
+  }
+  memcpy(input_buffer->buffer, line, line_length);
+  input_buffer->buffer[line_length] = '\0';
+  input_buffer->input_length = line_length;
+  reader->position += newline ? line_length + 1 : line_length;
+  return true;
+}
+
+/**
+ * Closes and frees an InputBuffer.
+ * @param input_buffer Pointer to the InputBuffer structure to close.
+ */
+
+void close_input_buffer(InputBuffer* input_buffer) {
+  // Free the buffer and the InputBuffer structure itself
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+/**
+ * Records the end of a backup process.
+ * If the backup failed, the pages it was copying are marked as changed again so
+ * the next incremental backup picks them up.
+ * @param pager Pointer to the Pager structure.
+ * @param result What waitpid returned for the backup process.
+ * @param status Its exit status.
+ */
+
+void pager_end_backup(Pager* pager, pid_t result, int status) {
+  if (result == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    for (uint32_t i = 0; i < PAGE_BITMAP_SIZE(pager->page_capacity); i++) {
+      pager->changed_pages[i] |= pager->backup_pages[i];
+    }
+    printf("Backup failed.\n");
+  }
+  pager->backup_pid = 0;
+  memset(pager->backup_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+}
+
+/**
+ * Waits for the running backup, if any, to finish.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void pager_wait_backup(Pager* pager) {
+  if (pager->backup_pid == 0) {
+    return;
+  }
+  int status;
+  pid_t result = waitpid(pager->backup_pid, &status, 0);
+  pager_end_backup(pager, result, status);
+}
+
+/**
+ * Tells whether a backup is still running, reaping it if it is done.
+ * @param pager Pointer to the Pager structure.
+ * @return True if the backup process has not exited yet.
+ */
+
+bool pager_backup_running(Pager* pager) {
+  if (pager->backup_pid == 0) {
+    return false;
+  }
+  int status;
+  pid_t result = waitpid(pager->backup_pid, &status, WNOHANG);
+  if (result == 0) {
+    return true;
+  }
+  pager_end_backup(pager, result, status);
+  return false;
+}
+
+/**
+ * Copies pages into a backup file. Runs in the forked backup process, which sees
+ * the cache exactly as it was at fork time, while the parent keeps serving queries.
+ * Pages are written at their page number, so the backup of a shadow-paged file
+ * is a compact database that uses in-place writes. Only system calls are made:
+ * another thread, such as the commit flusher or a server worker, may have held
+ * the allocator's lock when the process forked, so the child must not allocate.
+ * @param pager Pointer to the Pager structure (the child's copy-on-write snapshot).
+ * @param backup_fd File descriptor of the backup file.
+ * @param incremental If true, only pages set in backup_pages are copied.
+ * @param buffer Page buffer allocated before the fork, for pages read from the file.
+ * @return True if every page was written and synced.
+ */
+
+bool pager_write_backup(Pager* pager, int backup_fd, bool incremental, void* buffer) {
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (incremental && !bitmap_test(pager->backup_pages, i)) {
+      continue;
+    }
+    void* page = pager->pages[i];
+    if (page == NULL) {
+      // Not cached, so the file still holds the current version of the page
+      if (pager_read_page(pager, i, buffer) == -1) {
+        return false;
+      }
+      page = buffer;
+    }
+    if (pwrite(backup_fd, page, PAGE_SIZE, (off_t)i * PAGE_SIZE) != PAGE_SIZE) {
+      return false;
+    }
+  }
+  return ftruncate(backup_fd, (off_t)pager->num_pages * PAGE_SIZE) == 0 &&
+         fsync(backup_fd) == 0;
+}
+
+/**
+ * Starts an online backup of the database into another file.
+ * The copy is made by a forked process, so the operating system's copy-on-write
+ * gives it a consistent snapshot of every cached page while statements keep
+ * running here. A full backup copies every page; an incremental one brings an
+ * earlier backup up to date by copying only pages changed since that backup.
+ * @param pager Pointer to the Pager structure.
+ * @param path Path of the backup file.
+ * @param incremental True to update an existing backup instead of making a new one.
+ */
+
+void pager_backup(Pager* pager, const char* path, bool incremental) {
+  // Backups are applied in order, so wait for the previous one
+  pager_wait_backup(pager);
+
+  int flags = incremental ? O_RDWR : (O_RDWR | O_CREAT | O_TRUNC);
+  int backup_fd = open(path, flags, S_IWUSR | S_IRUSR);
+  if (backup_fd == -1) {
+    printf("Unable to open backup file '%s'.\n", path);
+    return;
+  }
+
+  uint32_t num_pages_to_copy = 0;
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (!incremental || bitmap_test(pager->changed_pages, i)) {
+      num_pages_to_copy++;
+    }
+  }
+
+  // Hand the changed set to the backup and start tracking changes afresh
+  memcpy(pager->backup_pages, pager->changed_pages, PAGE_BITMAP_SIZE(pager->page_capacity));
+  void* buffer = pager_allocate_page();  // The child must not allocate
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    printf("Unable to start backup: %d\n", errno);
+    memset(pager->backup_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+    close(backup_fd);
+    free(buffer);
+    return;
+  }
+  if (pid == 0) {
+    _exit(pager_write_backup(pager, backup_fd, incremental, buffer) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  free(buffer);
+  close(backup_fd);
+  pager->backup_pid = pid;
+  memset(pager->changed_pages, 0, PAGE_BITMAP_SIZE(pager->page_capacity));
+  printf("Backing up %d pages.\n", num_pages_to_copy);
+}
+
+/**
+ * Closes the database, flushing all pages to disk.
+ * @param table Pointer to the Table structure.
+ */
+
+void db_close(Table* table) {
+  Pager* pager = table->pager;
+  // A replica owns none of the files, so it only releases its cache
+  if (!pager->is_replica) {
+    if (pager->is_shadow) {
+      // Statements commit as they run; sync the deferred ones, and the extra
+      // header persists changed_pages
+      pager_wait_backup(pager);
+      pager_stop_flusher(pager);
+      pager_flush_commits(pager);
+      shadow_write_header(pager);
+    }
+    // Write everything into the file, remembering the hot set before the
+    // cache is torn down, so replicas can restart from it
+    pager_checkpoint(pager);
+    if (pager->spill_fd != -1) {
+      close(pager->spill_fd);
+    }
+    unlink(pager->spill_path);
+  }
+  if (pager->log_fd != -1) {
+    close(pager->log_fd);
+  }
+  // Close the file descriptor
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < pager->page_capacity; i++) {
+    void* page = pager->pages[i];
+    if (page) {
+      free(page);
+      pager->pages[i] = NULL;
+    }
+  }
+  // Free the Pager and Table structures
+  dictionary_free(&table->dictionary);
+  free(pager->pages);
+  free(pager->changed_pages);
+  free(pager->backup_pages);
+  free(pager->commit_pages);
+  free(pager->summarized_pages);
+  free(pager->leaf_summaries);
+  free(pager->dirty_pages);
+  free(pager->spilled_pages);
+  free(pager->cache.list);
+  free(pager->cache.prev);
+  free(pager->cache.next);
+  free(pager->undo.commit_pages);
+  free(pager->undo.recorded);
+  free(pager->undo.changed);
+  free(pager->undo.images);
+  free(pager->hot_pages_path);
+  free(pager->changed_pages_path);
+  free(pager->log_path);
+  free(pager->spill_path);
+  free(pager->path);
+  free(pager->checkpoint_path);
+  free(pager);
+  free(table);
+}
+
+/**
+ * Encodes the integer values of a column chunk, run-length or frame of
+ * reference, whichever is smaller, and records their zone map.
+ * @param values The values.
+ * @param num_values Number of values, at least one.
+ * @param buffer Buffer receiving the encoded values.
+ * @param chunk Directory entry receiving the encoding and zone map.
+ * @return Number of bytes written to buffer.
+ */
+
+uint32_t columnar_encode_integers(int64_t* values, uint32_t num_values, uint8_t* buffer, ColumnChunk* chunk) {
+  int64_t min = values[0];
+  int64_t max = values[0];
+  uint32_t num_runs = 1;
+  for (uint32_t i = 1; i < num_values; i++) {
+    min = values[i] < min ? values[i] : min;
+    max = values[i] > max ? values[i] : max;
+    num_runs += values[i] != values[i - 1];
+  }
+  chunk->min = min;
+  chunk->max = max;
+
+  uint64_t range = (uint64_t)max - (uint64_t)min;
+  uint8_t width = range <= UINT8_MAX ? 1 : range <= UINT16_MAX ? 2 : range <= UINT32_MAX ? 4 : 8;
+  uint32_t rle_length = num_runs * (sizeof(int64_t) + sizeof(uint32_t));
+  uint32_t for_length = sizeof(int64_t) + 1 + num_values * width;
+  uint32_t length = 0;
+  if (rle_length < for_length) {
+    chunk->encoding = COLUMNAR_ENCODING_RLE;
+    for (uint32_t i = 0; i < num_values;) {
+      uint32_t run = 1;
+      while (i + run < num_values && values[i + run] == values[i]) {
+        run++;
+      }
+      memcpy(buffer + length, &values[i], sizeof(int64_t));
+      memcpy(buffer + length + sizeof(int64_t), &run, sizeof(uint32_t));
+      length += sizeof(int64_t) + sizeof(uint32_t);
+      i += run;
+    }
+  } else {
+    chunk->encoding = COLUMNAR_ENCODING_FOR;
+    memcpy(buffer, &min, sizeof(int64_t));
+    buffer[sizeof(int64_t)] = width;
+    length = sizeof(int64_t) + 1;
+    for (uint32_t i = 0; i < num_values; i++) {
+      uint64_t delta = (uint64_t)values[i] - (uint64_t)min;
+      for (uint8_t byte = 0; byte < width; byte++) {
+        buffer[length++] = delta >> (8 * byte);
+      }
+    }
+  }
+  return length;
+}
+
+/**
+ * Decodes the integer values of a column chunk, checking that the encoded
+ * values fit in chunk->length bytes.
+ * @param buffer The encoded values.
+ * @param chunk Directory entry of the chunk.
+ * @param values Array receiving chunk->num_values values.
+ * @return false if the chunk is malformed.
+ */
+
+bool columnar_decode_integers(uint8_t* buffer, ColumnChunk* chunk, int64_t* values) {
+  if (chunk->encoding == COLUMNAR_ENCODING_RLE) {
+    if (chunk->length % (sizeof(int64_t) + sizeof(uint32_t)) != 0) {
+      return false;
+    }
+    uint32_t count = 0;
+    for (uint32_t position = 0; position < chunk->length; position += sizeof(int64_t) + sizeof(uint32_t)) {
+      int64_t value;
+      uint32_t run;
+      memcpy(&value, buffer + position, sizeof(int64_t));
+      memcpy(&run, buffer + position + sizeof(int64_t), sizeof(uint32_t));
+      while (run-- > 0 && count < chunk->num_values) {
+        values[count++] = value;
+      }
+    }
+    return count == chunk->num_values;
+  } else {
+    if (chunk->length < sizeof(int64_t) + 1) {
+      return false;
+    }
+    int64_t min;
+    memcpy(&min, buffer, sizeof(int64_t));
+    uint8_t width = buffer[sizeof(int64_t)];
+    if (width > sizeof(int64_t) ||
+        chunk->length < sizeof(int64_t) + 1 + (uint64_t)chunk->num_values * width) {
+      return false;
+    }
+    uint8_t* data = buffer + sizeof(int64_t) + 1;
+    for (uint32_t i = 0; i < chunk->num_values; i++) {
+      uint64_t delta = 0;
+      for (uint8_t byte = 0; byte < width; byte++) {
+        delta |= (uint64_t)data[i * width + byte] << (8 * byte);
+      }
+      values[i] = (int64_t)((uint64_t)min + delta);
+    }
+    return true;
+  }
+}
+
+/**
+ * Writes a buffer at a given position of a file.
+ * @param fd The file descriptor.
+ * @param buffer The bytes to write.
+ * @param length Number of bytes to write.
+ * @param offset Position in the file.
+ * @return true if every byte was written.
+ */
+
+bool columnar_write(int fd, const void* buffer, uint32_t length, uint64_t offset) {
+  if (pwrite(fd, buffer, length, offset) != (ssize_t)length) {
+    printf("Error writing columnar file: %d\n", errno);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Writes the chunks of every column of a group of rows.
+ * @param fd The file descriptor of the columnar file.
+ * @param values Integer values of the rows, COLUMNAR_CHUNK_ROWS per column.
+ * @param emails Emails of the rows, up to their domain.
+ * @param num_rows Number of rows in the group.
+ * @param buffer Scratch buffer of COLUMNAR_CHUNK_BUFFER_SIZE bytes.
+ * @param chunks Directory entries of the group, one per column.
+ * @param offset Position of the end of the file, advanced past the chunks.
+ * @return true if the chunks were written.
+ */
+
+bool columnar_write_chunks(int fd, int64_t* values, char (*emails)[COLUMN_EMAIL_SIZE + 1], uint32_t num_rows,
+                           uint8_t* buffer, ColumnChunk* chunks, uint64_t* offset) {
+  for (uint32_t column = 0; column < COLUMNAR_NUM_COLUMNS; column++) {
+    ColumnChunk* chunk = &chunks[column];
+    uint32_t length = 0;
+    if (column == COLUMNAR_EMAIL) {
+      chunk->encoding = COLUMNAR_ENCODING_PLAIN;
+      chunk->min = 0;
+      chunk->max = 0;
+      for (uint32_t i = 0; i < num_rows; i++) {
+        uint8_t email_length = strlen(emails[i]);
+        buffer[length] = email_length;
+        memcpy(buffer + length + 1, emails[i], email_length);
+        length += 1 + email_length;
+      }
+    } else {
+      length = columnar_encode_integers(values + column * COLUMNAR_CHUNK_ROWS, num_rows, buffer, chunk);
+    }
+    chunk->offset = *offset;
+    chunk->length = length;
+    chunk->num_values = num_rows;
+    if (!columnar_write(fd, buffer, length, *offset)) {
+      return false;
+    }
+    *offset += length;
+  }
+  return true;
+}
+
+void dictionary_decode_local(Dictionary* dictionary, Row* row);
+
+/**
+ * Exports the table to a columnar snapshot file for analytic scans.
+ * The dictionary-encoded columns keep their codes, so the snapshot carries a
+ * copy of the dictionary. Payloads are not exported.
+ * @param table Pointer to the Table structure.
+ * @param path Path of the file to write.
+ */
+
+void columnar_export(Table* table, const char* path) {
+  if (table->pager->is_replica) {
+    replica_catch_up(table->pager);
+    dictionary_load(table);
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to open columnar file '%s'.\n", path);
+    return;
+  }
+
+  ColumnarHeader header;
+  memset(&header, 0, sizeof(ColumnarHeader));
+  memcpy(header.magic, COLUMNAR_MAGIC, sizeof(header.magic));
+  uint64_t offset = sizeof(ColumnarHeader);
+  int64_t* values = malloc(COLUMNAR_NUM_COLUMNS * COLUMNAR_CHUNK_ROWS * sizeof(int64_t));
+  char (*emails)[COLUMN_EMAIL_SIZE + 1] = malloc(COLUMNAR_CHUNK_ROWS * (COLUMN_EMAIL_SIZE + 1));
+  uint8_t* buffer = malloc(COLUMNAR_CHUNK_BUFFER_SIZE);
+  ColumnChunk* directory = NULL;
+  bool ok = true;
+
+  // Gather the rows in key order, writing the columns of every full chunk
+  Cursor* cursor = table_start(table);
+  Row row;
+  uint32_t num_rows = 0;
+  while (ok && (!cursor->end_of_table || num_rows > 0)) {
+    if (!cursor->end_of_table) {
+      deserialize_row(cursor_value(cursor), &row);
+      values[COLUMNAR_TENANT * COLUMNAR_CHUNK_ROWS + num_rows] = row.tenant_id;
+      values[COLUMNAR_ID * COLUMNAR_CHUNK_ROWS + num_rows] = row.id;
+      values[COLUMNAR_USERNAME * COLUMNAR_CHUNK_ROWS + num_rows] = row.username_code;
+      values[COLUMNAR_DOMAIN * COLUMNAR_CHUNK_ROWS + num_rows] = row.domain_code;
+      dictionary_decode_local(&table->dictionary, &row);
+      strcpy(emails[num_rows], row.email);
+      num_rows++;
+      cursor_advance(cursor);
+    }
+    if (num_rows == COLUMNAR_CHUNK_ROWS || (cursor->end_of_table && num_rows > 0)) {
+      directory = realloc(directory, (header.num_chunks + 1) * COLUMNAR_NUM_COLUMNS * sizeof(ColumnChunk));
+      ok = columnar_write_chunks(fd, values, emails, num_rows, buffer,
+                                 &directory[header.num_chunks * COLUMNAR_NUM_COLUMNS], &offset);
+      header.num_rows += num_rows;
+      header.num_chunks++;
+      num_rows = 0;
+    }
+  }
+  free(cursor);
+
+  // Then the dictionary, the directory and finally the header
+  Dictionary* dictionary = &table->dictionary;
+  header.dictionary_offset = offset;
+  header.num_dictionary_entries = dictionary->num_entries;
+  for (uint32_t code = 0; ok && code < dictionary->num_entries; code++) {
+    uint8_t length = strlen(dictionary->entries[code]);
+    ok = columnar_write(fd, &length, 1, offset) &&
+         columnar_write(fd, dictionary->entries[code], length, offset + 1);
+    offset += 1 + length;
+  }
+  header.directory_offset = offset;
+  ok = ok && columnar_write(fd, directory, header.num_chunks * COLUMNAR_NUM_COLUMNS * sizeof(ColumnChunk), offset);
+  ok = ok && columnar_write(fd, &header, sizeof(ColumnarHeader), 0);
+  if (ok) {
+    printf("Exported %d rows in %d chunks.\n", header.num_rows, header.num_chunks);
+  }
+
+  free(directory);
+  free(buffer);
+  free(emails);
+  free(values);
+  close(fd);
+}
+
+/**
+ * Reads a buffer from a given position of a file.
+ * @param fd The file descriptor.
+ * @param buffer Buffer receiving the bytes.
+ * @param length Number of bytes to read.
+ * @param offset Position in the file.
+ * @return true if every byte was read.
+ */
+
+bool columnar_read(int fd, void* buffer, uint64_t length, uint64_t offset) {
+  return pread(fd, buffer, length, offset) == (ssize_t)length;
+}
+
+/**
+ * Looks up a column by name.
+ * @param name The name of the column.
+ * @return The column, or COLUMNAR_NUM_COLUMNS if there is none by that name.
+ */
+
+uint32_t columnar_column(const char* name) {
+  uint32_t column = 0;
+  while (column < COLUMNAR_NUM_COLUMNS && strcmp(COLUMNAR_COLUMN_NAMES[column], name) != 0) {
+    column++;
+  }
+  return column;
+}
+
+/**
+ * Scans a columnar snapshot: ".scan <path> <column>[,<column>...]
+ * [where tenant|id between <low> and <high>]". Only the chunks of the listed
+ * and filtered columns are read, and chunks whose zone map lies outside the
+ * filter are skipped without being read.
+ * @param arguments The arguments of the command.
+ */
+
+void columnar_scan(char* arguments) {
+  char* tokens[8];
+  uint32_t num_tokens = 0;
+  for (char* token = strtok(arguments, " "); token != NULL && num_tokens < 8; token = strtok(NULL, " ")) {
+    tokens[num_tokens++] = token;
+  }
+  bool has_filter = num_tokens == 8;
+  if ((num_tokens != 2 && !has_filter) ||
+      (has_filter && (strcmp(tokens[2], "where") != 0 || strcmp(tokens[4], "between") != 0 ||
+                      strcmp(tokens[6], "and") != 0))) {
+    printf("Usage: .scan <path> <column>[,<column>...] [where <column> between <low> and <high>]\n");
+    return;
+  }
+
+  // Parse the projection and the filter
+  uint32_t projection[COLUMNAR_NUM_COLUMNS];
+  uint32_t num_projected = 0;
+  bool needed[COLUMNAR_NUM_COLUMNS] = {false};
+  for (char* name = strtok(tokens[1], ","); name != NULL; name = strtok(NULL, ",")) {
+    uint32_t column = columnar_column(name);
+    if (column == COLUMNAR_NUM_COLUMNS || num_projected == COLUMNAR_NUM_COLUMNS) {
+      printf("Unknown column '%s'.\n", name);
+      return;
+    }
+    projection[num_projected++] = column;
+    needed[column] = true;
+  }
+  needed[COLUMNAR_DOMAIN] |= needed[COLUMNAR_EMAIL];  // An email is printed with its domain
+  uint32_t filter_column = COLUMNAR_NUM_COLUMNS;
+  int64_t low = 0;
+  int64_t high = 0;
+  if (has_filter) {
+    filter_column = columnar_column(tokens[3]);
+    if (filter_column != COLUMNAR_TENANT && filter_column != COLUMNAR_ID) {
+      printf("Only tenant and id can be filtered.\n");
+      return;
+    }
+    needed[filter_column] = true;
+    char* low_end;
+    char* high_end;
+    errno = 0;
+    low = strtoll(tokens[5], &low_end, 10);
+    high = strtoll(tokens[7], &high_end, 10);
+    if (low_end == tokens[5] || *low_end != '\0' || high_end == tokens[7] || *high_end != '\0' ||
+        errno == ERANGE) {
+      printf("Usage: .scan <path> <column>[,<column>...] [where <column> between <low> and <high>]\n");
+      return;
+    }
+  }
+
+  int fd = open(tokens[0], O_RDONLY);
+  if (fd == -1) {
+    printf("Unable to open columnar file '%s'.\n", tokens[0]);
+    return;
+  }
+  ColumnarHeader header;
+  if (!columnar_read(fd, &header, sizeof(ColumnarHeader), 0) ||
+      memcmp(header.magic, COLUMNAR_MAGIC, sizeof(header.magic)) != 0) {
+    printf("'%s' is not a columnar file.\n", tokens[0]);
+    close(fd);
+    return;
+  }
+
+  // Nothing read from the file is trusted: the directory and the dictionary
+  // must lie within it, and every chunk within it and its buffer
+  uint64_t file_length = lseek(fd, 0, SEEK_END);
+  uint64_t num_entries = (uint64_t)header.num_chunks * COLUMNAR_NUM_COLUMNS;
+  if (header.dictionary_offset > header.directory_offset || header.directory_offset > file_length ||
+      num_entries * sizeof(ColumnChunk) > file_length - header.directory_offset ||
+      header.num_dictionary_entries > header.directory_offset - header.dictionary_offset) {
+    printf("Columnar directory out of bounds. Corrupt file.\n");
+    close(fd);
+    return;
+  }
+
+  // Load the directory and the dictionary
+  ColumnChunk* directory = malloc(num_entries * sizeof(ColumnChunk) + 1);
+  uint64_t dictionary_length = header.directory_offset - header.dictionary_offset;
+  char* dictionary_data = malloc(dictionary_length + 1);
+  char** dictionary = malloc(header.num_dictionary_entries * sizeof(char*) + 1);
+  bool ok = columnar_read(fd, directory, num_entries * sizeof(ColumnChunk), header.directory_offset) &&
+            columnar_read(fd, dictionary_data, dictionary_length, header.dictionary_offset);
+  for (uint32_t i = 0; ok && i < num_entries; i++) {
+    ColumnChunk* chunk = &directory[i];
+    ok = chunk->length <= COLUMNAR_CHUNK_BUFFER_SIZE && chunk->offset <= file_length &&
+         chunk->length <= file_length - chunk->offset && chunk->num_values <= COLUMNAR_CHUNK_ROWS &&
+         chunk->num_values == directory[i - i % COLUMNAR_NUM_COLUMNS].num_values &&
+         (i % COLUMNAR_NUM_COLUMNS == COLUMNAR_EMAIL || chunk->encoding == COLUMNAR_ENCODING_RLE ||
+          chunk->encoding == COLUMNAR_ENCODING_FOR);
+  }
+  uint64_t position = 0;
+  for (uint32_t code = 0; ok && code < header.num_dictionary_entries; code++) {
+    uint8_t length = dictionary_data[position];
+    if (position + 1 + length > dictionary_length) {
+      ok = false;
+      break;
+    }
+    memmove(dictionary_data + position, dictionary_data + position + 1, length);
+    dictionary_data[position + length] = '\0';  // Overwrites the next entry's length, already read
+    dictionary[code] = dictionary_data + position;
+    position += 1 + length;
+  }
+  if (!ok) {
+    printf("Columnar chunk out of bounds. Corrupt file.\n");
+    free(dictionary);
+    free(dictionary_data);
+    free(directory);
+    close(fd);
+    return;
+  }
+  uint64_t total_bytes = 0;
+  for (uint32_t i = 0; i < num_entries; i++) {
+    total_bytes += directory[i].length;
+  }
+
+  int64_t* values = malloc(COLUMNAR_NUM_COLUMNS * COLUMNAR_CHUNK_ROWS * sizeof(int64_t));
+  char** emails = malloc(COLUMNAR_CHUNK_ROWS * sizeof(char*));
+  uint8_t* buffers[COLUMNAR_NUM_COLUMNS];
+  for (uint32_t column = 0; column < COLUMNAR_NUM_COLUMNS; column++) {
+    buffers[column] = malloc(COLUMNAR_CHUNK_BUFFER_SIZE);
+  }
+  uint32_t chunks_scanned = 0;
+  uint64_t bytes_read = 0;
+  for (uint32_t chunk_num = 0; chunk_num < header.num_chunks; chunk_num++) {
+    ColumnChunk* chunks = &directory[chunk_num * COLUMNAR_NUM_COLUMNS];
+    if (has_filter && (chunks[filter_column].max < low || chunks[filter_column].min > high)) {
+      continue;  // The zone map shows no row of the chunk passes the filter
+    }
+    chunks_scanned++;
+    for (uint32_t column = 0; column < COLUMNAR_NUM_COLUMNS; column++) {
+      if (!needed[column]) {
+        continue;
+      }
+      ColumnChunk* chunk = &chunks[column];
+      ok = ok && columnar_read(fd, buffers[column], chunk->length, chunk->offset);
+      bytes_read += chunk->length;
+      if (column == COLUMNAR_EMAIL) {
+        // Terminate each email in place, over the next one's length byte
+        uint8_t* data = buffers[column];
+        uint32_t position = 0;
+        for (uint32_t i = 0; ok && i < chunk->num_values; i++) {
+          uint8_t length = position < chunk->length ? data[position] : 0;
+          if (position + 1 + length > chunk->length) {
+            ok = false;
+            break;
+          }
+          memmove(data + position, data + position + 1, length);
+          data[position + length] = '\0';
+          emails[i] = (char*)data + position;
+          position += 1 + length;
+        }
+      } else {
+        ok = ok && columnar_decode_integers(buffers[column], chunk, values + column * COLUMNAR_CHUNK_ROWS);
+      }
+    }
+    if (!ok) {
+      printf("Columnar chunk %d is truncated. Corrupt file.\n", chunk_num);
+      break;
+    }
+
+    for (uint32_t i = 0; i < chunks[0].num_values; i++) {
+      if (has_filter) {
+        int64_t value = values[filter_column * COLUMNAR_CHUNK_ROWS + i];
+        if (value < low || value > high) {
+          continue;
+        }
+      }
+      printf("(");
+      for (uint32_t p = 0; p < num_projected; p++) {
+        uint32_t column = projection[p];
+        int64_t value = column == COLUMNAR_EMAIL ? 0 : values[column * COLUMNAR_CHUNK_ROWS + i];
+        int64_t domain_code = values[COLUMNAR_DOMAIN * COLUMNAR_CHUNK_ROWS + i];
+        const char* domain = domain_code >= 0 && domain_code < header.num_dictionary_entries
+                                 ? dictionary[domain_code] : "";
+        if (p > 0) {
+          printf(", ");
+        }
+        if (column == COLUMNAR_EMAIL) {
+          printf("%s%s", emails[i], domain);
+        } else if (column == COLUMNAR_DOMAIN) {
+          printf("%s", domain);
+        } else if (column == COLUMNAR_USERNAME) {
+          printf("%s", value < header.num_dictionary_entries ? dictionary[value] : "");
+        } else {
+          printf("%" PRId64, value);
+        }
+      }
+      printf(")\n");
+    }
+  }
+  if (ok) {
+    printf("Scanned %d of %d chunks, read %" PRIu64 " of %" PRIu64 " bytes.\n",
+           chunks_scanned, header.num_chunks, bytes_read, total_bytes);
+  }
+
+  for (uint32_t column = 0; column < COLUMNAR_NUM_COLUMNS; column++) {
+    free(buffers[column]);
+  }
+  free(emails);
+  free(values);
+  free(dictionary);
+  free(dictionary_data);
+  free(directory);
+  close(fd);
+}
+
+/**
+ * Sets one limit of a workload class.
+ * @param workloads The budgets of every class.
+ * @param class_name Name of the class, interactive or report.
+ * @param resource Name of the resource: running, pages, cpu-ms or memory-kb.
+ * @param value The limit, 0 for none.
+ * @return False if the class or resource is unknown.
+ */
+
+bool workload_set_limit(Workload* workloads, const char* class_name, const char* resource,
+                        uint64_t value) {
+  for (uint32_t i = 0; i < WORKLOAD_CLASSES; i++) {
+    if (strcmp(class_name, WORKLOAD_CLASS_NAMES[i]) != 0) {
+      continue;
+    }
+    Workload* workload = &workloads[i];
+    if (strcmp(resource, "running") == 0) {
+      workload->max_running = value;
+    } else if (strcmp(resource, "pages") == 0) {
+      workload->max_pages_read = value;
+    } else if (strcmp(resource, "cpu-ms") == 0) {
+      workload->max_cpu_us = value * 1000;
+    } else if (strcmp(resource, "memory-kb") == 0) {
+      workload->max_memory = value * 1024;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Prints the limits of each workload class, what its statements ran into, and
+ * the pages scans evicted from the cache.
+ * @param table Pointer to the Table structure.
+ */
+
+void print_budget_status(Table* table) {
+  for (uint32_t i = 0; i < WORKLOAD_CLASSES; i++) {
+    const Workload* workload = &table->workloads[i];
+    printf("%s: running %u, pages %llu, cpu-ms %llu, memory-kb %llu; "
+           "%llu statements, %llu queued, %llu aborted\n",
+           WORKLOAD_CLASS_NAMES[i], workload->max_running,
+           (unsigned long long)workload->max_pages_read,
+           (unsigned long long)(workload->max_cpu_us / 1000),
+           (unsigned long long)(workload->max_memory / 1024),
+           (unsigned long long)workload->statements, (unsigned long long)workload->queued,
+           (unsigned long long)workload->aborted);
+  }
+  printf("Pages evicted by scans: %llu\n", (unsigned long long)table->pager->pages_evicted);
+}
+
+/**
+ * Prints the cache's policy and limit, and how often pages were found cached.
+ * @param pager Pointer to the Pager structure.
+ */
+
+void print_cache_status(Pager* pager) {
+  PageCache* cache = &pager->cache;
+  uint32_t cached = 0;
+  for (uint32_t i = 0; i < pager->page_capacity; i++) {
+    cached += pager->pages[i] != NULL;
+  }
+  PageCacheCounts counts = page_cache_counts(cache);
+  uint64_t accesses = counts.hits + counts.misses;
+  printf("Cache: %s%s, %u", CACHE_POLICY_NAMES[cache->policy],
+         cache->pin_internal ? " pinning internal nodes" : "", cached);
+  if (cache->capacity != 0) {
+    printf(" of %u", cache->capacity);
+  }
+  printf(" pages\n");
+  printf("Hits: %llu, misses: %llu (%.1f%% hits), evictions: %llu\n",
+         (unsigned long long)counts.hits, (unsigned long long)counts.misses,
+         accesses ? 100.0 * counts.hits / accesses : 0.0, (unsigned long long)counts.evictions);
+  printf("Prefetched at open: %u pages\n", pager->pages_prefetched);
+}
+
+/**
+ * Runs point lookups of keys drawn from a Zipfian distribution, with a full
+ * scan every so often, and counts the cache hits of the lookups alone.
+ * @param table Pointer to the Table structure.
+ * @param keys The keys of the table, KEY_SIZE bytes each, in shuffled order.
+ * @param cdf Probability of drawing each of the keys or one before it.
+ * @param num_keys Number of keys.
+ * @param lookups Lookups to run.
+ * @param scan_every Lookups between full scans, 0 for none.
+ * @param seed State of the random number generator.
+ * @return Percentage of the lookups' page accesses that hit the cache.
+ */
+
+double cache_bench_run(Table* table, const uint8_t* keys, const double* cdf, uint32_t num_keys,
+                       uint32_t lookups, uint32_t scan_every, uint64_t* seed) {
+  Pager* pager = table->pager;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  for (uint32_t i = 0; i < lookups; i++) {
+    if (scan_every != 0 && i % scan_every == 0) {
+      // Without a scan ring, so that the policy alone decides what stays
+      Cursor* cursor = table_start(table);
+      while (!cursor->end_of_table) {
+        cursor_value(cursor);
+        cursor_advance(cursor);
+        pager_trim_cache(pager);
+      }
+      free(cursor);
+    }
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    double draw = (double)(*seed >> 11) / (double)(1ULL << 53);
+    uint32_t low = 0;
+    uint32_t high = num_keys - 1;
+    while (low < high) {
+      uint32_t middle = (low + high) / 2;
+      if (cdf[middle] < draw) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    PageCacheCounts before = page_cache_counts(&pager->cache);
+    Cursor* cursor = table_seek(table, keys + (size_t)low * KEY_SIZE);
+    cursor_value(cursor);
+    free(cursor);
+    PageCacheCounts after = page_cache_counts(&pager->cache);
+    hits += after.hits - before.hits;
+    misses += after.misses - before.misses;
+    pager_trim_cache(pager);
+  }
+  return hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+}
+
+/**
+ * Compares the replacement policies: for each, empties the cache, warms it up
+ * with Zipfian point lookups, then measures their hit rate alone and with
+ * full scans in between. The cache keeps its limit, or gets a quarter of the
+ * table if it has none.
+ * @param table Pointer to the Table structure.
+ * @param lookups Lookups per measurement.
+ */
+
+void cache_bench(Table* table, uint32_t lookups) {
+  Pager* pager = table->pager;
+  if (pager->is_replica) {
+    printf("Replicas keep every page cached.\n");
+    return;
+  }
+  uint32_t num_keys = 0;
+  uint32_t capacity = 1024;
+  uint8_t* keys = malloc((size_t)capacity * KEY_SIZE);
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    if (num_keys == capacity) {
+      capacity *= 2;
+      keys = realloc(keys, (size_t)capacity * KEY_SIZE);
+    }
+    memcpy(keys + (size_t)num_keys * KEY_SIZE,
+           leaf_node_key(get_page(pager, cursor->page_num), cursor->cell_num), KEY_SIZE);
+    num_keys++;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  if (num_keys == 0) {
+    printf("DB is empty.\n");
+    free(keys);
+    return;
+  }
+  // Zipf's law, with the hottest keys spread over the table by a shuffle
+  uint64_t seed = 88172645463325252ULL;
+  uint8_t key[KEY_SIZE];
+  for (uint32_t i = num_keys - 1; i > 0; i--) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    uint32_t j = seed % (i + 1);
+    memcpy(key, keys + (size_t)i * KEY_SIZE, KEY_SIZE);
+    memcpy(keys + (size_t)i * KEY_SIZE, keys + (size_t)j * KEY_SIZE, KEY_SIZE);
+    memcpy(keys + (size_t)j * KEY_SIZE, key, KEY_SIZE);
+  }
+  double* cdf = malloc(num_keys * sizeof(double));
+  double sum = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+  for (uint32_t i = 0; i < num_keys; i++) {
+    cdf[i] /= sum;
+  }
+
+  // The measurements leave the cache's settings and counters as they were
+  CachePolicy saved_policy = pager->cache.policy;
+  bool saved_pin_internal = pager->cache.pin_internal;
+  uint32_t saved_capacity = pager->cache.capacity;
+  PageCacheCounts saved_counts[PAGE_CACHE_SHARDS];
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    saved_counts[i] = pager->cache.shards[i].counts;
+  }
+  uint32_t cache_pages = saved_capacity != 0 ? saved_capacity : (pager->num_pages + 3) / 4;
+  printf("%u keys on %u pages, %u cached, %u lookups, a full scan every %u:\n", num_keys,
+         pager->num_pages, cache_pages, lookups, lookups / 100 > 0 ? lookups / 100 : 1);
+  for (uint32_t config = 0; config < 3; config++) {
+    pager->cache.policy = config == 0 ? CACHE_POLICY_LRU : CACHE_POLICY_2Q;
+    pager->cache.pin_internal = config == 2;
+    pager->cache.capacity = cache_pages;
+    pager_reset_cache(pager, true);
+    seed = 88172645463325252ULL;
+    cache_bench_run(table, keys, cdf, num_keys, lookups, 0, &seed);
+    double alone = cache_bench_run(table, keys, cdf, num_keys, lookups, 0, &seed);
+    double scanned = cache_bench_run(table, keys, cdf, num_keys, lookups,
+                                     lookups / 100 > 0 ? lookups / 100 : 1, &seed);
+    printf("%s%s: %.1f%% hits alone, %.1f%% with scans\n", CACHE_POLICY_NAMES[pager->cache.policy],
+           pager->cache.pin_internal ? " pinning internal nodes" : "", alone, scanned);
+  }
+  pager->cache.policy = saved_policy;
+  pager->cache.pin_internal = saved_pin_internal;
+  pager->cache.capacity = saved_capacity;
+  for (uint32_t i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    pager->cache.shards[i].counts = saved_counts[i];
+  }
+  pager_reset_cache(pager, false);
+  free(cdf);
+  free(keys);
+}
+
+/**
+ * Executes a meta-command.
+ * @param input_buffer Pointer to the InputBuffer containing the command.
+ * @param table Pointer to the Table structure.
+ * @return Result of the meta-command execution.
+ */
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+  // Handle the ".exit" command
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    close_input_buffer(input_buffer);
+    db_close(table);
+    exit(EXIT_SUCCESS);
+    // Handle the ".btree" command to print the B-tree
+  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+    if (table->pager->is_replica) {
+      replica_catch_up(table->pager);
+    }
+    printf("Tree:\n");
+    print_tree(table->pager, 0, 0);
+    return META_COMMAND_SUCCESS;
+    // Handle the ".constants" command to print constants
+  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+    // Handle the ".backup [incremental] <path>" command
+  } else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0) {
+    char* path = input_buffer->buffer + 8;
+    bool incremental = strncmp(path, "incremental ", 12) == 0;
+    if (incremental) {
+      path += 12;
+    }
+    pager_backup(table->pager, path, incremental);
+    return META_COMMAND_SUCCESS;
+    // Handle the ".replication" command to report commit position and lag
+  } else if (strcmp(input_buffer->buffer, ".replication") == 0) {
+    print_replication_status(table->pager);
+    return META_COMMAND_SUCCESS;
+    // Handle the ".durability [sync|group|async]" command to report or switch modes
+  } else if (strncmp(input_buffer->buffer, ".durability", 11) == 0) {
+    char* mode = input_buffer->buffer + 11;
+    if (*mode == '\0') {
+      print_durability_status(table->pager);
+      return META_COMMAND_SUCCESS;
+    }
+    for (uint32_t i = 0; i < DURABILITY_MODES; i++) {
+      if (*mode == ' ' && strcmp(mode + 1, DURABILITY_MODE_NAMES[i]) == 0) {
+        if (i != DURABILITY_SYNC && !table->pager->is_shadow) {
+          printf("Only shadow-paged databases can defer commits.\n");
+        } else {
+          pager_set_durability(table->pager, i);
+        }
+        return META_COMMAND_SUCCESS;
+      }
+    }
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    // Handle the ".budget [<class> <resource> <limit>]" command to report or set budgets
+  } else if (strncmp(input_buffer->buffer, ".budget", 7) == 0) {
+    if (input_buffer->buffer[7] == '\0') {
+      print_budget_status(table);
+      return META_COMMAND_SUCCESS;
+    }
+    char class_name[16];
+    char resource[16];
+    unsigned long long value;
+    if (sscanf(input_buffer->buffer + 7, " %15s %15s %llu", class_name, resource, &value) != 3 ||
+        !workload_set_limit(table->workloads, class_name, resource, value)) {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    return META_COMMAND_SUCCESS;
+    // Handle the ".cache [bench [lookups]]" command to report on or benchmark the page cache
+  } else if (strcmp(input_buffer->buffer, ".cache") == 0) {
+    print_cache_status(table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".cache bench", 12) == 0) {
+    int lookups = input_buffer->buffer[12] == ' ' ? atoi(input_buffer->buffer + 13) : 10000;
+    if (lookups <= 0) {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    cache_bench(table, lookups);
+    return META_COMMAND_SUCCESS;
+    // Handle the ".export <path>" command to write a columnar snapshot
+  } else if (strncmp(input_buffer->buffer, ".export ", 8) == 0) {
+    columnar_export(table, input_buffer->buffer + 8);
+    return META_COMMAND_SUCCESS;
+    // Handle the ".scan <path> <columns> [where ...]" command to read one
+  } else if (strncmp(input_buffer->buffer, ".scan ", 6) == 0) {
+    columnar_scan(input_buffer->buffer + 6);
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/**
+ * Validates one "name id email" triple and fills in a Row.
+ * @param username Token holding the username.
+ * @param id_string Token holding the id.
+ * @param email Token holding the email.
+ * @param row Pointer to the Row structure to fill.
+ * @return Result of the preparation process.
+ */
+
+PrepareResult prepare_row(char* username, char* id_string, char* email, Row* row) {
+  // Syntax validation
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  // The id is either "id" or "tenant:id"; both parts may be negative
+  char* end;
+  int32_t tenant_id = 0;
+  errno = 0;
+  long long id = strtoll(id_string, &end, 10);
+  if (*end == ':' && end != id_string) {
+    if (id < INT32_MIN || id > INT32_MAX) {
+      return PREPARE_INVALID_ID;
+    }
+    tenant_id = (int32_t)id;
+    char* id_part = end + 1;
+    id = strtoll(id_part, &end, 10);
+    if (end == id_part) {
+      return PREPARE_INVALID_ID;
+    }
+  }
+  if (end == id_string || *end != '\0' || errno == ERANGE) {
+    return PREPARE_INVALID_ID;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  // Set the values in the row
+  row->tenant_id = tenant_id;
+  row->id = id;
+  strcpy(row->username, username);
+  strcpy(row->email, email);
+  row->payload_length = 0;
+  row->payload_page = INVALID_PAGE_NUM;
+  memset(row->payload_prefix, 0, PAYLOAD_PREFIX_SIZE);
+  row->payload = NULL;
+
+  return PREPARE_SUCCESS;
+}
+
+/**
+ * Prepares an INSERT statement. Several "name id email" triples on one line
+ * make a batch insert.
+ * @param input_buffer Pointer to the InputBuffer containing the command.
+ * @param statement Pointer to the Statement structure to be prepared.
+ * @return Result of the preparation process.
+ */
+
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+
+  // Everything after " = " is the payload column, which may contain spaces
+  char* payload = strstr(input_buffer->buffer, " = ");
+  if (payload != NULL) {
+    *payload = '\0';
+    payload += 3;
+  }
+
+  // Tokenize the input to extract individual components
+  char* keyword = strtok(input_buffer->buffer, " ");
+  char* username = strtok(NULL, " ");  // First input is now name
+  char* id_string = strtok(NULL, " "); // Second input is id
+  char* email = strtok(NULL, " ");     // Third input is email
+
+  PrepareResult result = prepare_row(username, id_string, email, &statement->row_to_insert);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  // Any further triples turn the statement into a batch
+  username = strtok(NULL, " ");
+  if (username == NULL) {
+    if (payload != NULL) {
+      statement->row_to_insert.payload = payload;
+      statement->row_to_insert.payload_length = strlen(payload);
+    }
+    return PREPARE_SUCCESS;
+  }
+  if (payload != NULL) {
+    return PREPARE_SYNTAX_ERROR;  // Only a single row can carry a payload
+  }
+  statement->type = STATEMENT_INSERT_BATCH;
+  uint32_t capacity = 16;
+  statement->batch_rows = malloc(capacity * sizeof(Row));
+  statement->batch_rows[0] = statement->row_to_insert;
+  statement->batch_size = 1;
+  while (username != NULL) {
+    id_string = strtok(NULL, " ");
+    email = strtok(NULL, " ");
+    if (statement->batch_size == capacity) {
+      capacity *= 2;
+      statement->batch_rows = realloc(statement->batch_rows, capacity * sizeof(Row));
+    }
+    result = prepare_row(username, id_string, email,
+                         &statement->batch_rows[statement->batch_size]);
+    if (result != PREPARE_SUCCESS) {
+      free(statement->batch_rows);
+      statement->batch_rows = NULL;
+      return result;
+    }
+    statement->batch_size++;
+    username = strtok(NULL, " ");
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+
+/**
+ * Prepares a SELECT statement: "select", optionally followed by "*" to print
+ * the payload column and by "where tenant = N", "where username = NAME" or
+ * "where domain = DOMAIN"; or "select count by username" (or domain).
+ * @param input_buffer Pointer to the InputBuffer containing the command.
+ * @param statement Pointer to the Statement structure to be prepared.
+ * @return Result of the preparation process.
+ */
+
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+  statement->with_payload = false;
+  statement->has_tenant = false;
+  statement->where_column = DICTIONARY_COLUMN_NONE;
+  statement->count_by = DICTIONARY_COLUMN_NONE;
+
+  char* rest = input_buffer->buffer + 6;
+  if (strcmp(rest, " count by username") == 0) {
+    statement->count_by = DICTIONARY_COLUMN_USERNAME;
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(rest, " count by domain") == 0) {
+    statement->count_by = DICTIONARY_COLUMN_DOMAIN;
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(rest, " *", 2) == 0) {
+    statement->with_payload = true;
+    rest += 2;
+  }
+  if (*rest == '\0') {
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(rest, " where username = ", 18) == 0) {
+    if (strlen(rest + 18) > COLUMN_USERNAME_SIZE) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    statement->where_column = DICTIONARY_COLUMN_USERNAME;
+    strcpy(statement->where_value, rest + 18);
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(rest, " where domain = ", 16) == 0) {
+    char* domain = rest + 16;
+    if (strlen(domain) > COLUMN_EMAIL_SIZE) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    // Domains are stored with their '@', which may be left out here
+    statement->where_column = DICTIONARY_COLUMN_DOMAIN;
+    statement->where_value[0] = '@';
+    strcpy(statement->where_value + (domain[0] == '@' ? 0 : 1), domain);
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(rest, " where tenant = ", 16) != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* tenant_string = rest + 16;
+  char* end;
+  errno = 0;
+  long tenant_id = strtol(tenant_string, &end, 10);
+  if (end == tenant_string || *end != '\0' || errno == ERANGE ||
+      tenant_id < INT32_MIN || tenant_id > INT32_MAX) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  statement->has_tenant = true;
+  statement->tenant_id = (int32_t)tenant_id;
+  return PREPARE_SUCCESS;
+}
+
+/**
+ * Prepares a statement based on input.
+ * @param input_buffer Pointer to the InputBuffer containing the command.
+ * @param statement Pointer to the Statement structure to be prepared.
+ * @return Result of the preparation process.
+ */
+
+PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+    statement->batch_rows = NULL;
+    statement->result = NULL;
+    statement->suspended = false;
+    statement->resuming = false;
+    statement->pages_read = 0;
+    statement->cpu_us = 0;
+    statement->memory = 0;
+    statement->over_budget = NULL;
+    statement->ring.num_pages = 0;
+    statement->ring.next = 0;
+
+    // Check if input is a natural language command
+    if (strncmp(input_buffer->buffer, "Ada ", 4) == 0) {
+        // Call Python script to get SQL query
+        char* sql_query = get_db_query(input_buffer->buffer + 4);
+        strncpy(input_buffer->buffer, sql_query, input_buffer->buffer_length - 1);
+        input_buffer->buffer[input_buffer->buffer_length - 1] = '\0'; // Ensure null termination
+    }
+
+    // Existing logic to prepare INSERT and SELECT statements
+    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+        return prepare_insert(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "select", 6) == 0 &&
+        (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+        return prepare_select(input_buffer, statement);
+    }
+    if (strcmp(input_buffer->buffer, "begin") == 0) {
+        statement->type = STATEMENT_BEGIN;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, "commit") == 0) {
+        statement->type = STATEMENT_COMMIT;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, "rollback") == 0) {
+        statement->type = STATEMENT_ROLLBACK;
+        return PREPARE_SUCCESS;
+    }
+
+    // Handle unrecognized statements
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+
+/**
+ * Gets the number of the next unused page in the pager.
+ * @param pager Pointer to the Pager structure.
+ * @return The page number of the next unused page.
+ */
+
+uint32_t get_unused_page_num(Pager* pager) { 
+  // A page past the end may keep the summary of a leaf an undone statement made
+  bitmap_clear(pager->summarized_pages, pager->num_pages);
+  // Return the current number of pages as the next unused page number
+  return pager->num_pages; 
+}
+
+/**
+ * Moves the part of a row's payload that does not fit in its cell to a chain
+ * of new overflow pages, and fills in the row's prefix and first page.
+ * @param pager Pointer to the Pager structure.
+ * @param row Pointer to the Row whose payload is written.
+ */
+
+void pager_write_overflow(Pager* pager, Row* row) {
+  uint32_t prefix_length = row->payload_length < PAYLOAD_PREFIX_SIZE ?
+                           row->payload_length : PAYLOAD_PREFIX_SIZE;
+  memset(row->payload_prefix, 0, PAYLOAD_PREFIX_SIZE);
+  memcpy(row->payload_prefix, row->payload, prefix_length);
+  row->payload_page = INVALID_PAGE_NUM;
+
+  uint32_t written = prefix_length;
+  void* previous = NULL;
+  while (written < row->payload_length) {
+    uint32_t page_num = get_unused_page_num(pager);
+    void* page = get_page(pager, page_num);  // Claims the page
+    pager_mark_dirty(pager, page_num);
+    uint32_t used = row->payload_length - written;
+    if (used > OVERFLOW_PAGE_SPACE_FOR_DATA) {
+      used = OVERFLOW_PAGE_SPACE_FOR_DATA;
+    }
+    memcpy(overflow_page_data(page), row->payload + written, used);
+    *overflow_page_used(page) = used;
+    *overflow_page_next(page) = INVALID_PAGE_NUM;
+    // Link the page after the previous one, or from the cell if it is the first
+    if (previous == NULL) {
+      row->payload_page = page_num;
+    } else {
+      *overflow_page_next(previous) = page_num;
+    }
+    previous = page;
+    written += used;
+  }
+}
+
+/**
+ * Hashes a dictionary string (FNV-1a).
+ * @param value The string.
+ * @param length Length of the string.
+ * @return The hash.
+ */
+
+uint32_t dictionary_hash(const char* value, uint32_t length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)value[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Adds a code to the dictionary's hash table, doubling the table first if it
+ * would become more than half full.
+ * @param dictionary Pointer to the Dictionary.
+ * @param code The code to add; its string must already be in entries.
+ */
+
+void dictionary_index(Dictionary* dictionary, uint32_t code) {
+  if ((code + 1) * 2 > dictionary->hash_capacity) {
+    uint32_t old_capacity = dictionary->hash_capacity;
+    uint32_t* old_slots = dictionary->hash_slots;
+    dictionary->hash_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    dictionary->hash_slots = calloc(dictionary->hash_capacity, sizeof(uint32_t));
+    for (uint32_t i = 0; i < old_capacity; i++) {
+      if (old_slots[i] != 0) {
+        dictionary_index(dictionary, old_slots[i] - 1);
+      }
+    }
+    free(old_slots);
+  }
+  const char* value = dictionary->entries[code];
+  uint32_t mask = dictionary->hash_capacity - 1;
+  uint32_t slot = dictionary_hash(value, strlen(value)) & mask;
+  while (dictionary->hash_slots[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  dictionary->hash_slots[slot] = code + 1;
+}
+
+/**
+ * Gives the next code to a string in the in-memory dictionary.
+ * @param dictionary Pointer to the Dictionary.
+ * @param value The string, not necessarily null-terminated.
+ * @param length Length of the string.
+ */
+
+void dictionary_add_entry(Dictionary* dictionary, const char* value, uint32_t length) {
+  if (dictionary->num_entries == dictionary->capacity) {
+    dictionary->capacity = dictionary->capacity == 0 ? 64 : dictionary->capacity * 2;
+    dictionary->entries = realloc(dictionary->entries, dictionary->capacity * sizeof(char*));
+  }
+  char* entry = malloc(length + 1);
+  memcpy(entry, value, length);
+  entry[length] = '\0';
+  uint32_t code = dictionary->num_entries++;
+  dictionary->entries[code] = entry;
+  dictionary_index(dictionary, code);
+}
+
+/**
+ * Looks up the code of a string.
+ * @param dictionary Pointer to the Dictionary.
+ * @param value The string.
+ * @return Its code, or NO_DICTIONARY_CODE if it has none.
+ */
+
+uint32_t dictionary_find(Dictionary* dictionary, const char* value) {
+  if (dictionary->hash_capacity == 0) {
+    return NO_DICTIONARY_CODE;
+  }
+  uint32_t mask = dictionary->hash_capacity - 1;
+  uint32_t slot = dictionary_hash(value, strlen(value)) & mask;
+  while (dictionary->hash_slots[slot] != 0) {
+    uint32_t code = dictionary->hash_slots[slot] - 1;
+    if (strcmp(dictionary->entries[code], value) == 0) {
+      return code;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return NO_DICTIONARY_CODE;
+}
+
+/**
+ * Releases the in-memory dictionary.
+ * @param dictionary Pointer to the Dictionary.
+ */
+
+void dictionary_free(Dictionary* dictionary) {
+  for (uint32_t i = 0; i < dictionary->num_entries; i++) {
+    free(dictionary->entries[i]);
+  }
+  free(dictionary->entries);
+  free(dictionary->hash_slots);
+  memset(dictionary, 0, sizeof(Dictionary));
+}
+
+/**
+ * Reads the dictionary pages into the in-memory dictionary. Nothing read from
+ * the pages is trusted: the chain must stay within the file without looping,
+ * and every entry within its page's data. A damaged dictionary ends the
+ * process, as no row could be decoded.
+ * @param table Pointer to the Table structure.
+ */
+
+void dictionary_load(Table* table) {
+  Dictionary* dictionary = &table->dictionary;
+  dictionary_free(dictionary);
+  dictionary->last_page_num = DICTIONARY_PAGE_NUM;
+  Pager* pager = table->pager;
+  if (pager->num_pages <= DICTIONARY_PAGE_NUM) {
+    return;  // A replica of a database that does not exist yet
+  }
+
+  uint32_t page_num = DICTIONARY_PAGE_NUM;
+  uint32_t pages_read = 0;
+  while (page_num != INVALID_PAGE_NUM) {
+    if (page_num >= pager->num_pages || ++pages_read > pager->num_pages) {
+      printf("Dictionary chain out of bounds. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    void* page = get_page(pager, page_num);
+    uint8_t* data = overflow_page_data(page);
+    uint32_t used = *overflow_page_used(page);
+    if (used > OVERFLOW_PAGE_SPACE_FOR_DATA) {
+      printf("Dictionary page %d out of bounds. Corrupt file.\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    for (uint32_t position = 0; position < used; position += 1 + data[position]) {
+      if (position + 1 + data[position] > used) {
+        printf("Dictionary page %d out of bounds. Corrupt file.\n", page_num);
+        exit(EXIT_FAILURE);
+      }
+      dictionary_add_entry(dictionary, (char*)data + position + 1, data[position]);
+    }
+    dictionary->last_page_num = page_num;
+    page_num = *overflow_page_next(page);
+  }
+}
+
+/**
+ * Returns the code of a string, assigning the next code and appending the
+ * string to the dictionary pages if it has none yet.
+ * @param table Pointer to the Table structure.
+ * @param value The string, at most 255 bytes long.
+ * @return Its code.
+ */
+
+uint32_t dictionary_code(Table* table, const char* value) {
+  Dictionary* dictionary = &table->dictionary;
+  uint32_t code = dictionary_find(dictionary, value);
+  if (code != NO_DICTIONARY_CODE) {
+    return code;
+  }
+
+  Pager* pager = table->pager;
+  uint32_t length = strlen(value);
+  void* page = get_page(pager, dictionary->last_page_num);
+  pager_mark_dirty(pager, dictionary->last_page_num);
+  if (*overflow_page_used(page) + 1 + length > OVERFLOW_PAGE_SPACE_FOR_DATA) {
+    // The last page is full; chain a new one after it
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_page = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    *overflow_page_next(new_page) = INVALID_PAGE_NUM;
+    *overflow_page_used(new_page) = 0;
+    *overflow_page_next(page) = new_page_num;
+    dictionary->last_page_num = new_page_num;
+    page = new_page;
+  }
+  uint8_t* data = overflow_page_data(page);
+  uint32_t used = *overflow_page_used(page);
+  data[used] = length;
+  memcpy(data + used + 1, value, length);
+  *overflow_page_used(page) = used + 1 + length;
+
+  dictionary_add_entry(dictionary, value, length);
+  return dictionary->num_entries - 1;
+}
+
+/**
+ * Assigns the dictionary codes of a row about to be inserted.
+ * @param table Pointer to the Table structure.
+ * @param row Pointer to the Row.
+ */
+
+void dictionary_encode_row(Table* table, Row* row) {
+  row->username_code = dictionary_code(table, row->username);
+  char* domain = email_domain(row->email);
+  row->domain_code = domain == NULL ? NO_DICTIONARY_CODE : dictionary_code(table, domain);
+  uint32_t local_length = domain == NULL ? strlen(row->email) : (uint32_t)(domain - row->email);
+  row->local_code = NO_DICTIONARY_CODE;
+  if (local_length > EMAIL_SIZE) {
+    char local[COLUMN_EMAIL_SIZE + 1];
+    memcpy(local, row->email, local_length);
+    local[local_length] = '\0';
+    row->local_code = dictionary_code(table, local);
+  }
+}
+
+/**
+ * Restores the local part of a row's email read from a leaf, if it was too
+ * long for the cell.
+ * @param dictionary Pointer to the Dictionary.
+ * @param row Pointer to the Row, holding the email up to its domain.
+ */
+
+void dictionary_decode_local(Dictionary* dictionary, Row* row) {
+  if (row->local_code < dictionary->num_entries) {
+    strcpy(row->email, dictionary->entries[row->local_code]);
+  }
+}
+
+/**
+ * Restores the strings of a row read from a leaf from its dictionary codes.
+ * @param dictionary Pointer to the Dictionary.
+ * @param row Pointer to the Row, holding the email up to its domain.
+ */
+
+void dictionary_decode_row(Dictionary* dictionary, Row* row) {
+  dictionary_decode_local(dictionary, row);
+  if (row->username_code < dictionary->num_entries) {
+    strcpy(row->username, dictionary->entries[row->username_code]);
+  }
+  if (row->domain_code < dictionary->num_entries) {
+    strcat(row->email, dictionary->entries[row->domain_code]);
+  }
+}
+
+/**
+ * Returns how many rows the bulk loader and sequential splits put in a leaf.
+ * @param table Pointer to the Table structure.
+ * @return The fill factor's share of LEAF_NODE_MAX_CELLS, at least one.
+ */
+
+uint32_t leaf_node_fill_count(Table* table) {
+  uint32_t count = LEAF_NODE_MAX_CELLS * table->fill_factor / 100;
+  return count < 1 ? 1 : count;
+}
+
+/**
+ * Chooses where a full leaf splits, following the table's split policy.
+ * Sequential inserts split at the insertion point, so the leaf they leave
+ * behind stays filled to the fill factor instead of half empty.
+ * @param cursor Pointer to the Cursor where the new row goes.
+ * @return Number of the LEAF_NODE_MAX_CELLS + 1 rows kept in the left leaf,
+ * from 1 to LEAF_NODE_MAX_CELLS.
+ */
+
+uint32_t leaf_node_split_point(Cursor* cursor) {
+  Table* table = cursor->table;
+  uint32_t cell_num = cursor->cell_num;
+  bool appending = cell_num == LEAF_NODE_MAX_CELLS;
+  bool same_leaf = table->last_insert_page_num == cursor->page_num;
+  if (table->split_policy == SPLIT_APPEND && appending) {
+    return leaf_node_fill_count(table);
+  }
+  if (table->split_policy == SPLIT_ADAPTIVE && same_leaf) {
+    if (table->last_insert_cell_num + 1 == cell_num) {
+      // Ascending run: the rows before the new one stay, the new one starts the right leaf
+      return appending ? leaf_node_fill_count(table) : cell_num;
+    }
+    if (table->last_insert_cell_num == cell_num && !appending) {
+      // Descending run: the new row ends the left leaf, the rows after it move right
+      return cell_num == 0 ? LEAF_NODE_MAX_CELLS + 1 - leaf_node_fill_count(table) : cell_num + 1;
+    }
+  }
+  return LEAF_NODE_LEFT_SPLIT_COUNT;
+}
+
+/**
+ * Widens a leaf's summary to cover a row written into it.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the leaf.
+ * @param row Pointer to the Row, with its dictionary codes.
+ */
+
+void leaf_summary_widen(Table* table, uint32_t page_num, Row* row) {
+  if (!bitmap_test(table->pager->summarized_pages, page_num)) {
+    return;
+  }
+  LeafSummary* summary = &table->pager->leaf_summaries[page_num];
+  summary->min_username_code = row->username_code < summary->min_username_code ? row->username_code : summary->min_username_code;
+  summary->max_username_code = row->username_code > summary->max_username_code ? row->username_code : summary->max_username_code;
+  summary->min_domain_code = row->domain_code < summary->min_domain_code ? row->domain_code : summary->min_domain_code;
+  summary->max_domain_code = row->domain_code > summary->max_domain_code ? row->domain_code : summary->max_domain_code;
+}
+
+/**
+ * Widens a leaf's summary to cover the cells of another leaf moved into it.
+ * The leaf stays summarized only if both were.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the leaf receiving the cells.
+ * @param source_page_num Page number of the leaf they come from.
+ */
+
+void leaf_summary_merge(Table* table, uint32_t page_num, uint32_t source_page_num) {
+  Pager* pager = table->pager;
+  if (!bitmap_test(pager->summarized_pages, source_page_num)) {
+    bitmap_clear(pager->summarized_pages, page_num);
+    return;
+  }
+  LeafSummary* summary = &pager->leaf_summaries[page_num];
+  LeafSummary* source = &pager->leaf_summaries[source_page_num];
+  summary->min_username_code = source->min_username_code < summary->min_username_code ? source->min_username_code : summary->min_username_code;
+  summary->max_username_code = source->max_username_code > summary->max_username_code ? source->max_username_code : summary->max_username_code;
+  summary->min_domain_code = source->min_domain_code < summary->min_domain_code ? source->min_domain_code : summary->min_domain_code;
+  summary->max_domain_code = source->max_domain_code > summary->max_domain_code ? source->max_domain_code : summary->max_domain_code;
+}
+
+/**
+ * Gives a new leaf the summary of the leaf its cells come from.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the new leaf.
+ * @param source_page_num Page number of the leaf its cells come from.
+ */
+
+void leaf_summary_copy(Table* table, uint32_t page_num, uint32_t source_page_num) {
+  Pager* pager = table->pager;
+  pager->leaf_summaries[page_num] = pager->leaf_summaries[source_page_num];
+  if (bitmap_test(pager->summarized_pages, source_page_num)) {
+    bitmap_set(pager->summarized_pages, page_num);
+  } else {
+    bitmap_clear(pager->summarized_pages, page_num);
+  }
+}
+
+/**
+ * Handles splitting the root node and creating a new root.
+ * @param table Pointer to the Table structure.
+ * @param right_child_page_num Page number of the new right child.
+ */
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+  // Retrieve the current root and right child
+  void* root = get_page(table->pager, table->root_page_num);
+  void* right_child = get_page(table->pager, right_child_page_num);
+  // Allocate a new page to move the old root data
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void* left_child = get_page(table->pager, left_child_page_num);
+  pager_mark_dirty(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
+  // Initialize the new left and right children as internal nodes if necessary
+  if (get_node_type(root) == NODE_INTERNAL) {
+    initialize_internal_node(right_child);
+    initialize_internal_node(left_child);
+  }
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+  if (get_node_type(left_child) == NODE_LEAF) {
+    leaf_summary_copy(table, left_child_page_num, table->root_page_num);
+  }
+  // Only leaves have summaries
+  bitmap_clear(table->pager->summarized_pages, table->root_page_num);
+  // Update the parent pointers of all children of the left child
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    void* child;
+    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
+      child = get_page(table->pager, *internal_node_child(left_child,i));
+      pager_mark_dirty(table->pager, *internal_node_child(left_child,i));
+      *node_parent(child) = left_child_page_num;
+    }
+    child = get_page(table->pager, *internal_node_right_child(left_child));
+    pager_mark_dirty(table->pager, *internal_node_right_child(left_child));
+    *node_parent(child) = left_child_page_num;
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  get_node_max_key(table->pager, left_child, internal_node_key(root, 0));
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+}
+
+
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num);
+
+/**
+ * Adds a new child/key pair to a parent internal node.
+ * @param table Pointer to the Table structure.
+ * @param parent_page_num Page number of the parent internal node.
+ * @param child_page_num Page number of the child node to be added.
+ */
+
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+  /*
+  Add a new child/key pair to parent that corresponds to child
+  */
+
+  void* parent = get_page(table->pager, parent_page_num);
+  void* child = get_page(table->pager, child_page_num);
+  uint8_t child_max_key[KEY_SIZE];
+  get_node_max_key(table->pager, child, child_max_key);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+  pager_mark_dirty(table->pager, parent_page_num);
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  /*
+  An internal node with a right child of INVALID_PAGE_NUM is empty
+  */
+  if (right_child_page_num == INVALID_PAGE_NUM) {
+    *internal_node_right_child(parent) = child_page_num;
+    return;
+  }
+
+  void* right_child = get_page(table->pager, right_child_page_num);
+  uint8_t right_child_max_key[KEY_SIZE];
+  get_node_max_key(table->pager, right_child, right_child_max_key);
+  /*
+  If we are already at the max number of cells for a node, we cannot increment
+  before splitting. Incrementing without inserting a new key/child pair
+  and immediately calling internal_node_split_and_insert has the effect
+  of creating a new key at (max_cells + 1) with an uninitialized value
+  */
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if (compare_keys(child_max_key, right_child_max_key) > 0) {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    memcpy(internal_node_key(parent, original_num_keys), right_child_max_key, KEY_SIZE);
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    for (uint32_t i = original_num_keys; i > index; i--) {
+      void* destination = internal_node_cell(parent, i);
+      void* source = internal_node_cell(parent, i - 1);
+      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_child(parent, index) = child_page_num;
+    memcpy(internal_node_key(parent, index), child_max_key, KEY_SIZE);
+  }
+}
+
+/**
+ * Updates a key in an internal node.
+ * @param node Pointer to the internal node.
+ * @param old_key The key to be replaced.
+ * @param new_key The new key to replace with.
+ */
+
+void update_internal_node_key(void* node, const uint8_t* old_key, const uint8_t* new_key) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  memcpy(internal_node_key(node, old_child_index), new_key, KEY_SIZE);
+}
+
+/**
+ * Splits an internal node and inserts a new child.
+ * @param table Pointer to the Table structure.
+ * @param parent_page_num Page number of the parent internal node.
+ * @param child_page_num Page number of the child node to be inserted.
+ */
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+  uint32_t old_page_num = parent_page_num;
+  void* old_node = get_page(table->pager,parent_page_num);
+  uint8_t old_max[KEY_SIZE];
+  get_node_max_key(table->pager, old_node, old_max);
+
+  void* child = get_page(table->pager, child_page_num); 
+  uint8_t child_max[KEY_SIZE];
+  get_node_max_key(table->pager, child, child_max);
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  pager_mark_dirty(table->pager, old_page_num);
+  pager_mark_dirty(table->pager, child_page_num);
+
+  /*
+  Declaring a flag before updating pointers which
+  records whether this operation involves splitting the root -
+  if it does, we will insert our newly created node during
+  the step where the table's new root is created. If it does
+  not, we have to insert the newly created node into its parent
+  after the old node's keys have been transferred over. We are not
+  able to do this if the newly created node's parent is not a newly
+  initialized root node, because in that case its parent may have existing
+  keys aside from our old node which we are splitting. If that is true, we
+  need to find a place for our newly created node in its parent, and we
+  cannot insert it at the correct index if it does not yet have any keys
+  */
+  uint32_t splitting_root = is_node_root(old_node);
+
+  void* parent;
+  void* new_node;
+  if (splitting_root) {
+    create_new_root(table, new_page_num);
+    parent = get_page(table->pager,table->root_page_num);
+    /*
+    If we are splitting the root, we need to update old_node to point
+    to the new root's left child, new_page_num will already point to
+    the new root's right child
+    */
+    old_page_num = *internal_node_child(parent,0);
+    old_node = get_page(table->pager, old_page_num);
+  } else {
+    pager_mark_dirty(table->pager, *node_parent(old_node));
+    parent = get_page(table->pager,*node_parent(old_node));
+    new_node = get_page(table->pager, new_page_num);
+    pager_mark_dirty(table->pager, new_page_num);
+    initialize_internal_node(new_node);
+  }
+  
+  uint32_t* old_num_keys = internal_node_num_keys(old_node);
+
+  uint32_t cur_page_num = *internal_node_right_child(old_node);
+  void* cur = get_page(table->pager, cur_page_num);
+
+  /*
+  First put right child into new node and set right child of old node to invalid page number
+  */
+  internal_node_insert(table, new_page_num, cur_page_num);
+  pager_mark_dirty(table->pager, cur_page_num);
+  *node_parent(cur) = new_page_num;
+  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+  /*
+  For each key until you get to the middle key, move the key and the child to the new node
+  */
+  for (int i = INTERNAL_NODE_MAX_KEYS - 1; i > INTERNAL_NODE_MAX_KEYS / 2; i--) {
+    cur_page_num = *internal_node_child(old_node, i);
+    cur = get_page(table->pager, cur_page_num);
+
+    internal_node_insert(table, new_page_num, cur_page_num);
+    pager_mark_dirty(table->pager, cur_page_num);
+    *node_parent(cur) = new_page_num;
+
+    (*old_num_keys)--;
+  }
+
+  /*
+  Set child before middle key, which is now the highest key, to be node's right child,
+  and decrement number of keys
+  */
+  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
+  (*old_num_keys)--;
+
+  /*
+  Determine which of the two nodes after the split should contain the child to be inserted,
+  and insert the child
+  */
+  uint8_t max_after_split[KEY_SIZE];
+  get_node_max_key(table->pager, old_node, max_after_split);
+
+  uint32_t destination_page_num =
+      compare_keys(child_max, max_after_split) < 0 ? old_page_num : new_page_num;
+
+  internal_node_insert(table, destination_page_num, child_page_num);
+  *node_parent(child) = destination_page_num;
+
+  uint8_t new_max[KEY_SIZE];
+  get_node_max_key(table->pager, old_node, new_max);
+  update_internal_node_key(parent, old_max, new_max);
+
+  if (!splitting_root) {
+    /*
+    Set the parent pointer before inserting: if the parent splits too, the new
+    node may end up under the parent's new sibling, which sets it again
+    */
+    *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table,*node_parent(old_node),new_page_num);
+  }
+}
+
+/**
+ * Inserts a row into a full leaf that has a parent, B*-tree style. If the leaf
+ * next to it under the same parent has room, the rows of both leaves and the
+ * new row are spread evenly over the two. Otherwise the leaf and a full
+ * neighbour are split into three leaves, each two-thirds full, rather than
+ * leaving two half-empty ones.
+ * @param cursor Pointer to the Cursor where the new row goes.
+ * @param key The key to be inserted.
+ * @param value Pointer to the Row structure representing the value to be inserted.
+ */
+
+void leaf_node_share_and_insert(Cursor* cursor, const uint8_t* key, Row* value) {
+  Table* table = cursor->table;
+  Pager* pager = table->pager;
+  void* node = get_page(pager, cursor->page_num);
+  uint32_t parent_page_num = *node_parent(node);
+  void* parent = get_page(pager, parent_page_num);
+  uint8_t node_max[KEY_SIZE];
+  get_node_max_key(pager, node, node_max);
+  uint32_t index = internal_node_find_child(parent, node_max);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+
+  // Pair the leaf with a neighbour that has room, the left one first
+  uint32_t left_page_num = INVALID_PAGE_NUM;
+  uint32_t right_page_num = INVALID_PAGE_NUM;
+  if (index > 0 && *leaf_node_num_cells(get_page(pager, *internal_node_child(parent, index - 1))) <
+                       LEAF_NODE_MAX_CELLS) {
+    left_page_num = *internal_node_child(parent, index - 1);
+    right_page_num = cursor->page_num;
+  } else if (index < num_keys &&
+             *leaf_node_num_cells(get_page(pager, *internal_node_child(parent, index + 1))) <
+                 LEAF_NODE_MAX_CELLS) {
+    left_page_num = cursor->page_num;
+    right_page_num = *internal_node_child(parent, index + 1);
+  }
+  bool has_room = left_page_num != INVALID_PAGE_NUM;
+  if (!has_room) {
+    // Both neighbours are full: split with one of them
+    left_page_num = index < num_keys ? cursor->page_num : *internal_node_child(parent, index - 1);
+    right_page_num = index < num_keys ? *internal_node_child(parent, index + 1) : cursor->page_num;
+  }
+
+  // Merge the rows of the pair and the new row in key order
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  uint32_t num_left = *leaf_node_num_cells(left);
+  uint32_t num_right = *leaf_node_num_cells(right);
+  uint32_t num_merged = num_left + num_right + 1;
+  uint32_t new_position = cursor->cell_num + (cursor->page_num == right_page_num ? num_left : 0);
+  uint8_t* merged = malloc(num_merged * LEAF_NODE_CELL_SIZE);
+  for (uint32_t i = 0, source = 0; i < num_merged; i++) {
+    uint8_t* cell = merged + i * LEAF_NODE_CELL_SIZE;
+    if (i == new_position) {
+      memcpy(cell + LEAF_NODE_KEY_OFFSET, key, KEY_SIZE);
+      serialize_row(value, cell + LEAF_NODE_VALUE_OFFSET);
+    } else {
+      void* source_cell = source < num_left ? leaf_node_cell(left, source)
+                                            : leaf_node_cell(right, source - num_left);
+      memcpy(cell, source_cell, LEAF_NODE_CELL_SIZE);
+      source++;
+    }
+  }
+
+  uint8_t old_left_max[KEY_SIZE];
+  get_node_max_key(pager, left, old_left_max);
+  uint32_t page_nums[3] = {left_page_num, right_page_num, INVALID_PAGE_NUM};
+  uint32_t num_pages = 2;
+  if (!has_room) {
+    // The new leaf goes between the pair
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = parent_page_num;
+    *leaf_node_next_leaf(new_node) = right_page_num;
+    *leaf_node_next_leaf(left) = new_page_num;
+    page_nums[1] = new_page_num;
+    page_nums[2] = right_page_num;
+    num_pages = 3;
+  }
+  // Every page gets rows of both leaves: give each the summary of the pair
+  leaf_summary_merge(table, left_page_num, right_page_num);
+  for (uint32_t i = 1; i < num_pages; i++) {
+    leaf_summary_copy(table, page_nums[i], left_page_num);
+  }
+
+  // Spread the rows evenly over the pages
+  uint32_t start = 0;
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint32_t count = num_merged / num_pages + (i < num_merged % num_pages ? 1 : 0);
+    void* destination = get_page(pager, page_nums[i]);
+    pager_mark_dirty(pager, page_nums[i]);
+    leaf_node_set_cells(destination, merged + start * LEAF_NODE_CELL_SIZE, count);
+    if (new_position >= start && new_position < start + count) {
+      table->last_insert_page_num = page_nums[i];
+      table->last_insert_cell_num = new_position - start;
+      leaf_summary_widen(table, page_nums[i], value);
+    }
+    start += count;
+  }
+  free(merged);
+
+  // Only the left leaf's maximum moved; a new middle leaf still needs its key
+  uint8_t new_left_max[KEY_SIZE];
+  get_node_max_key(pager, left, new_left_max);
+  pager_mark_dirty(pager, parent_page_num);
+  update_internal_node_key(parent, old_left_max, new_left_max);
+  if (!has_room) {
+    internal_node_insert(table, parent_page_num, page_nums[1]);
+  }
+}
+
+/**
+ * Splits a leaf node and inserts a new key-value pair into the appropriate leaf node.
+ * This function is called when the current leaf node is full and needs to split into two nodes.
+ * 
+ * @param cursor Pointer to the Cursor structure representing the position in the tree.
+ * @param key The key to be inserted.
+ * @param value Pointer to the Row structure representing the value to be inserted.
+ */
+
+void leaf_node_split_and_insert(Cursor* cursor, const uint8_t* key, Row* value) {
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent.
+  */
+
+  void* old_node = get_page(cursor->table->pager, cursor->page_num);
+  uint32_t left_count = leaf_node_split_point(cursor);
+  if (left_count == LEAF_NODE_LEFT_SPLIT_COUNT && !is_node_root(old_node)) {
+    // No sequential run to split at: use a neighbour's room first
+    leaf_node_share_and_insert(cursor, key, value);
+    return;
+  }
+  uint8_t old_max[KEY_SIZE];
+  get_node_max_key(cursor->table->pager, old_node, old_max);
+  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  void* new_node = get_page(cursor->table->pager, new_page_num);
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
+  pager_mark_dirty(cursor->table->pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+  leaf_summary_copy(cursor->table, new_page_num, cursor->page_num);
+
+  /*
+  All existing keys plus new key should should be divided
+  between old (left) and new (right) nodes at the split point.
+  Only the cells going right are copied; the old node keeps its
+  frames and just drops the slots of the cells that left.
+  */
+  uint32_t cell_num = cursor->cell_num;
+  for (uint32_t i = left_count; i <= LEAF_NODE_MAX_CELLS; i++) {
+    void* destination = leaf_node_insert_cell(new_node, i - left_count);
+    if (i == cell_num) {
+      memcpy(destination + LEAF_NODE_KEY_OFFSET, key, KEY_SIZE);
+      serialize_row(value, destination + LEAF_NODE_VALUE_OFFSET);
+    } else {
+      memcpy(destination, leaf_node_cell(old_node, i > cell_num ? i - 1 : i), LEAF_NODE_CELL_SIZE);
+    }
+  }
+  if (cell_num < left_count) {
+    *leaf_node_num_cells(old_node) = left_count - 1;
+    void* destination = leaf_node_insert_cell(old_node, cell_num);
+    memcpy(destination + LEAF_NODE_KEY_OFFSET, key, KEY_SIZE);
+    serialize_row(value, destination + LEAF_NODE_VALUE_OFFSET);
+  } else {
+    *leaf_node_num_cells(old_node) = left_count;
+  }
+
+  // Remember where the new row went, for the next split point
+  if (cursor->cell_num >= left_count) {
+    cursor->table->last_insert_page_num = new_page_num;
+    cursor->table->last_insert_cell_num = cursor->cell_num - left_count;
+  } else {
+    cursor->table->last_insert_page_num = cursor->page_num;
+    cursor->table->last_insert_cell_num = cursor->cell_num;
+  }
+  leaf_summary_widen(cursor->table, cursor->table->last_insert_page_num, value);
+
+  if (is_node_root(old_node)) {
+    return create_new_root(cursor->table, new_page_num);
+  } else {
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint8_t new_max[KEY_SIZE];
+    get_node_max_key(cursor->table->pager, old_node, new_max);
+    void* parent = get_page(cursor->table->pager, parent_page_num);
+
+    pager_mark_dirty(cursor->table->pager, parent_page_num);
+    update_internal_node_key(parent, old_max, new_max);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    return;
+  }
+}
+
+/**
+ * Inserts a new key-value pair into a leaf node. If the leaf node is full, it splits the node
+ * and then inserts the new key-value pair.
+ * 
+ * @param cursor Pointer to the Cursor structure representing the position in the tree.
+ * @param key The key to be inserted.
+ * @param value Pointer to the Row structure representing the value to be inserted.
+ */
+
+void leaf_node_insert(Cursor* cursor, const uint8_t* key, Row* value) {
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    // Node full
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
+  // Make room for new cell
+  leaf_node_insert_cell(node, cursor->cell_num);
+  memcpy(leaf_node_key(node, cursor->cell_num), key, KEY_SIZE);
+  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  leaf_summary_widen(cursor->table, cursor->page_num, value);
+  cursor->table->last_insert_page_num = cursor->page_num;
+  cursor->table->last_insert_cell_num = cursor->cell_num;
+}
+
+/**
+ * Counts the levels of the tree, from the root down to the leaves.
+ * @param table Pointer to the Table structure.
+ * @return Number of levels, 1 for a root leaf.
+ */
+
+uint32_t table_depth(Table* table) {
+  uint32_t depth = 1;
+  void* node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    node = get_page(table->pager, *internal_node_right_child(node));
+    depth++;
+  }
+  return depth;
+}
+
+/**
+ * Bounds the dictionary pages the strings of some rows may add. An entry only
+ * starts a new page when the last one has less room than the longest entry,
+ * so every page but the last holds at least that much less than it can.
+ * @param rows The rows, not encoded yet.
+ * @param num_rows Number of rows.
+ * @return Most dictionary pages the rows add.
+ */
+
+uint32_t dictionary_pages_for_rows(Row* rows, uint32_t num_rows) {
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    // The username, the domain, and the local part if it is too long for the cell
+    bytes += 1 + strlen(rows[i].username) + 1 + strlen(rows[i].email);
+  }
+  const uint32_t longest_entry = 1 + COLUMN_EMAIL_SIZE;
+  return bytes / (OVERFLOW_PAGE_SPACE_FOR_DATA - longest_entry) + 1;
+}
+
+/**
+ * Bounds the pages inserting one row may add: the dictionary pages of its
+ * strings, its payload's overflow pages, and a split of its leaf and of
+ * every internal node above it, the root's taking two pages.
+ * @param table Pointer to the Table structure.
+ * @param row Pointer to the Row to insert.
+ * @return Most pages the insert adds.
+ */
+
+uint32_t table_pages_for_row(Table* table, Row* row) {
+  uint32_t overflow_pages = 0;
+  if (row->payload_length > PAYLOAD_PREFIX_SIZE) {
+    overflow_pages = (row->payload_length - PAYLOAD_PREFIX_SIZE + OVERFLOW_PAGE_SPACE_FOR_DATA - 1) /
+                     OVERFLOW_PAGE_SPACE_FOR_DATA;
+  }
+  return dictionary_pages_for_rows(row, 1) + overflow_pages + table_depth(table) + 1;
+}
+
+/**
+ * Undoes the running statement, which ran out of pages midway. The dictionary
+ * is read again, as the statement's new codes are gone from its pages.
+ * @param table Pointer to the Table structure.
+ */
+
+void table_undo_statement(Table* table) {
+  pager_end_undo(table->pager, true);
+  dictionary_load(table);
+  table->last_insert_page_num = INVALID_PAGE_NUM;
+}
+
+/**
+ * Inserts one row into the tree, leaving the commit to the caller. Nothing is
+ * changed unless the pages the row may need are free.
+ * @param table Pointer to the Table structure where the row will be inserted.
+ * @param row_to_insert Pointer to the Row to insert.
+ * @return EXECUTE_DUPLICATE_KEY if the key exists, EXECUTE_TABLE_FULL or
+ * EXECUTE_DISK_FULL if the row may not fit, EXECUTE_SUCCESS otherwise.
+ */
+
+ExecuteResult table_insert_row(Table* table, Row* row_to_insert) {
+  ExecuteResult reserved = pager_reserve_pages(table->pager, table_pages_for_row(table, row_to_insert));
+  if (reserved != EXECUTE_SUCCESS) {
+    return reserved;
+  }
+  uint8_t key_to_insert[KEY_SIZE];
+  encode_key(row_to_insert->tenant_id, row_to_insert->id, key_to_insert);
+  // Find the position to insert the new row.
+  Cursor* cursor = table_find(table, key_to_insert);
+  // Access the node where the row will be inserted.
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  // Check for duplicate keys.
+  if (cursor->cell_num < num_cells) {
+    if (compare_keys(leaf_node_key(node, cursor->cell_num), key_to_insert) == 0) {
+      free(cursor);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  // Replace the low-cardinality strings by their dictionary codes.
+  dictionary_encode_row(table, row_to_insert);
+  // Move a large payload out to overflow pages before the cell is written.
+  if (row_to_insert->payload_length > 0) {
+    pager_write_overflow(table->pager, row_to_insert);
+  }
+  // Perform the insertion.
+  leaf_node_insert(cursor, key_to_insert, row_to_insert);
+  // Clean up.
+  free(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+/**
+ * Checks whether a row with the given key is in the tree.
+ * @param table Pointer to the Table structure.
+ * @param key The key to look for.
+ * @return True if the key exists.
+ */
+
+bool table_has_key(Table* table, const uint8_t* key) {
+  Cursor* cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+               compare_keys(leaf_node_key(node, cursor->cell_num), key) == 0;
+  free(cursor);
+  return found;
+}
+
+/**
+ * Executes an insert operation in the database. This function inserts a new row into a table.
+ * It handles the insertion of the row and checks for duplicate keys.
+ * 
+ * @param statement Pointer to the Statement structure containing the row to insert.
+ * @param table Pointer to the Table structure where the row will be inserted.
+ * @return ExecuteResult indicating the result of the execution (success or error code).
+ */
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  // Replicas only change through the primary's log.
+  if (table->pager->is_replica) {
+    return EXECUTE_READ_ONLY;
+  }
+  ExecuteResult result = table_insert_row(table, &statement->row_to_insert);
+  // Ship the modified pages to replicas.
+  pager_commit(table->pager);
+
+  return result;
+}
+
+/**
+ * Locks the rows a statement writes, in exclusive mode until the transaction
+ * ends. A statement outside a transaction runs as a transaction of its own.
+ * Called before the statement latch is taken, so a wait never holds up the
+ * transaction it waits for. A statement that was parked runs again with the
+ * same id, so it keeps its age, and finds the locks it took before still held.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the connection's Transaction.
+ * @param statement Pointer to the prepared Statement.
+ * @return LOCK_GRANTED, LOCK_DIED if the transaction must roll back, or
+ * LOCK_WAIT if the statement was parked.
+ */
+
+LockResult transaction_lock_rows(Table* table, Transaction* transaction, Statement* statement) {
+  Row* rows = &statement->row_to_insert;
+  uint32_t num_rows = 1;
+  if (statement->type == STATEMENT_INSERT_BATCH) {
+    rows = statement->batch_rows;
+    num_rows = statement->batch_size;
+  } else if (statement->type != STATEMENT_INSERT) {
+    return LOCK_GRANTED;
+  }
+  // The row's release took the waiter off it
+  bool waited = transaction->waiting;
+  transaction->waiting = false;
+  if (!transaction->active && !waited) {
+    lock_start_transaction(&table->locks, transaction);
+  }
+  uint8_t key[KEY_SIZE];
+  for (uint32_t i = 0; i < num_rows; i++) {
+    encode_key(rows[i].tenant_id, rows[i].id, key);
+    LockResult result = lock_acquire(&table->locks, transaction, key, LOCK_EXCLUSIVE);
+    if (result != LOCK_GRANTED) {
+      return result;
+    }
+  }
+  return LOCK_GRANTED;
+}
+
+/**
+ * Adds inserts to a transaction, to be applied at commit. Rows whose key is
+ * already in the table or the transaction are skipped.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the active Transaction.
+ * @param rows The rows to insert, with their keys locked.
+ * @param num_rows Number of rows.
+ * @return EXECUTE_DUPLICATE_KEY if any row was skipped, EXECUTE_SUCCESS otherwise.
+ */
+
+ExecuteResult transaction_add_rows(Table* table, Transaction* transaction,
+                                   Row* rows, uint32_t num_rows) {
+  bool duplicate = false;
+  uint8_t key[KEY_SIZE];
+  for (uint32_t i = 0; i < num_rows; i++) {
+    encode_key(rows[i].tenant_id, rows[i].id, key);
+    bool exists = table_has_key(table, key);
+    for (uint32_t j = 0; j < transaction->num_rows && !exists; j++) {
+      exists = transaction->rows[j].tenant_id == rows[i].tenant_id &&
+               transaction->rows[j].id == rows[i].id;
+    }
+    if (exists) {
+      duplicate = true;
+      continue;
+    }
+    if (transaction->num_rows == transaction->rows_capacity) {
+      transaction->rows_capacity = transaction->rows_capacity ? transaction->rows_capacity * 2 : 16;
+      transaction->rows = realloc(transaction->rows, transaction->rows_capacity * sizeof(Row));
+    }
+    Row* row = &transaction->rows[transaction->num_rows++];
+    *row = rows[i];
+    if (row->payload != NULL) {
+      row->payload = strdup(row->payload);  // The input line is reused by the next statement
+    }
+  }
+  return duplicate ? EXECUTE_DUPLICATE_KEY : EXECUTE_SUCCESS;
+}
+
+/**
+ * Ends a transaction: drops the inserts not applied and releases its locks.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the Transaction.
+ */
+
+void transaction_end(Table* table, Transaction* transaction) {
+  for (uint32_t i = 0; i < transaction->num_rows; i++) {
+    free(transaction->rows[i].payload);
+  }
+  transaction->num_rows = 0;
+  transaction->active = false;
+  lock_cancel_wait(&table->locks, transaction);
+  lock_release_all(&table->locks, transaction);
+}
+
+/**
+ * Executes a begin, commit or rollback statement. A commit applies all the
+ * transaction's inserts as one commit, or none of them if they do not fit.
+ * @param statement Pointer to the Statement structure.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the connection's Transaction.
+ * @return ExecuteResult indicating the result of the execution.
+ */
+
+ExecuteResult execute_transaction(Statement* statement, Table* table, Transaction* transaction) {
+  if (statement->type == STATEMENT_BEGIN) {
+    if (table->pager->is_replica) {
+      return EXECUTE_READ_ONLY;
+    }
+    if (transaction->active) {
+      return EXECUTE_IN_TRANSACTION;
+    }
+    lock_start_transaction(&table->locks, transaction);
+    transaction->active = true;
+    return EXECUTE_SUCCESS;
+  }
+  if (!transaction->active) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  ExecuteResult result = EXECUTE_SUCCESS;
+  if (statement->type == STATEMENT_COMMIT) {
+    // The rows' locks kept every other transaction from adding their keys
+    pager_begin_undo(table->pager);
+    for (uint32_t i = 0; i < transaction->num_rows; i++) {
+      result = table_insert_row(table, &transaction->rows[i]);
+      if (result == EXECUTE_TABLE_FULL || result == EXECUTE_DISK_FULL) {
+        break;
+      }
+      result = EXECUTE_SUCCESS;
+    }
+    if (result == EXECUTE_SUCCESS) {
+      pager_end_undo(table->pager, false);
+      pager_commit(table->pager);
+    } else {
+      table_undo_statement(table);
+    }
+  }
+  transaction_end(table, transaction);
+  return result;
+}
+
+/**
+ * Orders rows by key, i.e. by tenant and then id, used to sort a batch with qsort.
+ * @param a Pointer to the first Row.
+ * @param b Pointer to the second Row.
+ * @return Negative, zero or positive like strcmp.
+ */
+
+int compare_rows_by_key(const void* a, const void* b) {
+  const Row* left = a;
+  const Row* right = b;
+  if (left->tenant_id != right->tenant_id) {
+    return (left->tenant_id > right->tenant_id) - (left->tenant_id < right->tenant_id);
+  }
+  return (left->id > right->id) - (left->id < right->id);
+}
+
+/**
+ * Merges a sorted run of rows into one leaf in a single pass.
+ * The existing cells and the new rows are merged into a scratch node, then
+ * copied back with one memcpy per destination page. If they no longer fit, the
+ * leaf splits once into as many pages as needed, each new page is linked into
+ * the leaf chain and handed to the parent.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the leaf all rows belong to.
+ * @param rows Rows sorted by key, given their dictionary codes as they are merged.
+ * @param num_rows Number of rows.
+ * @return True if some rows were skipped because their key already exists.
+ */
+
+bool leaf_node_insert_batch(Table* table, uint32_t page_num, Row* rows, uint32_t num_rows) {
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool duplicate = false;
+
+  // Merge existing cells and new rows into a scratch node that can hold them all
+  uint8_t* merged = malloc((num_cells + num_rows) * LEAF_NODE_CELL_SIZE);
+  uint32_t num_merged = 0;
+  uint32_t cell_num = 0;
+  uint32_t row_num = 0;
+  uint8_t row_key[KEY_SIZE];
+  while (cell_num < num_cells || row_num < num_rows) {
+    if (row_num < num_rows) {
+      encode_key(rows[row_num].tenant_id, rows[row_num].id, row_key);
+    }
+    if (row_num < num_rows && num_merged > 0 &&
+        compare_keys(row_key, merged + (num_merged - 1) * LEAF_NODE_CELL_SIZE + LEAF_NODE_KEY_OFFSET) == 0) {
+      duplicate = true;  // Already present, or repeated within the batch
+      row_num++;
+    } else if (row_num == num_rows ||
+               (cell_num < num_cells && compare_keys(leaf_node_key(node, cell_num), row_key) <= 0)) {
+      memcpy(merged + num_merged++ * LEAF_NODE_CELL_SIZE, leaf_node_cell(node, cell_num++),
+             LEAF_NODE_CELL_SIZE);
+    } else {
+      uint8_t* cell = merged + num_merged++ * LEAF_NODE_CELL_SIZE;
+      memcpy(cell + LEAF_NODE_KEY_OFFSET, row_key, KEY_SIZE);
+      // Only rows actually inserted get dictionary codes
+      dictionary_encode_row(table, &rows[row_num]);
+      leaf_summary_widen(table, page_num, &rows[row_num]);
+      serialize_row(&rows[row_num++], cell + LEAF_NODE_VALUE_OFFSET);
+    }
+  }
+
+  pager_mark_dirty(table->pager, page_num);
+  if (num_merged <= LEAF_NODE_MAX_CELLS) {
+    leaf_node_set_cells(node, merged, num_merged);
+    free(merged);
+    return duplicate;
+  }
+
+  // Split once into the fewest pages that hold everything at the fill factor, filled evenly
+  uint32_t fill_count = leaf_node_fill_count(table);
+  uint32_t num_pages = (num_merged + fill_count - 1) / fill_count;
+  uint8_t old_max[KEY_SIZE] = {0};
+  if (num_cells > 0) {
+    get_node_max_key(table->pager, node, old_max);
+  }
+  uint32_t* page_nums = malloc(num_pages * sizeof(uint32_t));
+  uint32_t start = 0;
+  uint32_t previous_page_num = page_num;
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint32_t count = num_merged / num_pages + (i < num_merged % num_pages ? 1 : 0);
+    uint32_t destination_page_num = page_num;
+    if (i > 0) {
+      // Link a new leaf in after the previous one
+      destination_page_num = get_unused_page_num(table->pager);
+      void* previous = get_page(table->pager, previous_page_num);
+      void* destination = get_page(table->pager, destination_page_num);
+      pager_mark_dirty(table->pager, destination_page_num);
+      initialize_leaf_node(destination);
+      leaf_summary_copy(table, destination_page_num, page_num);
+      *leaf_node_next_leaf(destination) = *leaf_node_next_leaf(previous);
+      *leaf_node_next_leaf(previous) = destination_page_num;
+    }
+    void* destination = get_page(table->pager, destination_page_num);
+    leaf_node_set_cells(destination, merged + start * LEAF_NODE_CELL_SIZE, count);
+    start += count;
+    page_nums[i] = destination_page_num;
+    previous_page_num = destination_page_num;
+  }
+  free(merged);
+
+  /*
+  Hand the new leaves to the parent right to left. The rightmost one goes in
+  first so the maximum of every ancestor is already final when a parent
+  splits; each earlier leaf then goes in just before its right neighbour.
+  */
+  if (is_node_root(node)) {
+    // The root's cells move to a new left child; the root keeps its page
+    create_new_root(table, page_nums[num_pages - 1]);
+  } else {
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = get_page(table->pager, parent_page_num);
+    void* last = get_page(table->pager, page_nums[num_pages - 1]);
+    pager_mark_dirty(table->pager, parent_page_num);
+    uint8_t new_max[KEY_SIZE];
+    get_node_max_key(table->pager, node, new_max);
+    update_internal_node_key(parent, old_max, new_max);
+    *node_parent(last) = parent_page_num;
+    internal_node_insert(table, parent_page_num, page_nums[num_pages - 1]);
+  }
+  for (uint32_t i = num_pages - 2; i > 0; i--) {
+    void* right = get_page(table->pager, page_nums[i + 1]);
+    void* new_node = get_page(table->pager, page_nums[i]);
+    uint32_t parent_page_num = *node_parent(right);
+    *node_parent(new_node) = parent_page_num;
+    internal_node_insert(table, parent_page_num, page_nums[i]);
+  }
+  free(page_nums);
+  return duplicate;
 }
 
 /**
- * Serializes a Row structure into a byte array.
- * @param source Pointer to the Row structure to be serialized.
- * @param destination Pointer to the destination byte array where the serialized data will be stored.
+ * Executes a batch insert. The batch is sorted, and each run of rows that falls
+ * into the same leaf is applied with one descent and one merge, instead of one
+ * descent, one shift and possibly one split per row.
+ * Rows whose key already exists are skipped; the others are still inserted.
+ * A batch that does not fit is undone as a whole.
+ * @param statement Pointer to the Statement structure holding the batch.
+ * @param table Pointer to the Table structure.
+ * @return EXECUTE_TABLE_FULL or EXECUTE_DISK_FULL if the batch did not fit,
+ * EXECUTE_DUPLICATE_KEY if any row was skipped, EXECUTE_SUCCESS otherwise.
  */
 
-void serialize_row(Row* source, void* destination) {
-  // Copy the ID from the source to the destination at the ID_OFFSET
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  // Copy the username from the source to the destination at the USERNAME_OFFSET
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  // Copy the email from the source to the destination at the EMAIL_OFFSET
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+ExecuteResult execute_insert_batch(Statement* statement, Table* table) {
+  if (table->pager->is_replica) {
+    return EXECUTE_READ_ONLY;
+  }
+  Row* rows = statement->batch_rows;
+  uint32_t num_rows = statement->batch_size;
+  pager_begin_undo(table->pager);
+  ExecuteResult result = EXECUTE_SUCCESS;
+  qsort(rows, num_rows, sizeof(Row), compare_rows_by_key);
+
+  bool duplicate = false;
+  uint32_t next = 0;
+  uint8_t key[KEY_SIZE];
+  while (next < num_rows && result == EXECUTE_SUCCESS) {
+    // One descent finds the leaf for the smallest pending key and its bound
+    uint8_t upper_bound[KEY_SIZE];
+    bool has_upper_bound;
+    encode_key(rows[next].tenant_id, rows[next].id, key);
+    uint32_t page_num = table_find_leaf(table, key, upper_bound, &has_upper_bound);
+    uint32_t end = next + 1;
+    while (end < num_rows) {
+      encode_key(rows[end].tenant_id, rows[end].id, key);
+      if (has_upper_bound && compare_keys(key, upper_bound) > 0) {
+        break;
+      }
+      end++;
+    }
+    // Every new leaf may split each internal node above it, the root's split
+    // taking two pages
+    uint32_t num_cells = *leaf_node_num_cells(get_page(table->pager, page_num));
+    uint32_t new_leaves = 0;
+    if (num_cells + end - next > LEAF_NODE_MAX_CELLS) {
+      uint32_t fill_count = leaf_node_fill_count(table);
+      new_leaves = (num_cells + end - next + fill_count - 1) / fill_count - 1;
+    }
+    // Rows are encoded as they are merged, so the strings of duplicates never
+    // reach the dictionary
+    result = pager_reserve_pages(table->pager, dictionary_pages_for_rows(rows + next, end - next) +
+                                               3 * new_leaves + 2 * table_depth(table));
+    if (result == EXECUTE_SUCCESS) {
+      duplicate |= leaf_node_insert_batch(table, page_num, rows + next, end - next);
+    }
+    next = end;
+  }
+  if (result != EXECUTE_SUCCESS) {
+    table_undo_statement(table);
+    return result;
+  }
+  // The whole batch is one commit
+  pager_end_undo(table->pager, false);
+  pager_commit(table->pager);
+
+  return duplicate ? EXECUTE_DUPLICATE_KEY : EXECUTE_SUCCESS;
 }
 
 /**
- * Deserializes a byte array into a Row structure.
- * @param source Pointer to the byte array containing the serialized data.
- * @param destination Pointer to the Row structure where the deserialized data will be stored.
+ * Makes room for more bytes at the end of a ByteBuffer.
+ * @param buffer Pointer to the ByteBuffer.
+ * @param extra Number of bytes that will be appended.
  */
 
-void deserialize_row(void* source, Row* destination) {
-  // Copy the ID from the source to the destination at the ID_OFFSET
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  // Copy the username from the source to the destination at the USERNAME_OFFSET
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  // Copy the email from the source to the destination at the EMAIL_OFFSET
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+void byte_buffer_reserve(ByteBuffer* buffer, size_t extra) {
+  if (buffer->length + extra <= buffer->capacity) {
+    return;
+  }
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+  while (capacity < buffer->length + extra) {
+    capacity *= 2;
+  }
+  buffer->data = realloc(buffer->data, capacity);
+  buffer->capacity = capacity;
 }
 
 /**
- * Initializes a node as a leaf node.
- * @param node Pointer to the node to be initialized.
+ * Appends bytes to a ByteBuffer.
+ * @param buffer Pointer to the ByteBuffer.
+ * @param data The bytes to append.
+ * @param length Number of bytes.
  */
 
-void initialize_leaf_node(void* node) {
-  // Set the node type to NODE_LEAF
-  set_node_type(node, NODE_LEAF);
-  // Set the node as non-root
-  set_node_root(node, false);
-  // Initialize the number of cells to 0
-  *leaf_node_num_cells(node) = 0;
-  // Set the next leaf pointer to 0 (no sibling)
-  *leaf_node_next_leaf(node) = 0;
+void byte_buffer_append(ByteBuffer* buffer, const void* data, size_t length) {
+  byte_buffer_reserve(buffer, length);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
 }
 
+// Set by SIGINT or SIGTERM to stop the server
+volatile sig_atomic_t server_stopping = 0;
+
 /**
- * Initializes a node as an internal node.
- * @param node Pointer to the node to be initialized.
+ * Sleeps until a shared word may have changed from a value, for at most 100 ms.
+ * Without futexes it sleeps for a moment instead.
+ * @param word The word, in shared memory.
+ * @param value The value it held when the caller decided to sleep.
  */
 
-void initialize_internal_node(void* node) {
-  // Set the node type to NODE_INTERNAL
-  set_node_type(node, NODE_INTERNAL);
-  // Set the node as non-root
-  set_node_root(node, false);
-  // Initialize the number of keys to 0
-  *internal_node_num_keys(node) = 0;
-  /*
-  Necessary because the root page number is 0; by not initializing an internal 
-  node's right child to an invalid page number when initializing the node, we may
-  end up with 0 as the node's right child, which makes the node a parent of the root
-  */
-  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+void shm_futex_wait(uint32_t* word, uint32_t value) {
+#if defined(__linux__)
+  struct timespec timeout = {0, 100000000};
+  syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+  (void)word;
+  (void)value;
+  struct timespec pause = {0, 50000};
+  nanosleep(&pause, NULL);
+#endif
 }
 
 /**
- * Finds a particular key within a leaf node and returns a cursor pointing to it.
- * @param table Pointer to the Table structure.
- * @param page_num The page number of the leaf node.
- * @param key The key to find in the leaf node.
- * @return Cursor pointing to the location of the key, or where the key should be if it's not present.
+ * Wakes the process sleeping on a shared word, if any.
+ * @param word The word, in shared memory.
  */
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);  // Retrieve the specified page
-  uint32_t num_cells = *leaf_node_num_cells(node);  // Get the number of cells in the leaf node
-  // Allocate and initialize a new cursor
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
-  cursor->end_of_table = false;
+void shm_futex_wake(uint32_t* word) {
+#if defined(__linux__)
+  syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+  (void)word;
+#endif
+}
 
-  // Binary search
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index; // Key found
-      return cursor;
-    }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
+/**
+ * Tells whether the other side of a shared-memory connection still holds its
+ * socket open.
+ * @param fd The socket.
+ * @return False once the peer has closed it.
+ */
+
+bool shm_peer_alive(int fd) {
+  char byte;
+  ssize_t result = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return result > 0 || (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+/**
+ * Returns how many times to poll a ring before sleeping. On a single CPU the
+ * other side cannot run while we poll, so we sleep at once.
+ * @return The number of polls.
+ */
+
+uint32_t shm_spin_limit() {
+  static long cpus = 0;
+  if (cpus == 0) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  return cpus > 1 ? SHM_SPIN_ITERATIONS : 0;
+}
+
+/**
+ * Waits for room for a frame at the head of a ring and returns where to write
+ * it. A frame that would run past the end of the ring goes to its start, after
+ * a WIRE_PAD frame filling the end. If the reader has gone away, or the server
+ * is stopping, whatever it left unread is dropped.
+ * @param ring Pointer to the producer's ShmRing.
+ * @param length Bytes of the frame, header included.
+ * @return Where to write the frame; shm_ring_publish makes it visible.
+ */
+
+char* shm_ring_reserve(ShmRing* ring, uint32_t length) {
+  if (length > SHM_RING_SIZE / 2) {
+    printf("Frame too large for a shared ring.\n");
+    exit(EXIT_FAILURE);
+  }
+  ShmRingHeader* header = ring->header;
+  uint32_t head = header->head;  // Only the producer writes it
+  uint32_t contiguous = SHM_RING_SIZE - (head & (SHM_RING_SIZE - 1));
+  uint32_t needed = length <= contiguous ? length : contiguous + length;
+  uint32_t spins = 0;
+  while (SHM_RING_SIZE - (head - __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) < needed) {
+    if (++spins < shm_spin_limit()) {
+      continue;
+    }
+    __atomic_store_n(&header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+    uint32_t tail = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST);
+    if (SHM_RING_SIZE - (head - tail) < needed) {
+      shm_futex_wait(&header->tail, tail);
     }
+    __atomic_store_n(&header->producer_waiting, 0, __ATOMIC_RELAXED);
+    if (server_stopping || !shm_peer_alive(ring->peer_fd)) {
+      __atomic_store_n(&header->tail, head, __ATOMIC_RELAXED);
+    }
+  }
+  if (length > contiguous) {
+    WireHeader pad = {contiguous - sizeof(WireHeader), WIRE_PAD, 0, 0};
+    memcpy(ring->data + (head & (SHM_RING_SIZE - 1)), &pad, sizeof(pad));
+    __atomic_store_n(&header->head, head + contiguous, __ATOMIC_RELEASE);
+    head += contiguous;
   }
+  return ring->data + (head & (SHM_RING_SIZE - 1));
+}
 
-  cursor->cell_num = min_index; // Key not found, return position where it should be inserted
-  return cursor;
+/**
+ * Makes the frame written at the head of a ring visible to the reader, waking
+ * it if it sleeps.
+ * @param ring Pointer to the producer's ShmRing.
+ * @param length Bytes of the frame, header included.
+ */
+
+void shm_ring_publish(ShmRing* ring, uint32_t length) {
+  ShmRingHeader* header = ring->header;
+  __atomic_store_n(&header->head, header->head + length, __ATOMIC_SEQ_CST);
+  // One wakeup is enough however many frames follow before the reader runs
+  if (__atomic_exchange_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST)) {
+    shm_futex_wake(&header->head);
+  }
 }
 
 /**
- * Finds the child index in an internal node that should contain the given key.
- * @param node Pointer to the internal node.
- * @param key The key to find.
- * @return The index of the child that should contain the key.
+ * Waits for the next frame of a ring, polling for a while before sleeping.
+ * The other process may rewrite the ring at any time, so the frame's header is
+ * copied out once and checked against the ring's bounds before it is used: its
+ * payload must be padded, fit in half the ring, end before the end of the ring
+ * and have been published. The payload stays in the ring, to be read in place,
+ * until shm_ring_consume.
+ * @param ring Pointer to the consumer's ShmRing.
+ * @param frame Receives the header of the frame.
+ * @return The payload of the frame, or NULL if the writer has gone away, the
+ * server is stopping or the frame is corrupt.
  */
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-  /*
-  Return the index of the child which should contain
-  the given key.
-  */
+const char* shm_ring_next(ShmRing* ring, WireHeader* frame) {
+  ShmRingHeader* header = ring->header;
+  uint32_t tail = header->tail;  // Only the consumer writes it
+  uint32_t spins = 0;
+  while (true) {
+    uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (head != tail) {
+      uint32_t offset = tail & (SHM_RING_SIZE - 1);
+      if (offset % sizeof(WireHeader) != 0 || head - tail < sizeof(WireHeader)) {
+        return NULL;
+      }
+      uint64_t raw = __atomic_load_n((uint64_t*)(ring->data + offset), __ATOMIC_RELAXED);
+      memcpy(frame, &raw, sizeof(WireHeader));
+      if (frame->length > SHM_RING_SIZE / 2 || frame->length % 8 != 0 ||
+          sizeof(WireHeader) + frame->length > SHM_RING_SIZE - offset ||
+          sizeof(WireHeader) + frame->length > head - tail) {
+        return NULL;
+      }
+      if (frame->type != WIRE_PAD) {
+        return ring->data + offset + sizeof(WireHeader);
+      }
+      tail += sizeof(WireHeader) + frame->length;
+      __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (server_stopping) {
+      return NULL;
+    }
+    if (++spins < shm_spin_limit()) {
+      continue;
+    }
+    __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == tail) {
+      shm_futex_wait(&header->head, tail);
+    }
+    __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+    if (!shm_peer_alive(ring->peer_fd)) {
+      return NULL;
+    }
+  }
+}
 
-  uint32_t num_keys = *internal_node_num_keys(node);
+/**
+ * Frees the space of the frame returned by shm_ring_next, waking the writer if
+ * it waits for room.
+ * @param ring Pointer to the consumer's ShmRing.
+ * @param frame The header shm_ring_next copied out, already checked.
+ */
 
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
+void shm_ring_consume(ShmRing* ring, const WireHeader* frame) {
+  ShmRingHeader* header = ring->header;
+  __atomic_store_n(&header->tail, header->tail + sizeof(WireHeader) + frame->length,
+                   __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&header->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+    shm_futex_wake(&header->tail);
+  }
+}
 
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
-    }
+/**
+ * Returns where to write a frame of a connection's output.
+ * @param out Pointer to the WireOutput.
+ * @param length Bytes of the frame, header included.
+ * @return Where to write the frame; wire_commit sends it.
+ */
+
+char* wire_reserve(WireOutput* out, size_t length) {
+  if (out->ring != NULL) {
+    return shm_ring_reserve(out->ring, length);
   }
+  byte_buffer_reserve(&out->buffer, length);
+  return out->buffer.data + out->buffer.length;
+}
 
-  return min_index; // Return the index of the child that should contain the key
+/**
+ * Sends the frame written at wire_reserve's pointer: at once over shared
+ * memory, with the next write over the socket.
+ * @param out Pointer to the WireOutput.
+ * @param length Bytes of the frame, header included.
+ */
+
+void wire_commit(WireOutput* out, size_t length) {
+  if (out->ring != NULL) {
+    shm_ring_publish(out->ring, length);
+  } else {
+    out->buffer.length += length;
+  }
 }
 
 /**
- * Finds a key within an internal node and returns a cursor pointing to it.
- * @param table Pointer to the Table structure.
- * @param page_num The page number of the internal node.
- * @param key The key to find in the internal node.
- * @return Cursor pointing to the location of the key.
+ * Appends a frame to a connection's output.
+ * @param out Pointer to the WireOutput.
+ * @param type The WireFrameType.
+ * @param status The status of a WIRE_DONE frame, 0 otherwise.
+ * @param payload The payload bytes.
+ * @param length Number of payload bytes, before padding.
  */
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);  // Retrieve the specified page
-  // Find the child that should contain the key
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  // Recursively find the key in the child node
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+void wire_append_frame(WireOutput* out, uint8_t type, uint8_t status,
+                       const void* payload, size_t length) {
+  WireHeader header = {(length + 7) & ~(size_t)7, type, status, 0};
+  char* frame = wire_reserve(out, sizeof(header) + header.length);
+  memcpy(frame, &header, sizeof(header));
+  if (length > 0) {
+    memcpy(frame + sizeof(header), payload, length);
   }
+  memset(frame + sizeof(header) + length, 0, header.length - length);
+  wire_commit(out, sizeof(header) + header.length);
 }
 
 /**
- * Finds the position of a given key in the table. If the key is not present, returns the position where it should be inserted.
+ * Encodes the rows gathered in a ResultBatch as one WIRE_ROWS frame, written
+ * straight into the output, and empties the batch.
+ * @param batch Pointer to the ResultBatch.
+ */
+
+void result_batch_flush(ResultBatch* batch) {
+  uint32_t n = batch->num_rows;
+  if (n == 0) {
+    return;
+  }
+  WireBatchHeader batch_header = {n, batch->usernames.length, batch->emails.length,
+                                  batch->payloads.length};
+  size_t length = sizeof(batch_header) + n * sizeof(int64_t) + n * sizeof(int32_t) +
+                  3 * (n + 1) * sizeof(uint32_t) + batch->usernames.length +
+                  batch->emails.length + batch->payloads.length;
+  WireHeader header = {(length + 7) & ~(size_t)7, WIRE_ROWS, 0, 0};
+  char* frame = wire_reserve(batch->out, sizeof(header) + header.length);
+  char* position = frame;
+  memcpy(position, &header, sizeof(header));
+  position += sizeof(header);
+  memcpy(position, &batch_header, sizeof(batch_header));
+  position += sizeof(batch_header);
+  memcpy(position, batch->ids, n * sizeof(int64_t));
+  position += n * sizeof(int64_t);
+  memcpy(position, batch->tenants, n * sizeof(int32_t));
+  position += n * sizeof(int32_t);
+  memcpy(position, batch->username_offsets, (n + 1) * sizeof(uint32_t));
+  position += (n + 1) * sizeof(uint32_t);
+  memcpy(position, batch->email_offsets, (n + 1) * sizeof(uint32_t));
+  position += (n + 1) * sizeof(uint32_t);
+  memcpy(position, batch->payload_offsets, (n + 1) * sizeof(uint32_t));
+  position += (n + 1) * sizeof(uint32_t);
+  memcpy(position, batch->usernames.data, batch->usernames.length);
+  position += batch->usernames.length;
+  memcpy(position, batch->emails.data, batch->emails.length);
+  position += batch->emails.length;
+  memcpy(position, batch->payloads.data, batch->payloads.length);
+  position += batch->payloads.length;
+  memset(position, 0, header.length - length);
+  wire_commit(batch->out, sizeof(header) + header.length);
+
+  batch->num_rows = 0;
+  batch->usernames.length = 0;
+  batch->emails.length = 0;
+  batch->payloads.length = 0;
+}
+
+/**
+ * Adds a row to a ResultBatch, sending the batch first if it is full.
+ * Batches are also cut at WIRE_BATCH_BYTES, so a frame always fits a shared ring.
+ * @param batch Pointer to the ResultBatch.
+ * @param pager Pointer to the Pager, to read the payload from overflow pages.
+ * @param row Pointer to the decoded Row.
+ * @param with_payload True to include the payload column.
+ */
+
+void result_batch_add_row(ResultBatch* batch, Pager* pager, Row* row, bool with_payload) {
+  if (batch->num_rows == WIRE_BATCH_ROWS ||
+      batch->usernames.length + batch->emails.length + batch->payloads.length >= WIRE_BATCH_BYTES) {
+    result_batch_flush(batch);
+  }
+  uint32_t i = batch->num_rows++;
+  if (i == 0) {
+    batch->username_offsets[0] = 0;
+    batch->email_offsets[0] = 0;
+    batch->payload_offsets[0] = 0;
+  }
+  batch->ids[i] = row->id;
+  batch->tenants[i] = row->tenant_id;
+  byte_buffer_append(&batch->usernames, row->username, strlen(row->username));
+  batch->username_offsets[i + 1] = batch->usernames.length;
+  byte_buffer_append(&batch->emails, row->email, strlen(row->email));
+  batch->email_offsets[i + 1] = batch->emails.length;
+  if (with_payload) {
+    uint32_t remaining = row->payload_length;
+    uint32_t prefix_length = remaining < PAYLOAD_PREFIX_SIZE ? remaining : PAYLOAD_PREFIX_SIZE;
+    byte_buffer_append(&batch->payloads, row->payload_prefix, prefix_length);
+    remaining -= prefix_length;
+    // A corrupt chain ends the payload where it stops making sense
+    uint32_t page_num = row->payload_page;
+    bool corrupt = false;
+    while (remaining > 0 && page_num < pager->num_pages && !corrupt) {
+      void* page = get_page(pager, page_num);
+      uint32_t used = overflow_page_bytes(page, remaining, &corrupt);
+      byte_buffer_append(&batch->payloads, overflow_page_data(page), used);
+      remaining -= used;
+      page_num = *overflow_page_next(page);
+    }
+  }
+  batch->payload_offsets[i + 1] = batch->payloads.length;
+}
+
+/**
+ * Prints a row followed by its payload column. The payload is streamed from
+ * the cell prefix and then one overflow page at a time, never copied whole.
+ * @param pager Pointer to the Pager structure.
+ * @param row Pointer to the Row to be printed.
+ */
+
+void print_row_with_payload(Pager* pager, Row* row) {
+  printf("(");
+  print_id(row->tenant_id, row->id);
+  printf(", %s, %s, ", row->username, row->email);
+  uint32_t remaining = row->payload_length;
+  uint32_t prefix_length = remaining < PAYLOAD_PREFIX_SIZE ? remaining : PAYLOAD_PREFIX_SIZE;
+  fwrite(row->payload_prefix, 1, prefix_length, stdout);
+  remaining -= prefix_length;
+  uint32_t page_num = row->payload_page;
+  bool corrupt = false;
+  while (remaining > 0 && !corrupt) {
+    if (page_num >= pager->num_pages) {
+      corrupt = true;  // The chain ends, or leaves the file, before the payload does
+      break;
+    }
+    void* page = get_page(pager, page_num);
+    uint32_t used = overflow_page_bytes(page, remaining, &corrupt);
+    fwrite(overflow_page_data(page), 1, used, stdout);
+    remaining -= used;
+    page_num = *overflow_page_next(page);
+  }
+  printf(")\n");
+  if (corrupt) {
+    printf("Payload overflow chain out of bounds. Corrupt file.\n");
+  }
+}
+
+/**
+ * Outputs a row selected by a SELECT: printed, or added to the client's batch.
+ * @param statement Pointer to the SELECT Statement.
  * @param table Pointer to the Table structure.
- * @param key The key to find.
- * @return Cursor pointing to the location of the key or where it should be inserted.
+ * @param row Pointer to the decoded Row.
  */
 
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
-  // Determine the type of the root node and find the key accordingly
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
+void select_emit_row(Statement* statement, Table* table, Row* row) {
+  if (statement->result != NULL) {
+    result_batch_add_row(statement->result, table->pager, row, statement->with_payload);
+  } else if (statement->with_payload) {
+    print_row_with_payload(table->pager, row);
   } else {
-    return internal_node_find(table, root_page_num, key);
+    print_row(row);  // Never touches the overflow pages
   }
 }
 
 /**
- * Returns a cursor to the start of the table.
- * @param table Pointer to the Table structure.
- * @return Cursor positioned at the start of the table.
+ * Tells which workload class a statement belongs to.
+ * @param statement Pointer to the prepared Statement.
+ * @return WORKLOAD_REPORT for statements reading the whole table.
  */
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);  // Find the first position in the table
+WorkloadClass statement_workload(Statement* statement) {
+  if (statement->type == STATEMENT_SELECT &&
+      (statement->count_by != DICTIONARY_COLUMN_NONE ||
+       (!statement->has_tenant && statement->where_column == DICTIONARY_COLUMN_NONE))) {
+    return WORKLOAD_REPORT;
+  }
+  return WORKLOAD_INTERACTIVE;
+}
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);  // Set end_of_table if the table is empty
+/**
+ * Checks a running statement against the budgets of its workload class.
+ * @param statement Pointer to the Statement.
+ * @param table Pointer to the Table structure.
+ * @return True if a budget is exceeded; over_budget then names it.
+ */
 
-  return cursor;
+bool statement_over_budget(Statement* statement, Table* table) {
+  Workload* workload = &table->workloads[statement->workload];
+  uint64_t cpu_us = statement->cpu_us + thread_cpu_microseconds() - statement->cpu_start_us;
+  if (workload->max_pages_read != 0 && statement->pages_read > workload->max_pages_read) {
+    statement->over_budget = "pages";
+  } else if (workload->max_cpu_us != 0 && cpu_us > workload->max_cpu_us) {
+    statement->over_budget = "CPU time";
+  } else if (workload->max_memory != 0 && statement->memory > workload->max_memory) {
+    statement->over_budget = "memory";
+  }
+  return statement->over_budget != NULL;
 }
 
 /**
- * Retrieves the value at the cursor's current position.
- * @param cursor Pointer to the Cursor structure.
- * @return Pointer to the value at the cursor's current position.
+ * Lets other work run in the middle of a scan, every SCAN_YIELD_ROWS rows. A
+ * client's SELECT that may suspend stops while other connections wait for a
+ * worker, to continue after them. Otherwise the statements waiting for the
+ * latch run, and the scan resumes by seeking to the key it had reached, as the
+ * tree may have changed meanwhile.
+ * @param statement Pointer to the scanning Statement.
+ * @param cursor The scan's cursor, on a row not read yet; replaced if the scan yielded.
+ * @param rows_scanned Rows read so far by the scan.
+ * @param can_suspend False for scans whose state lives on the stack.
+ * @return True if the scan must stop: the statement is suspended or over budget.
  */
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num); // Return the value at the cursor's position
+bool scan_yield(Statement* statement, Cursor** cursor, uint32_t rows_scanned, bool can_suspend) {
+  if (rows_scanned % SCAN_YIELD_ROWS != 0 || (*cursor)->end_of_table) {
+    return false;
+  }
+  Table* table = (*cursor)->table;
+  if (statement_over_budget(statement, table)) {
+    return true;
+  }
+  uint8_t key[KEY_SIZE];
+  memcpy(key, leaf_node_key(get_page(table->pager, (*cursor)->page_num), (*cursor)->cell_num), KEY_SIZE);
+  ResultBatch* result = statement->result;
+  if (can_suspend && result != NULL && result->ready_connections != NULL &&
+      __atomic_load_n(result->ready_connections, __ATOMIC_RELAXED) > 0) {
+    statement->suspended = true;
+    decode_key(key, &statement->resume_tenant, &statement->resume_id);
+    return true;
+  }
+  // Reads made by the statements running meanwhile are not this scan's
+  statement_scan_ring = NULL;
+  statement_pages_read = NULL;
+  bool yielded = statement_latch_yield(table->pager, statement->shared_latch);
+  statement_scan_ring = &statement->ring;
+  statement_pages_read = &statement->pages_read;
+  if (yielded) {
+    free(*cursor);
+    *cursor = table_seek(table, key);
+  }
+  return false;
 }
 
 /**
- * Advances the cursor to the next position in the table.
- * @param cursor Pointer to the Cursor structure to advance.
+ * Reads one dictionary code straight from a serialized row.
+ * @param value Pointer to the serialized row in a leaf cell.
+ * @param column The column whose code is read.
+ * @return The code.
  */
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
+uint32_t row_dictionary_code(void* value, DictionaryColumn column) {
+  uint32_t code;
+  uint32_t offset = column == DICTIONARY_COLUMN_USERNAME ? USERNAME_CODE_OFFSET : DOMAIN_CODE_OFFSET;
+  memcpy(&code, value + offset, sizeof(uint32_t));
+  return code;
+}
 
-  cursor->cell_num += 1;  // Move to the next cell
-  // Check if we need to move to the next leaf node
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      // Move to the next leaf node
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+/**
+ * Executes SELECT COUNT BY: counts the rows per username or email domain.
+ * Rows are grouped on their dictionary codes, read from the cells without
+ * deserializing or decoding the rows.
+ * @param statement Pointer to the Statement structure.
+ * @param table Pointer to the Table structure.
+ * @return EXECUTE_SUCCESS, or EXECUTE_OVER_BUDGET if the statement ran out of budget.
+ */
+
+ExecuteResult execute_count_by(Statement* statement, Table* table) {
+  Dictionary* dictionary = &table->dictionary;
+  uint32_t num_codes = dictionary->num_entries;
+  // The counts are the aggregation's working memory
+  statement->memory = (num_codes + 1) * sizeof(uint32_t);
+  if (statement_over_budget(statement, table)) {
+    return EXECUTE_OVER_BUDGET;
+  }
+  uint32_t* counts = calloc(num_codes + 1, sizeof(uint32_t));
+  Cursor* cursor = table_start(table);
+  uint32_t rows_scanned = 0;
+  while (!(cursor->end_of_table)) {
+    if (scan_yield(statement, &cursor, ++rows_scanned, false) || cursor->end_of_table) {
+      break;
+    }
+    if (dictionary->num_entries > num_codes) {
+      // Rows inserted while the scan yielded brought new values
+      counts = realloc(counts, (dictionary->num_entries + 1) * sizeof(uint32_t));
+      memset(counts + num_codes, 0, (dictionary->num_entries + 1 - num_codes) * sizeof(uint32_t));
+      num_codes = dictionary->num_entries;
+      statement->memory = (num_codes + 1) * sizeof(uint32_t);
+    }
+    uint32_t code = row_dictionary_code(cursor_value(cursor), statement->count_by);
+    if (code < num_codes) {
+      counts[code]++;
+    }
+    cursor_advance(cursor);
+    pager_trim_cache(table->pager);
+  }
+  free(cursor);
+  if (statement->over_budget != NULL) {
+    free(counts);
+    return EXECUTE_OVER_BUDGET;
+  }
+
+  for (uint32_t code = 0; code < dictionary->num_entries; code++) {
+    if (counts[code] == 0) {
+      continue;
+    }
+    if (statement->result == NULL) {
+      printf("(%s, %d)\n", dictionary->entries[code], counts[code]);
+      continue;
     }
+    // A client gets the count as the id and the value in its own column
+    Row row;
+    memset(&row, 0, sizeof(row));
+    row.id = counts[code];
+    char* column = statement->count_by == DICTIONARY_COLUMN_USERNAME ? row.username : row.email;
+    strcpy(column, dictionary->entries[code]);
+    result_batch_add_row(statement->result, table->pager, &row, false);
   }
+  free(counts);
+  return EXECUTE_SUCCESS;
 }
 
 /**
- * Opens the database file and initializes a Pager structure.
- * @param filename Name of the database file to open.
- * @return Pointer to the initialized Pager structure.
+ * Builds the summary of a leaf from its cells.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the leaf.
+ * @param node Pointer to the leaf.
  */
 
-Pager* pager_open(const char* filename) {
-// Open the database file with read/write permissions; create if it doesn't exist
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
-
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
-  }
-  // Determine the length of the file
-  off_t file_length = lseek(fd, 0, SEEK_END);
-  // Allocate and initialize the Pager structure
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
-  // Check for file corruption: file length should be a multiple of PAGE_SIZE
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
-  }
-  // Initialize all page pointers to NULL
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+void leaf_summary_build(Table* table, uint32_t page_num, void* node) {
+  // Concurrent readers may summarize the same leaf
+  PageShard* shard = page_shard(&table->pager->cache, page_num);
+  pthread_mutex_lock(&shard->latch);
+  LeafSummary* summary = &table->pager->leaf_summaries[page_num];
+  summary->min_username_code = UINT32_MAX;
+  summary->max_username_code = 0;
+  summary->min_domain_code = UINT32_MAX;
+  summary->max_domain_code = 0;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t username_code = row_dictionary_code(leaf_node_value(node, i), DICTIONARY_COLUMN_USERNAME);
+    uint32_t domain_code = row_dictionary_code(leaf_node_value(node, i), DICTIONARY_COLUMN_DOMAIN);
+    summary->min_username_code = username_code < summary->min_username_code ? username_code : summary->min_username_code;
+    summary->max_username_code = username_code > summary->max_username_code ? username_code : summary->max_username_code;
+    summary->min_domain_code = domain_code < summary->min_domain_code ? domain_code : summary->min_domain_code;
+    summary->max_domain_code = domain_code > summary->max_domain_code ? domain_code : summary->max_domain_code;
   }
-
-  return pager;
+  // The other pages sharing the bitmap's byte are in other shards
+  __atomic_or_fetch(&table->pager->summarized_pages[page_num / 8], (uint8_t)(1 << (page_num % 8)),
+                    __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&shard->latch);
 }
 
 /**
- * Opens a database file and initializes a Table structure.
- * @param filename Name of the database file to open.
- * @return Pointer to the initialized Table structure.
+ * Tells whether a page is a leaf known to hold no row with a given code.
+ * @param table Pointer to the Table structure.
+ * @param page_num The page number.
+ * @param column The column filtered on.
+ * @param code The code the column must equal.
+ * @return True if the page's summary is up to date and excludes the code.
  */
 
-Table* db_open(const char* filename) {
-  // Open the pager for the database file
-  Pager* pager = pager_open(filename);
-  // Allocate and initialize the Table structure
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
-
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+bool leaf_summary_excludes(Table* table, uint32_t page_num, DictionaryColumn column, uint32_t code) {
+  PageShard* shard = page_shard(&table->pager->cache, page_num);
+  pthread_mutex_lock(&shard->latch);
+  bool excludes = false;
+  if (bitmap_test(table->pager->summarized_pages, page_num)) {
+    LeafSummary* summary = &table->pager->leaf_summaries[page_num];
+    if (column == DICTIONARY_COLUMN_USERNAME) {
+      excludes = code < summary->min_username_code || code > summary->max_username_code;
+    } else {
+      excludes = code < summary->min_domain_code || code > summary->max_domain_code;
+    }
   }
-
-  return table;
+  pthread_mutex_unlock(&shard->latch);
+  return excludes;
 }
 
-#define MAX_QUERY_LEN 1024  // Define the maximum length for the query string
-
 /**
- * Executes the Python script to convert natural language input to a database query.
- * 
- * @param user_input The natural language input from the user.
- * @return A string containing the translated database query.
+ * Prints the rows of a subtree whose dictionary column equals a code, in key
+ * order. Leaves whose summary excludes the code are skipped without being read;
+ * the others are summarized as they are scanned. The walk stops once the
+ * statement is over budget.
+ * @param statement Pointer to the SELECT Statement.
+ * @param table Pointer to the Table structure.
+ * @param page_num Page number of the root of the subtree.
+ * @param where_code The code the filtered column must equal.
  */
-char* get_db_query(const char* user_input) {
-    char command[MAX_QUERY_LEN];
-    sprintf(command, "python3 model_old/lora.py \"%s\"", user_input);
-    printf("Executing command: %s\n", command);  // Debug print
 
-    FILE* fp = popen(command, "r");
-    if (fp == NULL) {
-        printf("Failed to run command\n");
-        exit(1);
+void select_filtered_subtree(Statement* statement, Table* table, uint32_t page_num, uint32_t where_code) {
+  if (statement->over_budget != NULL ||
+      leaf_summary_excludes(table, page_num, statement->where_column, where_code)) {
+    return;
+  }
+  void* node = get_page(table->pager, page_num);
+  if (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      // Fetch the node again: the pages of the children are read meanwhile
+      node = get_page(table->pager, page_num);
+      select_filtered_subtree(statement, table, *internal_node_child(node, i), where_code);
     }
+    node = get_page(table->pager, page_num);
+    select_filtered_subtree(statement, table, *internal_node_right_child(node), where_code);
+    return;
+  }
 
-    static char translated_query[MAX_QUERY_LEN];
-    if (fgets(translated_query, sizeof(translated_query), fp) == NULL) {
-        printf("Failed to read output\n");  // Debug print
+  if (statement_over_budget(statement, table)) {
+    return;
+  }
+  Row row;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    void* value = leaf_node_value(node, i);
+    if (row_dictionary_code(value, statement->where_column) != where_code) {
+      continue;
     }
-    printf("Script output before trimming: '%s'\n", translated_query);  // Debug print
+    deserialize_row(value, &row);
+    if (statement->has_tenant && row.tenant_id != statement->tenant_id) {
+      continue;
+    }
+    dictionary_decode_row(&table->dictionary, &row);
+    select_emit_row(statement, table, &row);
+  }
+  leaf_summary_build(table, page_num, node);
+  pager_trim_cache(table->pager);  // Callers fetch their nodes again
+}
 
-    // Trim newline character
-    char* newline = strchr(translated_query, '\n');
-    if (newline) {
-        *newline = '\0';  // Replace newline with null terminator
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  // Replicas read the primary's latest commit.
+  if (table->pager->is_replica) {
+    uint64_t generation = table->pager->log_generation;
+    uint64_t sequence = table->pager->log_sequence;
+    replica_catch_up(table->pager);
+    if (table->pager->log_generation != generation || table->pager->log_sequence != sequence) {
+      dictionary_load(table);  // The commits may have added dictionary entries
     }
+  }
+  if (statement->count_by != DICTIONARY_COLUMN_NONE) {
+    return execute_count_by(statement, table);
+  }
+  // An equality filter on a dictionary column compares codes, not strings
+  uint32_t where_code = NO_DICTIONARY_CODE;
+  if (statement->where_column != DICTIONARY_COLUMN_NONE) {
+    where_code = dictionary_find(&table->dictionary, statement->where_value);
+    if (where_code == NO_DICTIONARY_CODE) {
+      return EXECUTE_SUCCESS;  // No row holds a value the dictionary has never seen
+    }
+  }
+  if (where_code != NO_DICTIONARY_CODE) {
+    // Walk the tree rather than the leaf chain, so summaries can skip leaves unread
+    select_filtered_subtree(statement, table, table->root_page_num, where_code);
+    return statement->over_budget == NULL ? EXECUTE_SUCCESS : EXECUTE_OVER_BUDGET;
+  }
+  Cursor* cursor;
+  if (statement->resuming) {
+    uint8_t resume_key[KEY_SIZE];
+    encode_key(statement->resume_tenant, statement->resume_id, resume_key);
+    cursor = table_seek(table, resume_key);
+  } else if (statement->has_tenant) {
+    // A tenant's rows are contiguous in key order: seek to its smallest id
+    uint8_t first_key[KEY_SIZE];
+    encode_key(statement->tenant_id, INT64_MIN, first_key);
+    cursor = table_seek(table, first_key);
+  } else {
+    cursor = table_start(table);
+    if (cursor->end_of_table && statement->result == NULL) {
+      printf("DB is empty.\n");
+      free(cursor);
+      return EXECUTE_SUCCESS;
+    }
+  }
 
-    printf("Script output after trimming: '%s'\n", translated_query);  // Debug print
+  Row row;
+  uint32_t rows_scanned = 0;
+  while (!(cursor->end_of_table)) {
+    if (scan_yield(statement, &cursor, ++rows_scanned, true) || cursor->end_of_table) {
+      break;
+    }
+    deserialize_row(cursor_value(cursor), &row);
+    if (statement->has_tenant && row.tenant_id != statement->tenant_id) {
+      break;  // Past the last row of the tenant
+    }
+    dictionary_decode_row(&table->dictionary, &row);
+    select_emit_row(statement, table, &row);
+    cursor_advance(cursor);
+    pager_trim_cache(table->pager);  // Only the cursor's page number is held here
+  }
 
-    pclose(fp);
-    return translated_query;
+  free(cursor);
+
+  return statement->over_budget == NULL ? EXECUTE_SUCCESS : EXECUTE_OVER_BUDGET;
 }
 
+
 /**
- * Creates a new input buffer for user input.
- * @return Pointer to the initialized InputBuffer structure.
+ * Executes a statement depending on its type (e.g., insert, select).
+ * 
+ * @param statement Pointer to the Statement structure representing the operation to execute.
+ * @param table Pointer to the Table structure representing the database table.
+ * @param transaction Pointer to the connection's Transaction, which buffers inserts while active.
+ * @return ExecuteResult indicating the result of the execution.
  */
 
-InputBuffer* new_input_buffer() {
-// Allocate and initialize the InputBuffer structure  
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
-
-  return input_buffer;
+ExecuteResult execute_statement(Statement* statement, Table* table, Transaction* transaction) {
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      if (transaction->active) {
+        return transaction_add_rows(table, transaction, &statement->row_to_insert, 1);
+      }
+      return execute_insert(statement, table);
+    case (STATEMENT_INSERT_BATCH):
+      if (transaction->active) {
+        return transaction_add_rows(table, transaction, statement->batch_rows, statement->batch_size);
+      }
+      return execute_insert_batch(statement, table);
+    case (STATEMENT_SELECT):
+      return execute_select(statement, table);
+    case (STATEMENT_BEGIN):
+    case (STATEMENT_COMMIT):
+    case (STATEMENT_ROLLBACK):
+      return execute_transaction(statement, table, transaction);
+  }
 }
 
 /**
- * Prints the database prompt.
+ * Runs a parsed statement, or resumes a suspended one. A SELECT that suspends
+ * leaves a copy of itself in its ResultBatch.
+ * @param statement Pointer to the Statement.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the connection's Transaction.
+ * @param error Receives the message of a failed statement, ERROR_MESSAGE_SIZE bytes.
+ * @return True on success.
  */
 
-void print_prompt() { printf("db > "); }
+bool run_prepared_statement(Statement* statement, Table* table, Transaction* transaction,
+                            char* error) {
+  if (!statement->resuming) {
+    statement->workload = statement_workload(statement);
+    if (statement->type == STATEMENT_INSERT_BATCH) {
+      statement->memory = statement->batch_size * sizeof(Row);  // The batch is sorted in place
+    }
+  }
+  // Row locks are taken before the statement latch
+  LockResult lock_result = transaction_lock_rows(table, transaction, statement);
+  ExecuteResult execute_result = lock_result == LOCK_WAIT ? EXECUTE_LOCK_WAIT : EXECUTE_LOCK_CONFLICT;
+  if (lock_result == LOCK_GRANTED) {
+    Pager* pager = table->pager;
+    // SELECTs on a primary only read pages, and run alongside each other.
+    // Replicas change pages to catch up first.
+    statement->shared_latch = statement->type == STATEMENT_SELECT && !pager->is_replica;
+    if (statement->shared_latch) {
+      statement_latch_lock_shared(pager);
+    } else {
+      statement_latch_lock(pager);
+    }
+    statement->cpu_start_us = thread_cpu_microseconds();
+    if (statement_over_budget(statement, table)) {
+      execute_result = EXECUTE_OVER_BUDGET;
+    } else {
+      // Pages the statement reads are counted, and a scan's evicted behind it
+      statement_pages_read = &statement->pages_read;
+      statement_scan_ring = statement->type == STATEMENT_SELECT ? &statement->ring : NULL;
+      execute_result = execute_statement(statement, table, transaction);
+      statement_pages_read = NULL;
+      statement_scan_ring = NULL;
+    }
+    pager_trim_cache(pager);
+    statement->cpu_us += thread_cpu_microseconds() - statement->cpu_start_us;
+    Workload* workload = &table->workloads[statement->workload];
+    __atomic_add_fetch(&workload->statements, !statement->resuming, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&workload->aborted, execute_result == EXECUTE_OVER_BUDGET, __ATOMIC_RELAXED);
+    if (statement->shared_latch) {
+      statement_latch_unlock_shared(pager);
+    } else {
+      statement_latch_unlock(pager);
+    }
+  }
+  // A parked statement keeps the locks it took until it runs again
+  if ((!transaction->active && execute_result != EXECUTE_LOCK_WAIT) ||
+      execute_result == EXECUTE_LOCK_CONFLICT) {
+    transaction_end(table, transaction);
+  }
+  free(statement->batch_rows);
+  statement->batch_rows = NULL;
+  if (statement->suspended) {
+    statement->result->suspended = malloc(sizeof(Statement));
+    memcpy(statement->result->suspended, statement, sizeof(Statement));
+  }
+
+  switch (execute_result) {
+    case EXECUTE_SUCCESS:
+      // printf("Executed.\n");
+      return true;
+    case EXECUTE_DUPLICATE_KEY:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Duplicate key.");
+      break;
+    case EXECUTE_READ_ONLY:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Read-only replica.");
+      break;
+    case EXECUTE_LOCK_CONFLICT:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Lock conflict, transaction rolled back.");
+      break;
+    case EXECUTE_LOCK_WAIT:
+      error[0] = '\0';  // Not an error: the statement runs again once the row is released
+      break;
+    case EXECUTE_NO_TRANSACTION:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: No transaction is open.");
+      break;
+    case EXECUTE_IN_TRANSACTION:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: A transaction is already open.");
+      break;
+    case EXECUTE_OVER_BUDGET:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Statement exceeded its %s budget.",
+               statement->over_budget);
+      break;
+    case EXECUTE_TABLE_FULL:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Table full.");
+      break;
+    case EXECUTE_DISK_FULL:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Error: Disk full.");
+      break;
+  }
+  return false;
+}
 
 /**
- * Reads user input into an InputBuffer.
- * @param input_buffer Pointer to the InputBuffer structure.
+ * Prepares a statement, describing why it could not be.
+ * @param input_buffer Pointer to the InputBuffer holding the line.
+ * @param statement Pointer to the Statement to prepare.
+ * @param error Receives the message of a failed preparation, ERROR_MESSAGE_SIZE bytes.
+ * @return True on success.
  */
 
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-  // Error handling for getline failure
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+bool prepare_statement_or_error(InputBuffer* input_buffer, Statement* statement, char* error) {
+  switch (prepare_statement(input_buffer, statement)) {
+    case PREPARE_SUCCESS:
+      return true;
+    case PREPARE_INVALID_ID:
+      snprintf(error, ERROR_MESSAGE_SIZE, "ID must be an integer or tenant:id.");
+      break;
+    case PREPARE_STRING_TOO_LONG:
+      snprintf(error, ERROR_MESSAGE_SIZE, "String is too long.");
+      break;
+    case PREPARE_SYNTAX_ERROR:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Syntax error. Could not parse statement.");
+      break;
+    case PREPARE_UNRECOGNIZED_STATEMENT:
+      snprintf(error, ERROR_MESSAGE_SIZE, "Unrecognized keyword at start of '%s'.",
+               input_buffer->buffer);
+      break;
   }
-
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
+  return false;
 }
 
 /**
- * Closes and frees an InputBuffer.
- * @param input_buffer Pointer to the InputBuffer structure to close.
+ * Runs one line of input: a meta-command or a statement.
+ * @param input_buffer Pointer to the InputBuffer holding the line.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the connection's Transaction.
+ * @param result Collects the rows of a SELECT for a client, or NULL to print
+ * them. Meta-commands only run in the REPL, where it is NULL.
+ * @param error Receives the message of a failed line, ERROR_MESSAGE_SIZE bytes.
+ * @return True on success.
  */
 
-void close_input_buffer(InputBuffer* input_buffer) {
-  // Free the buffer and the InputBuffer structure itself
-  free(input_buffer->buffer);
-  free(input_buffer);
+bool run_statement(InputBuffer* input_buffer, Table* table, Transaction* transaction,
+                   ResultBatch* result, char* error) {
+  if (input_buffer->buffer[0] == '.') {
+    if (result != NULL) {
+      snprintf(error, ERROR_MESSAGE_SIZE, "Meta commands only run in the REPL.");
+      return false;
+    }
+    // Pages are only read or changed under the statement latch, which
+    // the flusher takes to sync deferred commits between statements
+    statement_latch_lock(table->pager);
+    MetaCommandResult meta_result = do_meta_command(input_buffer, table);
+    pager_trim_cache(table->pager);
+    statement_latch_unlock(table->pager);
+    if (meta_result == META_COMMAND_UNRECOGNIZED_COMMAND) {
+      snprintf(error, ERROR_MESSAGE_SIZE, "Unrecognized command '%s'", input_buffer->buffer);
+      return false;
+    }
+    return true;
+  }
+
+  Statement statement;
+  if (!prepare_statement_or_error(input_buffer, &statement, error)) {
+    return false;
+  }
+  statement.result = result;
+  return run_prepared_statement(&statement, table, transaction, error);
 }
 
 /**
- * Flushes a page to disk.
- * @param pager Pointer to the Pager structure.
- * @param page_num The page number to flush.
+ * Runs one line of input in the REPL, printing its error if it fails.
+ * @param input_buffer Pointer to the InputBuffer holding the line.
+ * @param table Pointer to the Table structure.
+ * @param transaction Pointer to the REPL's Transaction.
  */
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  // Error handling for null page
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+void run_repl_statement(InputBuffer* input_buffer, Table* table, Transaction* transaction) {
+  char error[ERROR_MESSAGE_SIZE];
+  if (!run_statement(input_buffer, table, transaction, NULL, error)) {
+    printf("%s\n", error);
   }
-  // Seek to the correct location in the file
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+}
 
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-  // Write the page to disk
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+/**
+ * Asks the server to stop, from a signal handler.
+ * @param signal_number The signal received.
+ */
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
+void server_stop(int signal_number) {
+  (void)signal_number;
+  server_stopping = 1;
 }
 
 /**
- * Closes the database, flushing all pages to disk.
- * @param table Pointer to the Table structure.
+ * Writes all of a buffer to a socket.
+ * @param fd The socket.
+ * @param data The bytes to write.
+ * @param length Number of bytes.
+ * @return False if the peer went away.
  */
 
-void db_close(Table* table) {
-  Pager* pager = table->pager;
-  // Flush all pages to disk
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
+bool write_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written == -1 && errno == EINTR) {
       continue;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    length -= written;
   }
-  // Close the file descriptor
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  return true;
+}
+
+void server_release_slot(Connection* connection);
+
+/**
+ * Sends the rows a statement gathered, then its WIRE_DONE frame unless it was
+ * suspended, in which case the connection keeps it to resume later. A finished
+ * statement gives back its running slot.
+ * @param connection Pointer to the Connection.
+ * @param success Whether the statement succeeded.
+ * @param error The message of a failed statement.
+ */
+
+void connection_end_statement(Connection* connection, bool success, const char* error) {
+  ResultBatch* result = connection->result;
+  if (!success) {
+    wire_append_frame(&connection->out, WIRE_DONE, 1, error, strlen(error));
+    server_release_slot(connection);
+    return;
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  result_batch_flush(result);
+  if (result->suspended != NULL) {
+    connection->suspended = result->suspended;
+    result->suspended = NULL;
+    return;
   }
-  // Free the Pager and Table structures
-  free(pager);
-  free(table);
+  wire_append_frame(&connection->out, WIRE_DONE, 0, NULL, 0);
+  server_release_slot(connection);
 }
 
 /**
- * Executes a meta-command.
- * @param input_buffer Pointer to the InputBuffer containing the command.
- * @param table Pointer to the Table structure.
- * @return Result of the meta-command execution.
+ * Appends a connection to the wait queue of its statement's class. The caller
+ * holds the server's lock.
+ * @param connection Pointer to the Connection.
  */
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-  // Handle the ".exit" command
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    close_input_buffer(input_buffer);
-    db_close(table);
-    exit(EXIT_SUCCESS);
-    // Handle the ".btree" command to print the B-tree
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-    // Handle the ".constants" command to print constants
-  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
+void server_wait_queue_locked(Connection* connection) {
+  Server* server = connection->server;
+  WorkloadClass workload = connection->workload;
+  connection->next_ready = NULL;
+  if (server->waiting_tail[workload] == NULL) {
+    server->waiting_head[workload] = connection;
   } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    server->waiting_tail[workload]->next_ready = connection;
   }
+  server->waiting_tail[workload] = connection;
+  server->table->workloads[workload].queued++;
 }
 
 /**
- * Prepares an INSERT statement.
- * @param input_buffer Pointer to the InputBuffer containing the command.
- * @param statement Pointer to the Statement structure to be prepared.
- * @return Result of the preparation process.
+ * Takes a connection that gave up waiting out of its class's wait queue. The
+ * caller holds the server's lock.
+ * @param connection Pointer to the Connection.
  */
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
-
-  // Tokenize the input to extract individual components
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* username = strtok(NULL, " ");  // First input is now name
-  char* id_string = strtok(NULL, " "); // Second input is id
-  char* email = strtok(NULL, " ");     // Third input is email
-
-  // Syntax validation
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+void server_leave_wait_queue_locked(Connection* connection) {
+  Server* server = connection->server;
+  WorkloadClass workload = connection->workload;
+  Connection* previous = NULL;
+  Connection* waiter = server->waiting_head[workload];
+  while (waiter != NULL && waiter != connection) {
+    previous = waiter;
+    waiter = waiter->next_ready;
   }
-
-  int id = atoi(id_string); // Convert id to integer
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+  if (waiter == NULL) {
+    return;
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (previous == NULL) {
+    server->waiting_head[workload] = connection->next_ready;
+  } else {
+    previous->next_ready = connection->next_ready;
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (server->waiting_tail[workload] == connection) {
+    server->waiting_tail[workload] = previous;
   }
-  // Set the values in the statement
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
 }
 
-
 /**
- * Prepares a statement based on input.
- * @param input_buffer Pointer to the InputBuffer containing the command.
- * @param statement Pointer to the Statement structure to be prepared.
- * @return Result of the preparation process.
+ * Takes a running slot for a client's statement if its workload class has one
+ * free. A shared-memory client has a thread of its own, which waits here in
+ * the class's queue, in turn with the other clients, until a slot is handed
+ * to it.
+ * @param connection Pointer to the Connection.
+ * @param workload The class of the statement.
+ * @return False if the statement must wait for a slot, or for a shared-memory
+ * client, if the server stopped first.
  */
 
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
-    // Check if input is a natural language command
-    if (strncmp(input_buffer->buffer, "Ada ", 4) == 0) {
-        // Call Python script to get SQL query
-        char* sql_query = get_db_query(input_buffer->buffer + 4);
-        strncpy(input_buffer->buffer, sql_query, input_buffer->buffer_length - 1);
-        input_buffer->buffer[input_buffer->buffer_length - 1] = '\0'; // Ensure null termination
-    }
-
-    // Existing logic to prepare INSERT and SELECT statements
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-        return prepare_insert(input_buffer, statement);
+bool server_admit(Connection* connection, WorkloadClass workload) {
+  Server* server = connection->server;
+  uint32_t max_running = server->table->workloads[workload].max_running;
+  if (connection->admitted || max_running == 0) {
+    return true;  // Admitted already when a slot was handed over while waiting
+  }
+  connection->workload = workload;
+  pthread_mutex_lock(&server->lock);
+  bool admitted = server->running[workload] < max_running;
+  if (admitted) {
+    server->running[workload]++;
+    connection->admitted = true;
+  } else if (connection->shm != NULL) {
+    server_wait_queue_locked(connection);
+    while (!connection->admitted && !server_stopping) {
+      pthread_cond_wait(&server->slot_cond, &server->lock);
     }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+    if (!connection->admitted) {
+      server_leave_wait_queue_locked(connection);
     }
+    admitted = connection->admitted;
+  }
+  pthread_mutex_unlock(&server->lock);
+  return admitted;
+}
 
-    // Handle unrecognized statements
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+/**
+ * Runs one statement of a client and appends its rows and WIRE_DONE frame to
+ * the connection's output, unless its workload class has no slot free or it
+ * must wait for a younger transaction's row lock.
+ * @param connection Pointer to the Connection.
+ * @param table Pointer to the Table structure.
+ * @param input_buffer Scratch buffer receiving the text of the statement.
+ * @param text The statement, ending at its first padding byte.
+ * @param length Bytes of the padded text.
+ * @return False if the statement must run again once it gets a slot, as refused
+ * says, or the row lock, as lock_waiting says.
+ */
+
+bool connection_run_statement(Connection* connection, Table* table, InputBuffer* input_buffer,
+                              const char* text, size_t length) {
+  size_t text_length = strnlen(text, length);
+  if (input_buffer->buffer_length < text_length + 1) {
+    input_buffer->buffer_length = text_length + 1;
+    input_buffer->buffer = realloc(input_buffer->buffer, input_buffer->buffer_length);
+  }
+  memcpy(input_buffer->buffer, text, text_length);
+  input_buffer->buffer[text_length] = '\0';
+  input_buffer->input_length = text_length;
+
+  char error[ERROR_MESSAGE_SIZE];
+  if (input_buffer->buffer[0] == '.') {
+    bool success = run_statement(input_buffer, table, &connection->transaction, connection->result, error);
+    connection_end_statement(connection, success, error);
+    return true;
+  }
+  Statement statement;
+  if (!prepare_statement_or_error(input_buffer, &statement, error)) {
+    connection_end_statement(connection, false, error);
+    return true;
+  }
+  if (!server_admit(connection, statement_workload(&statement))) {
+    free(statement.batch_rows);
+    connection->refused = true;
+    return false;
+  }
+  statement.result = connection->result;
+  bool success = run_prepared_statement(&statement, table, &connection->transaction, error);
+  if (connection->transaction.waiting) {
+    // Parked on a row lock: the slot goes to others until the statement runs again
+    server_release_slot(connection);
+    connection->lock_waiting = true;
+    return false;
+  }
+  connection_end_statement(connection, success, error);
+  return true;
 }
 
+/**
+ * Continues the SELECT a connection suspended to let others run.
+ * @param connection Pointer to the Connection.
+ * @param table Pointer to the Table structure.
+ */
+
+void connection_resume_statement(Connection* connection, Table* table) {
+  Statement* statement = connection->suspended;
+  connection->suspended = NULL;
+  statement->result = connection->result;
+  statement->suspended = false;
+  statement->resuming = true;
+  char error[ERROR_MESSAGE_SIZE];
+  bool success = run_prepared_statement(statement, table, &connection->transaction, error);
+  free(statement);
+  connection_end_statement(connection, success, error);
+}
 
 /**
- * Gets the number of the next unused page in the pager.
- * @param pager Pointer to the Pager structure.
- * @return The page number of the next unused page.
+ * Points a request and a response ring at their parts of a shared region.
+ * @param region The mapped ShmRegion.
+ * @param requests Receives the request ring.
+ * @param responses Receives the response ring.
+ * @param peer_fd Socket to the other side.
  */
 
-uint32_t get_unused_page_num(Pager* pager) { 
-  // Return the current number of pages as the next unused page number
-  return pager->num_pages; 
+void shm_region_rings(ShmRegion* region, ShmRing* requests, ShmRing* responses, int peer_fd) {
+  requests->header = &region->requests;
+  requests->data = (char*)(region + 1);
+  requests->peer_fd = peer_fd;
+  responses->header = &region->responses;
+  responses->data = (char*)(region + 1) + SHM_RING_SIZE;
+  responses->peer_fd = peer_fd;
 }
 
 /**
- * Handles splitting the root node and creating a new root.
- * @param table Pointer to the Table structure.
- * @param right_child_page_num Page number of the new right child.
+ * Moves a client to shared memory, on its WIRE_SHM_ATTACH frame. The region is
+ * unlinked as soon as it is created and its descriptor is passed over the
+ * socket, so it disappears with the two processes. Responses already queued
+ * are sent first; the socket then only tells each side that the other is gone.
+ * @param connection Pointer to the Connection.
+ * @return False if the client went away.
  */
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  // Retrieve the current root and right child
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  // Allocate a new page to move the old root data
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
-  // Initialize the new left and right children as internal nodes if necessary
-  if (get_node_type(root) == NODE_INTERNAL) {
-    initialize_internal_node(right_child);
-    initialize_internal_node(left_child);
+bool connection_attach_shm(Connection* connection) {
+  static uint32_t regions_created = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/db-%d-%u", (int)getpid(), regions_created++);
+  int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  ShmRegion* region = MAP_FAILED;
+  if (shm_fd != -1) {
+    shm_unlink(name);
+    if (ftruncate(shm_fd, SHM_REGION_SIZE) == 0) {
+      region = mmap(NULL, SHM_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    }
   }
-
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
-  // Update the parent pointers of all children of the left child
-  if (get_node_type(left_child) == NODE_INTERNAL) {
-    void* child;
-    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-      child = get_page(table->pager, *internal_node_child(left_child,i));
-      *node_parent(child) = left_child_page_num;
+  if (region == MAP_FAILED) {
+    if (shm_fd != -1) {
+      close(shm_fd);
     }
-    child = get_page(table->pager, *internal_node_right_child(left_child));
-    *node_parent(child) = left_child_page_num;
+    const char* error = "Unable to set up shared memory.";
+    wire_append_frame(&connection->out, WIRE_DONE, 1, error, strlen(error));
+    return true;
   }
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+  // The socket leaves the event loop, so it blocks again
+  fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) & ~O_NONBLOCK);
+  if (!write_all(connection->fd, connection->out.buffer.data, connection->out.buffer.length)) {
+    munmap(region, SHM_REGION_SIZE);
+    close(shm_fd);
+    return false;
+  }
+  connection->out.buffer.length = 0;
+  WireHeader header = {0, WIRE_DONE, 0, 0};
+  struct iovec vector = {&header, sizeof(header)};
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  struct cmsghdr* descriptor = CMSG_FIRSTHDR(&message);
+  descriptor->cmsg_level = SOL_SOCKET;
+  descriptor->cmsg_type = SCM_RIGHTS;
+  descriptor->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(descriptor), &shm_fd, sizeof(int));
+  ssize_t sent = sendmsg(connection->fd, &message, 0);
+  close(shm_fd);
+  if (sent != sizeof(header)) {
+    munmap(region, SHM_REGION_SIZE);
+    return false;
+  }
+  connection->shm = region;
+  shm_region_rings(region, &connection->requests, &connection->responses, connection->fd);
+  connection->out.ring = &connection->responses;
+  return true;
 }
 
+/**
+ * Tells whether a client has work for a worker: a suspended SELECT, or a frame
+ * in its input, complete or with a header breaking the protocol.
+ * @param connection Pointer to the Connection.
+ * @return True if connection_handle_frames has something to do.
+ */
 
-
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num);
+bool connection_has_frame(Connection* connection) {
+  if (connection->suspended != NULL) {
+    return true;
+  }
+  size_t available = connection->in.length - connection->in_position;
+  if (available < sizeof(WireHeader)) {
+    return false;
+  }
+  WireHeader header;
+  memcpy(&header, connection->in.data + connection->in_position, sizeof(header));
+  return header.length > WIRE_MAX_FRAME_SIZE || available >= sizeof(header) + header.length;
+}
 
 /**
- * Adds a new child/key pair to a parent internal node.
+ * Handles the complete frames a client has sent, up to WORKER_QUANTUM
+ * statements or until a SELECT suspends or a statement must wait for a slot,
+ * appending the responses to its output. Pipelined statements run
+ * in order and their responses follow each other in the same order. A client
+ * moving to shared memory sends nothing more over the socket.
+ * @param connection Pointer to the Connection.
  * @param table Pointer to the Table structure.
- * @param parent_page_num Page number of the parent internal node.
- * @param child_page_num Page number of the child node to be added.
+ * @param input_buffer Scratch buffer receiving the text of each statement.
+ * @return False if the client broke the protocol and must be dropped.
  */
 
-void internal_node_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-  /*
-  Add a new child/key pair to parent that corresponds to child
-  */
-
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table->pager, child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
-
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-
-  if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
-    internal_node_split_and_insert(table, parent_page_num, child_page_num);
-    return;
+bool connection_handle_frames(Connection* connection, Table* table, InputBuffer* input_buffer) {
+  for (uint32_t statements = 0; statements < WORKER_QUANTUM && connection->shm == NULL; statements++) {
+    if (connection->suspended != NULL) {
+      connection_resume_statement(connection, table);
+      if (connection->suspended != NULL) {
+        return true;  // Suspended again: others are still waiting
+      }
+      continue;
+    }
+    if (!connection_has_frame(connection)) {
+      return true;
+    }
+    WireHeader header;
+    memcpy(&header, connection->in.data + connection->in_position, sizeof(header));
+    if ((header.type != WIRE_STATEMENT && header.type != WIRE_SHM_ATTACH) ||
+        header.length > WIRE_MAX_FRAME_SIZE) {
+      return false;
+    }
+    const char* text = connection->in.data + connection->in_position + sizeof(header);
+    if (header.type == WIRE_SHM_ATTACH) {
+      connection->in_position += sizeof(header) + header.length;
+      return connection_attach_shm(connection);
+    }
+    if (!connection_run_statement(connection, table, input_buffer, text, header.length)) {
+      return true;  // The frame stays until a slot or the row lock is free
+    }
+    connection->in_position += sizeof(header) + header.length;
   }
+  return true;
+}
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  /*
-  An internal node with a right child of INVALID_PAGE_NUM is empty
-  */
-  if (right_child_page_num == INVALID_PAGE_NUM) {
-    *internal_node_right_child(parent) = child_page_num;
-    return;
-  }
+bool server_wait_lock(Connection* connection);
 
-  void* right_child = get_page(table->pager, right_child_page_num);
-  /*
-  If we are already at the max number of cells for a node, we cannot increment
-  before splitting. Incrementing without inserting a new key/child pair
-  and immediately calling internal_node_split_and_insert has the effect
-  of creating a new key at (max_cells + 1) with an uninitialized value
-  */
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+/**
+ * Serves a client over shared memory until it disconnects or the server is
+ * stopped. Statements are run straight from the request ring and rows written
+ * straight into the response ring.
+ * @param connection Pointer to the Connection of the client.
+ * @param table Pointer to the Table structure.
+ * @param input_buffer Scratch buffer for statement text.
+ */
 
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+void connection_serve_shm(Connection* connection, Table* table, InputBuffer* input_buffer) {
+  WireHeader frame;
+  const char* payload;
+  while ((payload = shm_ring_next(&connection->requests, &frame)) != NULL) {
+    if (frame.type != WIRE_STATEMENT) {
+      return;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    if (!connection_run_statement(connection, table, input_buffer, payload, frame.length)) {
+      // A statement is only refused a slot when the server stops. One parked
+      // on a row lock runs again from the same frame once the lock is released.
+      if (!connection->lock_waiting || !server_wait_lock(connection)) {
+        return;
+      }
+      continue;
+    }
+    shm_ring_consume(&connection->requests, &frame);
   }
 }
 
 /**
- * Updates a key in an internal node.
- * @param node Pointer to the internal node.
- * @param old_key The key to be replaced.
- * @param new_key The new key to replace with.
+ * Frees the rows and column buffers of a ResultBatch.
+ * @param batch Pointer to the ResultBatch.
  */
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+void result_batch_free(ResultBatch* batch) {
+  free(batch->usernames.data);
+  free(batch->emails.data);
+  free(batch->payloads.data);
+  free(batch);
 }
 
 /**
- * Splits an internal node and inserts a new child.
- * @param table Pointer to the Table structure.
- * @param parent_page_num Page number of the parent internal node.
- * @param child_page_num Page number of the child node to be inserted.
+ * Counts a client connecting or leaving. At most one statement per worker runs
+ * at a time, so that many connections can join a group commit. The event loop
+ * never waits for the latch: the flusher rereads the count whenever it wakes.
+ * @param server Pointer to the Server.
+ * @param delta 1 for a new client, -1 for one leaving.
  */
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-  uint32_t old_page_num = parent_page_num;
-  void* old_node = get_page(table->pager,parent_page_num);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
+void server_count_connection(Server* server, int delta) {
+  uint32_t connections = __atomic_add_fetch(&server->num_connections, delta, __ATOMIC_RELAXED);
+  uint32_t joiners = connections < server->num_workers ? connections : server->num_workers;
+  __atomic_store_n(&server->table->pager->connections, joiners, __ATOMIC_RELAXED);
+}
 
-  void* child = get_page(table->pager, child_page_num); 
-  uint32_t child_max = get_node_max_key(table->pager, child);
+/**
+ * Closes a client's connection. A client that goes away rolls back its open
+ * transaction.
+ * @param connection Pointer to the Connection, freed.
+ */
 
-  uint32_t new_page_num = get_unused_page_num(table->pager);
+void connection_close(Connection* connection) {
+  Server* server = connection->server;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  transaction_end(server->table, &connection->transaction);
+  free(connection->transaction.rows);
+  free(connection->transaction.locked_keys);
+  free(connection->suspended);
+  server_release_slot(connection);
+  if (connection->shm != NULL) {
+    munmap(connection->shm, SHM_REGION_SIZE);
+  }
+  server_count_connection(server, -1);
+  free(connection->in.data);
+  free(connection->out.buffer.data);
+  free(connection);
+}
 
-  /*
-  Declaring a flag before updating pointers which
-  records whether this operation involves splitting the root -
-  if it does, we will insert our newly created node during
-  the step where the table's new root is created. If it does
-  not, we have to insert the newly created node into its parent
-  after the old node's keys have been transferred over. We are not
-  able to do this if the newly created node's parent is not a newly
-  initialized root node, because in that case its parent may have existing
-  keys aside from our old node which we are splitting. If that is true, we
-  need to find a place for our newly created node in its parent, and we
-  cannot insert it at the correct index if it does not yet have any keys
-  */
-  uint32_t splitting_root = is_node_root(old_node);
+/**
+ * Gives a buffer a connection is done with to the server's spares, or frees it.
+ * @param server Pointer to the Server.
+ * @param buffer The buffer, emptied.
+ */
 
-  void* parent;
-  void* new_node;
-  if (splitting_root) {
-    create_new_root(table, new_page_num);
-    parent = get_page(table->pager,table->root_page_num);
-    /*
-    If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child
-    */
-    old_page_num = *internal_node_child(parent,0);
-    old_node = get_page(table->pager, old_page_num);
-  } else {
-    parent = get_page(table->pager,*node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
-    initialize_internal_node(new_node);
+void server_release_buffer(Server* server, ByteBuffer* buffer) {
+  if (buffer->data == NULL) {
+    return;
   }
-  
-  uint32_t* old_num_keys = internal_node_num_keys(old_node);
+  pthread_mutex_lock(&server->lock);
+  if (server->num_spare_buffers < SERVER_SPARE_BUFFERS && buffer->capacity <= 2 * WIRE_READ_SIZE) {
+    server->spare_buffers[server->num_spare_buffers++] = (ByteBuffer){buffer->data, 0, buffer->capacity};
+    buffer->data = NULL;
+  }
+  pthread_mutex_unlock(&server->lock);
+  free(buffer->data);
+  *buffer = (ByteBuffer){NULL, 0, 0};
+}
 
-  uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void* cur = get_page(table->pager, cur_page_num);
+/**
+ * Gives a spare buffer to a connection that has none.
+ * @param server Pointer to the Server.
+ * @param buffer The connection's buffer.
+ */
 
-  /*
-  First put right child into new node and set right child of old node to invalid page number
-  */
-  internal_node_insert(table, new_page_num, cur_page_num);
-  *node_parent(cur) = new_page_num;
-  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-  /*
-  For each key until you get to the middle key, move the key and the child to the new node
-  */
-  for (int i = INTERNAL_NODE_MAX_KEYS - 1; i > INTERNAL_NODE_MAX_KEYS / 2; i--) {
-    cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+void server_acquire_buffer(Server* server, ByteBuffer* buffer) {
+  if (buffer->data != NULL) {
+    return;
+  }
+  pthread_mutex_lock(&server->lock);
+  if (server->num_spare_buffers > 0) {
+    *buffer = server->spare_buffers[--server->num_spare_buffers];
+  }
+  pthread_mutex_unlock(&server->lock);
+}
 
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
+/**
+ * Hands a connection back to the event loop until its socket is ready.
+ * @param connection Pointer to the Connection.
+ * @param events EPOLLIN to wait for input, EPOLLOUT to wait for room to write.
+ */
+
+void connection_park(Connection* connection, uint32_t events) {
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = connection;
+  epoll_ctl(connection->server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/**
+ * Appends a connection to the ready queue, waking a worker. The caller holds
+ * the server's lock.
+ * @param connection Pointer to the Connection.
+ */
 
-    (*old_num_keys)--;
+void server_queue_locked(Connection* connection) {
+  Server* server = connection->server;
+  connection->next_ready = NULL;
+  if (server->ready_tail == NULL) {
+    server->ready_head = connection;
+  } else {
+    server->ready_tail->next_ready = connection;
   }
+  server->ready_tail = connection;
+  __atomic_add_fetch(&server->num_ready, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&server->ready_cond);
+}
 
-  /*
-  Set child before middle key, which is now the highest key, to be node's right child,
-  and decrement number of keys
-  */
-  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
-  (*old_num_keys)--;
+/**
+ * Appends a connection to the ready queue, waking a worker.
+ * @param connection Pointer to the Connection.
+ */
 
-  /*
-  Determine which of the two nodes after the split should contain the child to be inserted,
-  and insert the child
-  */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+void server_queue(Connection* connection) {
+  pthread_mutex_lock(&connection->server->lock);
+  server_queue_locked(connection);
+  pthread_mutex_unlock(&connection->server->lock);
+}
 
-  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+/**
+ * Puts a connection refused a slot in its class's wait queue, or in the ready
+ * queue if a slot was freed since.
+ * @param connection Pointer to the Connection, its output written.
+ */
 
-  internal_node_insert(table, destination_page_num, child_page_num);
-  *node_parent(child) = destination_page_num;
+void server_wait_slot(Connection* connection) {
+  Server* server = connection->server;
+  WorkloadClass workload = connection->workload;
+  connection->refused = false;
+  pthread_mutex_lock(&server->lock);
+  if (server->running[workload] < server->table->workloads[workload].max_running) {
+    server->running[workload]++;
+    connection->admitted = true;
+    server_queue_locked(connection);
+  } else {
+    server_wait_queue_locked(connection);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
 
-  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+/**
+ * Parks a connection whose statement waits for a row lock, or queues it at once
+ * if the lock was released meanwhile. The thread of a shared-memory client
+ * sleeps here until the lock is released instead.
+ * @param connection Pointer to the Connection, its output written.
+ * @return False if the server stopped before the lock was released.
+ */
 
-  if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
-    *node_parent(new_node) = *node_parent(old_node);
+bool server_wait_lock(Connection* connection) {
+  Server* server = connection->server;
+  connection->lock_waiting = false;
+  pthread_mutex_lock(&server->lock);
+  if (connection->shm != NULL) {
+    while (!connection->lock_released && !server_stopping) {
+      pthread_cond_wait(&server->slot_cond, &server->lock);
+    }
+  } else if (connection->lock_released) {
+    server_queue_locked(connection);
+  } else {
+    connection->lock_parked = true;
+    pthread_mutex_unlock(&server->lock);
+    return true;
   }
+  bool released = connection->lock_released;
+  connection->lock_released = false;
+  pthread_mutex_unlock(&server->lock);
+  return released;
 }
 
 /**
- * Splits a leaf node and inserts a new key-value pair into the appropriate leaf node.
- * This function is called when the current leaf node is full and needs to split into two nodes.
- * 
- * @param cursor Pointer to the Cursor structure representing the position in the tree.
- * @param key The key to be inserted.
- * @param value Pointer to the Row structure representing the value to be inserted.
+ * Runs the statement of a connection waiting for a row lock again, once a
+ * holder released the row: LockManager's wake for the server. The worker that
+ * ran the statement may not have parked the connection yet, in which case it
+ * queues it itself.
+ * @param waiter Pointer to the Connection.
  */
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
-  */
+void server_wake_lock_waiter(void* waiter) {
+  Connection* connection = waiter;
+  Server* server = connection->server;
+  pthread_mutex_lock(&server->lock);
+  if (connection->lock_parked) {
+    connection->lock_parked = false;
+    server_queue_locked(connection);
+  } else {
+    connection->lock_released = true;
+    pthread_cond_broadcast(&server->slot_cond);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
 
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+/**
+ * Gives back the running slot a connection holds, handing it straight to the
+ * oldest connection waiting for one of the same class: a socket client is
+ * queued for a worker, and the thread of a shared-memory client woken.
+ * @param connection Pointer to the Connection.
+ */
 
-  /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
+void server_release_slot(Connection* connection) {
+  if (!connection->admitted) {
+    return;
+  }
+  Server* server = connection->server;
+  WorkloadClass workload = connection->workload;
+  connection->admitted = false;
+  pthread_mutex_lock(&server->lock);
+  Connection* waiter = server->waiting_head[workload];
+  if (waiter != NULL) {
+    server->waiting_head[workload] = waiter->next_ready;
+    if (server->waiting_head[workload] == NULL) {
+      server->waiting_tail[workload] = NULL;
+    }
+    waiter->admitted = true;
+    if (waiter->shm != NULL) {
+      pthread_cond_broadcast(&server->slot_cond);
     } else {
-      destination_node = old_node;
+      server_queue_locked(waiter);
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
+  } else {
+    server->running[workload]--;
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Moves a connection on once the thread owning it is done with it: writes what
+ * it can of the output, then queues the connection if it has statements to
+ * run, closes it if the client is gone, or parks it. Only one thread owns a
+ * connection at a time, as the event loop watches it in one-shot mode.
+ * @param connection Pointer to the Connection.
+ */
 
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+void connection_continue(Connection* connection) {
+  ByteBuffer* out = &connection->out.buffer;
+  while (connection->out_position < out->length) {
+    ssize_t written = write(connection->fd, out->data + connection->out_position,
+                            out->length - connection->out_position);
+    if (written > 0) {
+      connection->out_position += written;
+    } else if (written == -1 && errno == EINTR) {
+      continue;
+    } else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      connection_park(connection, EPOLLOUT);
+      return;
     } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      connection_close(connection);
+      return;
     }
   }
+  out->length = 0;
+  connection->out_position = 0;
+  if (connection->refused) {
+    server_wait_slot(connection);
+    return;
+  }
+  if (connection->lock_waiting) {
+    server_wait_lock(connection);
+    return;
+  }
+  if (connection_has_frame(connection)) {
+    server_queue(connection);
+    return;
+  }
+  if (connection->hung_up) {
+    connection_close(connection);
+    return;
+  }
+  // Idle clients keep no buffers
+  if (connection->in_position == connection->in.length) {
+    server_release_buffer(connection->server, &connection->in);
+    connection->in_position = 0;
+  }
+  server_release_buffer(connection->server, out);
+  connection_park(connection, EPOLLIN);
+}
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+/**
+ * Reads what a client has sent, on the event loop, and moves the connection on.
+ * @param connection Pointer to the Connection.
+ */
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+void connection_read(Connection* connection) {
+  server_acquire_buffer(connection->server, &connection->in);
+  while (true) {
+    // Keep the unhandled tail of the input and read after it
+    size_t remaining = connection->in.length - connection->in_position;
+    if (remaining > 0) {
+      // Without a buffer yet, in.data is NULL and there is nothing to keep
+      memmove(connection->in.data, connection->in.data + connection->in_position, remaining);
+    }
+    connection->in.length = remaining;
+    connection->in_position = 0;
+    byte_buffer_reserve(&connection->in, WIRE_READ_SIZE);
+    size_t room = connection->in.capacity - connection->in.length;
+    ssize_t bytes_read = read(connection->fd, connection->in.data + connection->in.length, room);
+    if (bytes_read > 0) {
+      connection->in.length += bytes_read;
+      if ((size_t)bytes_read < room || connection_has_frame(connection)) {
+        break;
+      }
+    } else if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    } else if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      connection->hung_up = true;
+      break;
+    }
   }
+  connection_continue(connection);
 }
 
 /**
- * Inserts a new key-value pair into a leaf node. If the leaf node is full, it splits the node
- * and then inserts the new key-value pair.
- * 
- * @param cursor Pointer to the Cursor structure representing the position in the tree.
- * @param key The key to be inserted.
- * @param value Pointer to the Row structure representing the value to be inserted.
+ * Serves a client that moved to shared memory, on a thread of its own: rings
+ * are polled, not watched by the event loop.
+ * @param arg Pointer to the Connection, closed at the end.
+ * @return Always NULL.
  */
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+void* server_shm_thread(void* arg) {
+  Connection* connection = arg;
+  Server* server = connection->server;
+  InputBuffer* input_buffer = new_input_buffer();
+  connection->result = calloc(1, sizeof(ResultBatch));
+  connection->result->out = &connection->out;
+  connection_serve_shm(connection, server->table, input_buffer);
+  result_batch_free(connection->result);
+  close_input_buffer(input_buffer);
+  connection_close(connection);
+  pthread_mutex_lock(&server->lock);
+  server->shm_threads--;
+  pthread_cond_broadcast(&server->shm_cond);
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
-  }
+/**
+ * Runs ready connections, WORKER_QUANTUM statements at a time, so that a client
+ * pipelining many statements does not hold up the others.
+ * @param arg Pointer to the Server.
+ * @return Always NULL.
+ */
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+void* server_worker(void* arg) {
+  Server* server = arg;
+  InputBuffer* input_buffer = new_input_buffer();
+  ResultBatch* result = calloc(1, sizeof(ResultBatch));
+  result->ready_connections = &server->num_ready;
+  while (true) {
+    pthread_mutex_lock(&server->lock);
+    while (server->ready_head == NULL && !server_stopping) {
+      pthread_cond_wait(&server->ready_cond, &server->lock);
+    }
+    Connection* connection = server->ready_head;
+    if (connection == NULL) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    server->ready_head = connection->next_ready;
+    if (server->ready_head == NULL) {
+      server->ready_tail = NULL;
+    }
+    __atomic_sub_fetch(&server->num_ready, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&server->lock);
+
+    connection->result = result;
+    result->out = &connection->out;
+    server_acquire_buffer(server, &connection->out.buffer);
+    if (!connection_handle_frames(connection, server->table, input_buffer)) {
+      connection_close(connection);
+      continue;
+    }
+    if (connection->shm != NULL) {
+      epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+      pthread_t thread;
+      pthread_mutex_lock(&server->lock);
+      server->shm_threads++;
+      pthread_mutex_unlock(&server->lock);
+      if (pthread_create(&thread, NULL, server_shm_thread, connection) != 0) {
+        printf("Error starting a shared-memory thread.\n");
+        exit(EXIT_FAILURE);
+      }
+      pthread_detach(thread);
+      continue;
     }
+    connection_continue(connection);
   }
+  result_batch_free(result);
+  close_input_buffer(input_buffer);
+  return NULL;
+}
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+/**
+ * Accepts every pending client and parks it in the event loop.
+ * @param server Pointer to the Server.
+ */
+
+void server_accept(Server* server) {
+  while (true) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd == -1) {
+      return;  // EAGAIN once no client is left, or a client that already left
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Connection* connection = calloc(1, sizeof(Connection));
+    connection->server = server;
+    connection->fd = fd;
+    connection->transaction.waiter = connection;
+    server_count_connection(server, 1);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = connection;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
 }
 
 /**
- * Executes an insert operation in the database. This function inserts a new row into a table.
- * It handles the insertion of the row and checks for duplicate keys.
- * 
- * @param statement Pointer to the Statement structure containing the row to insert.
- * @param table Pointer to the Table structure where the row will be inserted.
- * @return ExecuteResult indicating the result of the execution (success or error code).
+ * Runs the database as a server on a Unix socket until SIGINT or SIGTERM.
+ * One thread waits on all the connections with epoll, reading requests and
+ * finishing writes; a pool of workers, one per core, runs the statements.
+ * Stopping saves the database like .exit; transactions still open are lost.
+ * @param table Pointer to the Table structure.
+ * @param socket_path Path of the socket to create.
  */
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  // Extract row to insert and its key.
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  // Find the position to insert the new row.
-  Cursor* cursor = table_find(table, key_to_insert);
-  // Access the node where the row will be inserted.
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  // Check for duplicate keys.
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+void server_run(Table* table, const char* socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+  Server server;
+  memset(&server, 0, sizeof(server));
+  server.table = table;
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.listen_fd == -1 ||
+      bind(server.listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(server.listen_fd, SOMAXCONN) == -1) {
+    printf("Unable to listen on %s: %d\n", socket_path, errno);
+    exit(EXIT_FAILURE);
+  }
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listen_event;
+  listen_event.events = EPOLLIN;
+  listen_event.data.ptr = NULL;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_event);
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.ready_cond, NULL);
+  pthread_cond_init(&server.shm_cond, NULL);
+  pthread_cond_init(&server.slot_cond, NULL);
+  // Workers must not block on a transaction whose client is not running a
+  // statement: connections waiting for a row lock are parked instead
+  table->locks.wake = server_wake_lock_waiter;
+  table->pager->connections = 0;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  server.num_workers = cores < 1 ? 1 : cores > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS : cores;
+  // Reports leave at least half the workers to interactive statements
+  Workload* reports = &table->workloads[WORKLOAD_REPORT];
+  if (reports->max_running == 0) {
+    reports->max_running = server.num_workers / 2 > 1 ? server.num_workers / 2 : 1;
+  }
+  pthread_t workers[SERVER_MAX_WORKERS];
+  for (uint32_t i = 0; i < server.num_workers; i++) {
+    if (pthread_create(&workers[i], NULL, server_worker, &server) != 0) {
+      printf("Error starting server workers.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = server_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);  // A client going away shows up as a failed write
+  printf("Listening on %s\n", socket_path);
+  fflush(stdout);
+
+  struct epoll_event events[64];
+  while (!server_stopping) {
+    // The stop signals may land on any thread, so the loop also wakes up on its own
+    int num_events = epoll_wait(server.epoll_fd, events, 64, SERVER_POLL_TIMEOUT_MS);
+    for (int i = 0; i < num_events; i++) {
+      Connection* connection = events[i].data.ptr;
+      if (connection == NULL) {
+        server_accept(&server);
+      } else if (events[i].events & EPOLLOUT) {
+        connection_continue(connection);
+      } else {
+        connection_read(connection);
+      }
     }
   }
-  // Perform the insertion.
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-  // Clean up.
-  free(cursor);
 
-  return EXECUTE_SUCCESS;
+  // Let the statements running finish, then save
+  pthread_mutex_lock(&server.lock);
+  pthread_cond_broadcast(&server.ready_cond);
+  pthread_mutex_unlock(&server.lock);
+  for (uint32_t i = 0; i < server.num_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_mutex_lock(&server.lock);
+  pthread_cond_broadcast(&server.slot_cond);  // Shared-memory clients waiting for a slot give up
+  while (server.shm_threads > 0) {
+    pthread_cond_wait(&server.shm_cond, &server.lock);
+  }
+  pthread_mutex_unlock(&server.lock);
+  close(server.listen_fd);
+  unlink(socket_path);
+  pthread_mutex_lock(&table->pager->commit_lock);
+  db_close(table);
+  exit(EXIT_SUCCESS);
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
+/**
+ * Queues a statement for the server. The text is padded like every frame.
+ * @param out Where the frames to send go: a buffer, or the request ring.
+ * @param text The statement.
+ */
 
-  if (cursor->end_of_table) {
-    printf("DB is empty.\n");
-    free(cursor);
-    return EXECUTE_SUCCESS;
+void bench_append_statement(WireOutput* out, const char* text) {
+  wire_append_frame(out, WIRE_STATEMENT, 0, text, strlen(text));
+}
+
+/**
+ * Sends the statements queued for a socket. Over shared memory they were
+ * published as they were queued.
+ * @param fd The socket.
+ * @param out The queued frames.
+ */
+
+void bench_send(int fd, WireOutput* out) {
+  if (out->ring == NULL) {
+    write_all(fd, out->buffer.data, out->buffer.length);
+    out->buffer.length = 0;
   }
+}
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+/**
+ * Reads one response frame in place: the id column of a batch is summed
+ * straight from the frame.
+ * @param header The header of the frame.
+ * @param payload The payload following it.
+ * @param rows Incremented by the number of rows received.
+ * @param checksum Receives the sum of the ids, so the columns are really read.
+ * @return True if the frame ends a statement.
+ */
+
+bool bench_handle_frame(const WireHeader* header, const char* payload, uint64_t* rows,
+                        int64_t* checksum) {
+  if (header->type == WIRE_ROWS) {
+    const WireBatchHeader* batch = (const WireBatchHeader*)payload;
+    const int64_t* ids = (const int64_t*)(batch + 1);
+    for (uint32_t i = 0; i < batch->num_rows; i++) {
+      *checksum += ids[i];
+    }
+    *rows += batch->num_rows;
+  } else if (header->type == WIRE_DONE) {
+    if (header->status != 0) {
+      printf("Error from server: %.*s\n", (int)header->length, payload);
+      exit(EXIT_FAILURE);
+    }
+    return true;
   }
+  return false;
+}
 
-  free(cursor);
+/**
+ * Reads frames from the server until the given number of statements finished.
+ * @param fd The socket.
+ * @param in Receive buffer, kept 8-byte aligned so columns can be read in place.
+ * @param responses The response ring once on shared memory, NULL before.
+ * @param statements Number of WIRE_DONE frames to wait for.
+ * @param rows Incremented by the number of rows received.
+ * @param checksum Receives the sum of the ids.
+ */
 
-  return EXECUTE_SUCCESS;
+void bench_receive(int fd, ByteBuffer* in, ShmRing* responses, uint32_t statements,
+                   uint64_t* rows, int64_t* checksum) {
+  if (responses != NULL) {
+    while (statements > 0) {
+      WireHeader header;
+      const char* payload = shm_ring_next(responses, &header);
+      if (payload == NULL) {
+        printf("Server closed the connection.\n");
+        exit(EXIT_FAILURE);
+      }
+      statements -= bench_handle_frame(&header, payload, rows, checksum);
+      shm_ring_consume(responses, &header);
+    }
+    return;
+  }
+  size_t position = 0;
+  in->length = 0;
+  while (statements > 0) {
+    if (in->length - position < sizeof(WireHeader) ||
+        in->length - position < sizeof(WireHeader) + ((WireHeader*)(in->data + position))->length) {
+      // Move the partial frame to the front, keeping it aligned, and read more
+      memmove(in->data, in->data + position, in->length - position);
+      in->length -= position;
+      position = 0;
+      byte_buffer_reserve(in, WIRE_READ_SIZE);
+      ssize_t bytes_read = read(fd, in->data + in->length, in->capacity - in->length);
+      if (bytes_read <= 0) {
+        printf("Server closed the connection.\n");
+        exit(EXIT_FAILURE);
+      }
+      in->length += bytes_read;
+      continue;
+    }
+    WireHeader* header = (WireHeader*)(in->data + position);
+    statements -= bench_handle_frame(header, (const char*)(header + 1), rows, checksum);
+    position += sizeof(WireHeader) + header->length;
+  }
+}
+
+/**
+ * Asks the server to move the connection to shared memory and maps the region
+ * whose descriptor comes back with the answer.
+ * @param fd The socket.
+ * @param requests Receives the request ring.
+ * @param responses Receives the response ring.
+ * @return The mapped region.
+ */
+
+ShmRegion* bench_attach_shm(int fd, ShmRing* requests, ShmRing* responses) {
+  WireHeader header = {0, WIRE_SHM_ATTACH, 0, 0};
+  write_all(fd, (const char*)&header, sizeof(header));
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec vector = {&header, sizeof(header)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  struct cmsghdr* descriptor = NULL;
+  if (recvmsg(fd, &message, MSG_WAITALL) == sizeof(header)) {
+    descriptor = CMSG_FIRSTHDR(&message);
+  }
+  if (descriptor == NULL || descriptor->cmsg_type != SCM_RIGHTS) {
+    printf("Server did not share memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  int shm_fd;
+  memcpy(&shm_fd, CMSG_DATA(descriptor), sizeof(int));
+  ShmRegion* region = mmap(NULL, SHM_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (region == MAP_FAILED) {
+    printf("Unable to map shared memory: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  shm_region_rings(region, requests, responses, fd);
+  return region;
 }
 
+// Query of the round-trip benchmarks: it returns nothing, so it measures the protocol
+#define BENCH_POINT_QUERY "select where username = no-such-user"
 
 /**
- * Executes a statement depending on its type (e.g., insert, select).
- * 
- * @param statement Pointer to the Statement structure representing the operation to execute.
- * @param table Pointer to the Table structure representing the database table.
- * @return ExecuteResult indicating the result of the execution.
+ * Measures round trips per second of a point query sent one at a time and
+ * pipelined, then rows per second of full-table selects.
+ * @param transport Name of the transport, for the report.
+ * @param fd The socket.
+ * @param out Where statements go.
+ * @param in Receive buffer for the socket.
+ * @param responses The response ring, or NULL over the socket.
  */
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+void bench_run(const char* transport, int fd, WireOutput* out, ByteBuffer* in, ShmRing* responses) {
+  uint64_t rows = 0;
+  int64_t checksum = 0;
+  const uint32_t round_trips = 20000;
+  const uint32_t pipeline_depth = 64;
+  const uint32_t scans = 20;
+
+  uint64_t start = now_microseconds();
+  for (uint32_t i = 0; i < round_trips; i++) {
+    bench_append_statement(out, BENCH_POINT_QUERY);
+    bench_send(fd, out);
+    bench_receive(fd, in, responses, 1, &rows, &checksum);
+  }
+  uint64_t elapsed = now_microseconds() - start;
+  printf("%s round trips: %.0f/s\n", transport, round_trips * 1e6 / (elapsed ? elapsed : 1));
+
+  start = now_microseconds();
+  for (uint32_t i = 0; i < round_trips; i += pipeline_depth) {
+    for (uint32_t j = 0; j < pipeline_depth; j++) {
+      bench_append_statement(out, BENCH_POINT_QUERY);
+    }
+    bench_send(fd, out);
+    bench_receive(fd, in, responses, pipeline_depth, &rows, &checksum);
+  }
+  elapsed = now_microseconds() - start;
+  printf("%s pipelined round trips: %.0f/s\n", transport,
+         round_trips * 1e6 / (elapsed ? elapsed : 1));
+
+  rows = 0;
+  start = now_microseconds();
+  for (uint32_t i = 0; i < scans; i++) {
+    bench_append_statement(out, "select");
+    bench_send(fd, out);
+    bench_receive(fd, in, responses, 1, &rows, &checksum);
+  }
+  elapsed = now_microseconds() - start;
+  printf("%s rows: %.0f/s (%llu rows, id checksum %lld)\n", transport,
+         rows * 1e6 / (elapsed ? elapsed : 1), (unsigned long long)rows, (long long)checksum);
+}
+
+/**
+ * Measures a server over its socket, then over shared memory.
+ * @param socket_path Path of the server's socket.
+ */
+
+void bench_client(const char* socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    printf("Unable to connect to %s: %d\n", socket_path, errno);
+    exit(EXIT_FAILURE);
   }
+  WireOutput out = {{NULL, 0, 0}, NULL};
+  ByteBuffer in = {NULL, 0, 0};
+  bench_run("Socket", fd, &out, &in, NULL);
+
+  ShmRing requests;
+  ShmRing responses;
+  ShmRegion* region = bench_attach_shm(fd, &requests, &responses);
+  out.ring = &requests;
+  bench_run("Shared memory", fd, &out, &in, &responses);
+  munmap(region, SHM_REGION_SIZE);
+  free(out.buffer.data);
+  free(in.data);
+  close(fd);
 }
 
 /**
@@ -1495,56 +8989,122 @@ ExecuteResult execute_statement(Statement* statement, Table* table) {
  * initializes the database, processes input, and executes commands.
  */
 int main(int argc, char* argv[]) {
-  //Printing Header
-  printf("Welcome to the database\n \n \n");
-  if (argc < 2) {
+  char* filename = NULL;
+  bool batch = false;
+  char* listen_path = NULL;
+  // Workload classes start without budgets or limits
+  PagerOptions options = {.is_replica = false, .shadow_paging = false, .split_policy = SPLIT_MIDPOINT,
+                          .fill_factor = 0, .durability = DURABILITY_SYNC, .cache_pages = 0,
+                          .cache_policy = CACHE_POLICY_2Q, .pin_internal = false};
+  for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--replica") == 0) {
+          options.is_replica = true;
+      } else if (strcmp(argv[i], "--batch") == 0) {
+          batch = true;
+      } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+          listen_path = argv[++i];
+      } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+          bench_client(argv[i + 1]);
+          exit(EXIT_SUCCESS);
+      } else if (strcmp(argv[i], "--shadow") == 0) {
+          options.shadow_paging = true;
+      } else if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+          i++;
+          if (strcmp(argv[i], "midpoint") == 0) {
+              options.split_policy = SPLIT_MIDPOINT;
+          } else if (strcmp(argv[i], "append") == 0) {
+              options.split_policy = SPLIT_APPEND;
+          } else if (strcmp(argv[i], "adaptive") == 0) {
+              options.split_policy = SPLIT_ADAPTIVE;
+          } else {
+              printf("Split policy must be midpoint, append or adaptive.\n");
+              exit(EXIT_FAILURE);
+          }
+      } else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+          i++;
+          if (strcmp(argv[i], "sync") == 0) {
+              options.durability = DURABILITY_SYNC;
+          } else if (strcmp(argv[i], "group") == 0) {
+              options.durability = DURABILITY_GROUP;
+          } else if (strcmp(argv[i], "async") == 0) {
+              options.durability = DURABILITY_ASYNC;
+          } else {
+              printf("Durability must be sync, group or async.\n");
+              exit(EXIT_FAILURE);
+          }
+      } else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+          options.cache_pages = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--cache-policy") == 0 && i + 1 < argc) {
+          i++;
+          if (strcmp(argv[i], "lru") == 0) {
+              options.cache_policy = CACHE_POLICY_LRU;
+          } else if (strcmp(argv[i], "2q") == 0) {
+              options.cache_policy = CACHE_POLICY_2Q;
+          } else {
+              printf("Cache policy must be lru or 2q.\n");
+              exit(EXIT_FAILURE);
+          }
+      } else if (strcmp(argv[i], "--pin-internal") == 0) {
+          options.pin_internal = true;
+      } else if (strcmp(argv[i], "--budget") == 0 && i + 3 < argc) {
+          if (!workload_set_limit(options.workloads, argv[i + 1], argv[i + 2],
+                                  strtoull(argv[i + 3], NULL, 10))) {
+              printf("Budget must be: interactive|report running|pages|cpu-ms|memory-kb <limit>.\n");
+              exit(EXIT_FAILURE);
+          }
+          i += 3;
+      } else if (strcmp(argv[i], "--fill-factor") == 0 && i + 1 < argc) {
+          options.fill_factor = atoi(argv[++i]);
+          if (options.fill_factor < 1 || options.fill_factor > 100) {
+              printf("Fill factor must be a percentage from 1 to 100.\n");
+              exit(EXIT_FAILURE);
+          }
+      } else {
+          filename = argv[i];
+      }
+  }
+  //Printing Header, left out of a batch's output
+  if (!batch && listen_path == NULL) {
+      printf("Welcome to the database\n \n \n");
+  }
+  if (filename == NULL) {
       printf("Must supply a database filename.\n");
       exit(EXIT_FAILURE);
   }
 
-  char* filename = argv[1];
-  Table* table = db_open(filename);
+  Table* table = db_open(filename, &options);
+  if (options.durability != DURABILITY_SYNC && !table->pager->is_shadow) {
+      printf("Only shadow-paged databases can defer commits.\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (listen_path != NULL) {
+      server_run(table, listen_path);
+  }
 
   InputBuffer* input_buffer = new_input_buffer();
+  Transaction transaction = {0};
+  if (batch) {
+      // Whole chunks of statements run back to back and their output is
+      // written once per chunk
+      setvbuf(stdout, NULL, _IOFBF, BATCH_CHUNK_SIZE);
+      BatchReader reader = {NULL, 0, 0, 0, false};
+      while (batch_fill(&reader)) {
+          while (batch_read_line(&reader, input_buffer)) {
+              run_repl_statement(input_buffer, table, &transaction);
+          }
+          fflush(stdout);
+      }
+      // The end of the input saves the database like .exit
+      free(reader.data);
+      close_input_buffer(input_buffer);
+      pthread_mutex_lock(&table->pager->commit_lock);
+      db_close(table);
+      exit(EXIT_SUCCESS);
+  }
   while (true) {
       print_prompt();
       read_input(input_buffer);
-
-      if (input_buffer->buffer[0] == '.') {
-          switch (do_meta_command(input_buffer, table)) {
-              case META_COMMAND_SUCCESS:
-                  continue;
-              case META_COMMAND_UNRECOGNIZED_COMMAND:
-                  printf("Unrecognized command '%s'\n", input_buffer->buffer);
-                  continue;
-          }
-      }
-
-      Statement statement;
-      switch (prepare_statement(input_buffer, &statement)) {
-          case PREPARE_SUCCESS:
-              break;
-          case PREPARE_NEGATIVE_ID:
-              printf("ID must be positive.\n");
-              continue;
-          case PREPARE_STRING_TOO_LONG:
-              printf("String is too long.\n");
-              continue;
-          case PREPARE_SYNTAX_ERROR:
-              printf("Syntax error. Could not parse statement.\n");
-              continue;
-          case PREPARE_UNRECOGNIZED_STATEMENT:
-              printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-              continue;
-      }
-
-      switch (execute_statement(&statement, table)) {
-          case EXECUTE_SUCCESS:
-              // printf("Executed.\n");
-              break;
-          case EXECUTE_DUPLICATE_KEY:
-              printf("Error: Duplicate key.\n");
-              break;
-      }
+      run_repl_statement(input_buffer, table, &transaction);
   }
-}
\ No newline at end of file
+}
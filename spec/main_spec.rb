@@ -1,11 +1,11 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-* test-backup.db test-backup.db-*`
   end
 
-  def run_script(commands)
+  def run_script(commands, filename = "test.db")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db #{filename}", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -102,18 +102,20 @@ describe 'database' do
     ])
   end
 
-  it 'prints an error message if id is negative' do
+  it 'accepts negative ids and sorts them first' do
     script = [
-      "insert -1 cstack foo@bar.com",
+      "insert cstack 1 foo@bar.com",
+      "insert cstack -1 foo@bar.com",
+      "insert cstack 1x foo@bar.com",
       "select",
       ".exit",
     ]
     result = run_script(script)
-    expect(result).to match_array([
-      "db > ID must be positive.",
-      "db > Executed.",
-      "db > ",
-    ])
+    expect(result).to include(
+      "db > db > db > ID must be an integer or tenant:id.",
+      "db > (-1, cstack, foo@bar.com)",
+      "(1, cstack, foo@bar.com)",
+    )
   end
 
   it 'prints an error message if there is a duplicate id' do
@@ -154,6 +156,24 @@ describe 'database' do
     ])
   end
 
+  it 'keeps the key order of cells inserted out of order into a leaf after reopening' do
+    ids = [7, 3, 11, 1, 12, 5, 9, 2, 10, 4, 8, 6]
+    script = ids.map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      ".btree",
+      "select",
+      ".exit",
+    ]).map { |line| line.sub(/^(db > )+/, "") }
+    expect(result).to include("- leaf (size 12)")
+    keys = result.select { |line| line.start_with?("  - ") }
+    expect(keys).to eq((1..12).map { |i| "  - #{i}" })
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq((1..12).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+  end
+
   it 'allows printing out the structure of a 3-leaf-node btree' do
     script = (1..14).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -435,10 +455,10 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
+      "ROW_SIZE: 300",
       "COMMON_NODE_HEADER_SIZE: 6",
       "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
+      "LEAF_NODE_CELL_SIZE: 312",
       "LEAF_NODE_SPACE_FOR_CELLS: 4082",
       "LEAF_NODE_MAX_CELLS: 13",
       "db > ",
@@ -472,4 +492,667 @@ describe 'database' do
       "Executed.", "db > ",
     ])
   end
+
+  it 'refuses a file that does not carry its format version' do
+    run_script([
+      "insert user1 1 person1@example.com",
+      ".exit",
+    ])
+    # Page 1 starts with the magic number and the format version
+    db = File.binread("test.db")
+    db[4096 + 4, 4] = [0].pack("L<")
+    File.binwrite("test.db", db)
+    result = run_script([".exit"])
+    expect(result).to include("Db file is not in format version 2.")
+
+    File.binwrite("test.db", "\0" * 4096 * 2)
+    result = run_script([".exit"])
+    expect(result).to include("Db file is not in format version 2.")
+  end
+
+  it 'brings a backup up to date with an incremental backup' do
+    result = run_script([
+      "insert user1 1 person1@example.com",
+      ".backup test-backup.db",
+      "insert user2 2 person2@example.com",
+      ".backup incremental test-backup.db",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > db > Backing up 2 pages.",
+      "db > db > Backing up 2 pages.",
+    )
+
+    result = run_script([
+      "select",
+      ".exit",
+    ], "test-backup.db")
+    expect(result).to include(
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+    )
+  end
+
+  it 'serves reads but rejects writes on a replica' do
+    run_script([
+      "insert user1 1 person1@example.com",
+      ".exit",
+    ])
+
+    result = run_script([
+      "insert user2 2 person2@example.com",
+      "select",
+      ".replication",
+      ".exit",
+    ], "--replica test.db")
+    expect(result).to include(
+      "db > Error: Read-only replica.",
+      "db > (1, user1, person1@example.com)",
+      "db > Replica at commit 0, lag 0 commits (0 ms).",
+    )
+  end
+
+  it 'keeps committed rows of a shadow-paged database without a clean exit' do
+    run_script([
+      "insert user1 1 person1@example.com",
+      "insert user2 2 person2@example.com",
+    ], "--shadow test.db")
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+    )
+  end
+
+  it 'keeps a shadow-paged file intact across commits that rewrite most of its pages' do
+    rows = (1..2100).map { |i| "user#{i % 5} #{i * 10} person#{i % 5}@example.com" }
+    script = rows.each_slice(50).map { |slice| "insert " + slice.join(" ") }
+    # Each batch adds a row to every leaf, so the file holds three versions of them
+    script += (1..3).map do |k|
+      "insert " + (0...84).map { |j| "user1 #{(25 * j + 1) * 10 + k} person1@example.com" }.join(" ")
+    end
+    script << ".exit"
+    result = run_script(script, "--shadow --fill-factor 70 test.db")
+    expect(result.join("\n")).not_to include("Error")
+    expect(File.size("test.db") / 4096).to eq(331)
+
+    result = run_script(["select", ".exit"])
+    expect(result.join("\n").scan(/\(\d+, /).length).to eq(2100 + 3 * 84)
+    expect(result.last).not_to eq("Backup failed.")
+  end
+
+  it 'refreshes the warm-cache hints at checkpoints and reads them ahead when reopened' do
+    # No .exit: only the checkpoints write the hints
+    run_script((1..600).map { |i| "insert user#{i} #{i} person#{i}@example.com" })
+    expect(File.exist?("test.db-hot")).to eq(true)
+
+    result = run_script([".cache", ".exit"]).map { |line| line.sub(/^(db > )+/, "") }
+    prefetched = result.grep(/^Prefetched at open: /)
+    expect(prefetched.length).to eq(1)
+    expect(prefetched.first).not_to eq("Prefetched at open: 0 pages")
+  end
+
+  it 'checkpoints the replication log once it grows past its limit' do
+    script = (1..600).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script += [".replication", ".exit"]
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, "") }
+    # The log restarted partway, after writing every change into the file
+    expect(result).to include("Primary at commit 163.")
+
+    result = run_script(["select", ".exit"])
+    expect(result.join("\n").scan(/\(\d+, /).length).to eq(600)
+  end
+
+  it 'moves a lagging replica onto the new file once the log restarts' do
+    # Batch mode answers each chunk as it arrives, so the status line marks its end
+    primary = IO.popen("./db --batch test.db", "r+")
+    replica = nil
+    run = lambda do |pipe, commands, status|
+      pipe.puts(commands)
+      pipe.flush
+      lines = []
+      lines << pipe.gets.chomp until lines.last.to_s.start_with?(status)
+      lines
+    end
+    inserts = lambda { |ids| ids.map { |i| "insert user#{i} #{i} person#{i}@example.com" } }
+
+    run.call(primary, inserts.call(1..100) + [".replication"], "Primary at commit")
+    replica = IO.popen("./db --batch --replica --cache-pages 8 test.db", "r+")
+    before = run.call(replica, ["select", ".replication"], "Replica at commit")
+    # The replica sits idle while a checkpoint renames a new file over its own
+    status = run.call(primary, inserts.call(101..700) + [".replication"], "Primary at commit")
+    after = run.call(replica, ["select", ".replication"], "Replica at commit")
+    primary.close_write
+    primary.read
+    primary.close
+    replica.close
+
+    expect(status.last).to eq("Primary at commit 263.")
+    expect(before.grep(/^\(/).length).to eq(100)
+    expect(after.grep(/^\(/).map { |line| line[/\d+/].to_i }).to eq((1..700).to_a)
+  end
+
+  it 'inserts several rows from one statement in key order' do
+    script = ["insert " + (1..40).to_a.reverse.map { |i| "user#{i} #{i} person#{i}@example.com" }.join(" ")]
+    script << "insert user41 41 person41@example.com user3 3 person3@example.com"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > db > Error: Duplicate key.")
+    rows = result.select { |line| line.include?("person") }
+    expect(rows.length).to eq(41)
+    expect(rows.last).to eq("(41, user41, person41@example.com)")
+  end
+
+  it 'selects the rows of one tenant' do
+    script = (1..20).map { |i| "insert user#{i} #{i % 3}:#{i} person#{i}@example.com" }
+    script << "select where tenant = 2"
+    script << ".exit"
+    result = run_script(script)
+    rows = result.map { |line| line.sub(/^(db > )+/, "") }.select { |line| line.include?("person") }
+    expect(rows.length).to eq(7)
+    expect(rows.first).to eq("(2:2, user2, person2@example.com)")
+    expect(rows.last).to eq("(2:20, user20, person20@example.com)")
+  end
+
+  it 'stores a large payload in overflow pages' do
+    payload = "x" * 10000
+    run_script([
+      "insert user1 1 person1@example.com = #{payload}",
+      "insert user2 2 person2@example.com = short text",
+      ".exit",
+    ])
+
+    result = run_script([
+      "select",
+      "select *",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > (1, user1, person1@example.com)",
+      "db > (1, user1, person1@example.com, #{payload})",
+      "(2, user2, person2@example.com, short text)",
+    )
+  end
+
+  it 'reports an overflow page claiming more bytes than it holds as corrupt' do
+    payload = "x" * 10000
+    run_script([
+      "insert user1 1 person1@example.com = #{payload}",
+      ".exit",
+    ])
+    # The used count follows the next page number in each overflow page
+    db = File.binread("test.db")
+    page_num = (0...db.length / 4096).find { |i| db[i * 4096 + 8, 8] == "x" * 8 }
+    db[page_num * 4096 + 4, 4] = [0xFFFFFF00].pack("L<")
+    File.binwrite("test.db", db)
+
+    result = run_script([
+      "select *",
+      ".exit",
+    ])
+    expect(result).to include("Payload overflow chain out of bounds. Corrupt file.")
+  end
+
+  it 'filters and groups on dictionary-encoded columns' do
+    run_script([
+      "insert alice 1 alice1@gmail.com",
+      "insert bob 2 bob2@yahoo.com",
+      "insert alice 3 alice3@yahoo.com",
+      ".exit",
+    ])
+
+    result = run_script([
+      "select where domain = yahoo.com",
+      "select count by username",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > (2, bob, bob2@yahoo.com)",
+      "(3, alice, alice3@yahoo.com)",
+      "db > (alice, 2)",
+      "(bob, 1)",
+    )
+  end
+
+  it 'packs the left leaf when appending with the append split policy' do
+    script = (1..44).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script, "--split append test.db")
+    expect(result).to include(
+      "- internal (size 1)",
+      "  - leaf (size 43)",
+      "  - leaf (size 1)",
+    )
+  end
+
+  it 'keeps the fill factor the file was created with on later opens' do
+    script = (1..30).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script, "--split append --fill-factor 50 test.db")
+
+    # Opened again without the option, the file still packs leaves half full
+    script = (31..60).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script += [".constants", ".btree", ".exit"]
+    result = run_script(script, "--split append test.db").map { |line| line.sub(/^(db > )+/, "") }
+    max_cells = result.find { |line| line.start_with?("LEAF_NODE_MAX_CELLS: ") }.split(": ").last.to_i
+    sizes = result.grep(/- leaf \(size \d+\)/).map { |line| line[/\d+/].to_i }
+    expect(sizes[0..-2].uniq).to eq([max_cells * 50 / 100])
+  end
+
+  it 'moves rows to a sibling leaf before splitting, then splits two leaves into three' do
+    script = (1..66).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".btree"
+    script += (67..87).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, "") }
+    trees = result.join("\n").split("Tree:\n").drop(1).map do |tree|
+      tree.lines.map(&:chomp).reject { |line| line.start_with?("    - ") }
+    end
+    expect(trees[0].first(4)).to eq([
+      "- internal (size 1)",
+      "  - leaf (size 33)",
+      "  - key 33",
+      "  - leaf (size 33)",
+    ])
+    expect(trees[1].first(6)).to eq([
+      "- internal (size 2)",
+      "  - leaf (size 29)",
+      "  - key 29",
+      "  - leaf (size 29)",
+      "  - key 58",
+      "  - leaf (size 29)",
+    ])
+  end
+
+  it 'finds rows inserted into leaves skipped by an earlier filter' do
+    script = (1..100).map { |i| "insert user#{i / 20} #{i * 2} person#{i}@example.com" }
+    script << "select where username = user4"
+    script << "insert user4 41 late@example.com"
+    script << "select where username = user4"
+    script << ".exit"
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, "") }
+    expect(result.count("(160, user4, person80@example.com)")).to eq(2)
+    expect(result).to include("(41, user4, late@example.com)")
+  end
+
+  it 'scans a columnar export reading only the chunks that can match' do
+    script = (1..1200).map { |i| "insert user#{i % 3} #{i} person#{i}@example.com" }
+    script << ".export test.db-columns"
+    script << ".scan test.db-columns id,email where id between 1100 and 1101"
+    script << ".exit"
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, "") }
+    expect(result).to include(
+      "Exported 1200 rows in 2 chunks.",
+      "(1100, person1100@example.com)",
+      "(1101, person1101@example.com)",
+    )
+    expect(result.grep(/^Scanned /).first).to start_with("Scanned 1 of 2 chunks")
+  end
+
+  it 'reports a truncated or damaged columnar export as corrupt' do
+    script = (1..1200).map { |i| "insert user#{i % 3} #{i} person#{i}@example.com" }
+    script << ".export test.db-columns"
+    script << ".exit"
+    run_script(script)
+    export = File.binread("test.db-columns")
+    File.binwrite("test.db-columns", export[0, export.length / 2])
+    result = run_script([".scan test.db-columns id,email", ".exit"])
+    expect(result.join("\n")).to include("Columnar directory out of bounds. Corrupt file.")
+
+    # Give the first chunk's tenants a length past the end of the file
+    directory_offset = export[32, 8].unpack1("Q<")
+    export[directory_offset + 8, 4] = [100_000].pack("L<")
+    File.binwrite("test.db-columns", export)
+    result = run_script([".scan test.db-columns id,email", ".exit"])
+    expect(result.join("\n")).to include("Columnar chunk out of bounds. Corrupt file.")
+  end
+
+  it 'defers commits in async mode and syncs them at exit' do
+    result = run_script([
+      "insert user1 1 person1@example.com",
+      ".durability async",
+      "insert user2 2 person2@example.com",
+      "insert user3 3 person3@example.com",
+      ".durability",
+      ".exit",
+    ], "--shadow test.db").map { |line| line.sub(/^(db > )+/, "") }
+    expect(result).to include("Durability: async")
+    expect(result.grep(/^sync: /).first).to start_with("sync: 1 commits")
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to include(
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+    )
+  end
+
+  it 'stops a report that reads more pages than its budget' do
+    script = (1..300).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select count by username",
+      "select where username = user7",
+      ".budget",
+      ".exit",
+    ], "--budget report pages 1 test.db").map { |line| line.sub(/^(db > )+/, "") }
+    expect(result).to include(
+      "Error: Statement exceeded its pages budget.",
+      "(7, user7, person7@example.com)",
+      "report: running 0, pages 1, cpu-ms 0, memory-kb 0; 1 statements, 0 queued, 1 aborted",
+    )
+  end
+
+  it 'skips leaves by their summaries from the first filtered select after reopening' do
+    script = (1..600).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+
+    # Reading every leaf would take about twice the budget
+    result = run_script([
+      "select where username = user300",
+      "insert user300 1000 person300@example.com",
+      "select where username = user300",
+      ".exit",
+    ], "--cache-pages 8 --budget interactive pages 20 test.db").map { |line| line.sub(/^(db > )+/, "") }
+    expect(result.join("\n")).not_to include("Error")
+    expect(result.grep(/^\(\d+, /)).to eq([
+      "(300, user300, person300@example.com)",
+      "(300, user300, person300@example.com)",
+      "(1000, user300, person300@example.com)",
+    ])
+  end
+
+  it 'keeps the cache within its limit while scanning' do
+    script = (1..200).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script += ["select", ".cache", ".exit"]
+    result = run_script(script, "--shadow --cache-pages 8 test.db").map { |line| line.sub(/^(db > )+/, "") }
+    expect(result.grep(/^\(\d+, /).length).to eq(200)
+    expect(result).to include("Cache: 2q, 8 of 8 pages")
+    expect(result.grep(/^Hits: /).first).not_to end_with("evictions: 0")
+  end
+
+  it 'refuses inserts once a shadow-paged table is full and keeps the rows it has' do
+    script = (0...100).map do |j|
+      "insert " + (1..100).map { |k| i = j * 100 + k; "user#{i} #{i} person#{i}@example.com" }.join(" ")
+    end
+    script << ".exit"
+    result = run_script(script, "--shadow --cache-pages 8 test.db")
+    # Each batch is refused as a whole
+    refused = result.join("\n").scan("Error: Table full.").length
+    expect(refused).not_to eq(0)
+    expect(result.last(2)).to eq(["db > Error: Table full.", "db > "])
+
+    result = run_script(["select", ".exit"])
+    expect(result.join("\n").scan(/\(\d+, /).length).to eq((100 - refused) * 100)
+  end
+
+  it 'grows a table past the pages of a shadow-paged one within a small cache' do
+    script = (0...150).map do |j|
+      "insert " + (1..100).map { |k| i = j * 100 + k; "user#{i} #{i} person#{i}@example.com" }.join(" ")
+    end
+    script << ".exit"
+    result = run_script(script, "--cache-pages 8 test.db")
+    expect(result.join("\n")).not_to include("Error")
+    expect(File.size("test.db") / 4096 > 400).to eq(true)
+
+    result = run_script(["select", ".exit"], "--cache-pages 8 test.db")
+    expect(result.join("\n").scan(/\(\d+, /).length).to eq(15000)
+    expect(result[-2]).to eq("(15000, user15000, person15000@example.com)")
+  end
+
+  it 'spills changed pages to keep the cache within its limit until the disk is full' do
+    script = (1..200).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    script += ["select", ".cache", ".exit"]
+    result = run_script(script, "--cache-pages 8 test.db").map { |line| line.sub(/^(db > )+/, "") }
+    expect(result.grep(/^\(\d+, /).length).to eq(200)
+    expect(result).to include("Cache: 2q, 8 of 8 pages")
+    expect(File.exist?("test.db-spill")).to eq(false)
+
+    `rm -f test.db*; ln -s /dev/full test.db-spill`
+    script = (1..200).map { |i| "insert user#{i} #{i} person#{i}@example.com" }
+    result = run_script(script + [".exit"], "--cache-pages 8 test.db")
+    refused = result.join("\n").scan("Error: Disk full.").length
+    expect(refused).not_to eq(0)
+
+    result = run_script(["select", ".exit"])
+    expect(result.join("\n").scan(/\(\d+, /).length).to eq(200 - refused)
+  end
+
+  it 'applies the inserts of a transaction only when it commits' do
+    result = run_script([
+      "begin",
+      "insert user1 1 person1@example.com",
+      "insert user2 2 person2@example.com",
+      "select",
+      "commit",
+      "begin",
+      "insert user3 3 person3@example.com",
+      "rollback",
+      "commit",
+      "select",
+      ".exit",
+    ]).map { |line| line.sub(/^(db > )+/, "") }
+    expect(result).to include(
+      "DB is empty.",
+      "Error: No transaction is open.",
+      "(1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+    )
+    expect(result).not_to include("(3, user3, person3@example.com)")
+  end
+
+  it 'runs piped statements without prompts in batch mode and saves at the end of input' do
+    result = run_script([
+      "insert user1 1 person1@example.com",
+      "insert user1 1 person1@example.com",
+      "select",
+    ], "--batch test.db")
+    expect(result).to eq([
+      "Error: Duplicate key.",
+      "(1, user1, person1@example.com)",
+    ])
+
+    result = run_script([
+      "select",
+    ], "--batch test.db")
+    expect(result).to eq([
+      "(1, user1, person1@example.com)",
+    ])
+  end
+
+  it 'answers pipelined statements over the Unix socket with columnar batches' do
+    require 'socket'
+    server = IO.popen("./db --listen test.db-socket test.db", "r")
+    expect(server.gets).to eq("Listening on test.db-socket\n")
+    socket = UNIXSocket.new("test.db-socket")
+    frame = lambda do |text|
+      padded = text + "\0" * ((8 - text.bytesize % 8) % 8)
+      [padded.bytesize, 1, 0, 0].pack("VCCv") + padded
+    end
+    socket.write(frame.call("insert user1 1 person1@example.com") +
+                 frame.call("insert user2 3:2 person2@example.com") +
+                 frame.call("insert user1 1 person1@example.com") +
+                 frame.call("select"))
+
+    responses = []
+    while responses.count { |type, _| type == 3 } < 4
+      length, type, status = socket.read(8).unpack("VCC")
+      responses << [type, status, socket.read(length)]
+    end
+    socket.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(responses.map { |type, status, _| [type, status] }).to eq([[3, 0], [3, 0], [3, 1], [2, 0], [3, 0]])
+    expect(responses[2][2]).to start_with("Error: Duplicate key.")
+    rows, username_bytes, email_bytes = responses[3][2].unpack("VVV")
+    expect([rows, username_bytes, email_bytes]).to eq([2, 10, 38])
+    expect(responses[3][2][16, 24].unpack("q<q<l<l<")).to eq([1, 2, 0, 3])
+  end
+
+  it 'runs statements over shared memory and drops a client whose frame overruns the ring' do
+    require 'socket'
+    server = IO.popen("./db --listen test.db-socket test.db", "r")
+    expect(server.gets).to eq("Listening on test.db-socket\n")
+    socket = UNIXSocket.new("test.db-socket")
+    socket.write([0, 4, 0, 0].pack("VCCv"))
+    _, _, _, control = socket.recvmsg(8, 0, nil, scm_rights: true)
+    shm = control.unix_rights.first
+    # The region holds the positions of the two rings, 128 bytes each, then the
+    # request ring and the response ring, 4 MB each. The server polls them, so
+    # reading and writing the descriptor stands in for mapping it.
+    requests = 256
+    responses = requests + (1 << 22)
+    sent = 0
+    send = lambda do |text, length = nil|
+      padded = text + "\0" * ((8 - text.bytesize % 8) % 8)
+      shm.pwrite([length || padded.bytesize, 1, 0, 0].pack("VCCv") + padded, requests + sent)
+      sent += 8 + padded.bytesize
+      shm.pwrite([sent].pack("V"), 0)
+    end
+    received = 0
+    receive = lambda do
+      frames = []
+      until frames.last && frames.last[0] == 3
+        sleep 0.01 while shm.pread(4, 128).unpack1("V") == received
+        length, type, status = shm.pread(8, responses + received).unpack("VCC")
+        frames << [type, status, length > 0 ? shm.pread(length, responses + received + 8) : ""]
+        received += 8 + length
+        shm.pwrite([received].pack("V"), 192)
+      end
+      frames
+    end
+
+    send.call("insert user1 1 person1@example.com")
+    inserted = receive.call
+    send.call("select")
+    selected = receive.call
+    # A frame claiming more than the ring holds ends the connection
+    send.call("select", 1 << 30)
+    closed = socket.read
+    answered = shm.pread(4, 128).unpack1("V") != received
+    socket.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(inserted.map { |type, status, _| [type, status] }).to eq([[3, 0]])
+    expect(selected.map { |type, status, _| [type, status] }).to eq([[2, 0], [3, 0]])
+    expect(selected[0][2][0, 4].unpack1("V")).to eq(1)
+    expect(selected[0][2][16, 8].unpack1("q<")).to eq(1)
+    expect(closed).to eq("")
+    expect(answered).to eq(false)
+  end
+
+  it 'serves a client while another one sits idle in a transaction' do
+    require 'socket'
+    server = IO.popen("./db --listen test.db-socket test.db", "r")
+    expect(server.gets).to eq("Listening on test.db-socket\n")
+    run = lambda do |socket, text|
+      padded = text + "\0" * ((8 - text.bytesize % 8) % 8)
+      socket.write([padded.bytesize, 1, 0, 0].pack("VCCv") + padded)
+      while true
+        length, type, status = socket.read(8).unpack("VCC")
+        payload = socket.read(length)
+        return [status, payload.delete("\0")] if type == 3
+      end
+    end
+    idle = UNIXSocket.new("test.db-socket")
+    busy = UNIXSocket.new("test.db-socket")
+    results = [run.call(idle, "begin"), run.call(idle, "insert user1 1 person1@example.com"),
+               run.call(busy, "insert user1 1 person1@example.com"),
+               run.call(busy, "insert user2 2 person2@example.com"),
+               run.call(idle, "commit")]
+    idle.close
+    busy.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(results).to eq([[0, ""], [0, ""], [1, "Error: Lock conflict, transaction rolled back."],
+                           [0, ""], [0, ""]])
+  end
+
+  it 'makes an older transaction wait for the row lock of a younger one' do
+    require 'socket'
+    server = IO.popen("./db --listen test.db-socket test.db", "r")
+    expect(server.gets).to eq("Listening on test.db-socket\n")
+    send = lambda do |socket, text|
+      padded = text + "\0" * ((8 - text.bytesize % 8) % 8)
+      socket.write([padded.bytesize, 1, 0, 0].pack("VCCv") + padded)
+    end
+    receive = lambda do |socket|
+      while true
+        length, type, status = socket.read(8).unpack("VCC")
+        payload = socket.read(length)
+        return [status, payload.delete("\0")] if type == 3
+      end
+    end
+    run = lambda { |socket, text| send.call(socket, text); receive.call(socket) }
+    older = UNIXSocket.new("test.db-socket")
+    younger = UNIXSocket.new("test.db-socket")
+    results = [run.call(older, "begin"), run.call(younger, "begin"),
+               run.call(younger, "insert user2 1 person2@example.com")]
+    send.call(older, "insert user1 1 person1@example.com")
+    # The older transaction's insert is parked, not rolled back
+    waited = IO.select([older], nil, nil, 0.3).nil?
+    results << run.call(younger, "rollback")
+    results += [receive.call(older), run.call(older, "commit")]
+    older.close
+    younger.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(waited).to eq(true)
+    expect(results).to eq([[0, ""], [0, ""], [0, ""], [0, ""], [0, ""], [0, ""]])
+    result = run_script(["select", ".exit"])
+    expect(result).to include("db > (1, user1, person1@example.com)")
+  end
+
+  it 'runs selects side by side while another client inserts' do
+    require 'socket'
+    server = IO.popen("./db --shadow --cache-pages 8 --listen test.db-socket test.db", "r")
+    expect(server.gets).to eq("Listening on test.db-socket\n")
+    run = lambda do |socket, text|
+      padded = text + "\0" * ((8 - text.bytesize % 8) % 8)
+      socket.write([padded.bytesize, 1, 0, 0].pack("VCCv") + padded)
+      rows = 0
+      while true
+        length, type, status = socket.read(8).unpack("VCC")
+        payload = socket.read(length)
+        return [status, rows] if type == 3
+        rows += payload.unpack1("V")
+      end
+    end
+    writer = UNIXSocket.new("test.db-socket")
+    (1..100).each { |i| run.call(writer, "insert user#{i} #{i} person#{i}@example.com") }
+    readers = (1..3).map do
+      Thread.new do
+        socket = UNIXSocket.new("test.db-socket")
+        counts = (1..20).map { run.call(socket, "select") }
+        socket.close
+        counts
+      end
+    end
+    (101..200).each { |i| run.call(writer, "insert user#{i} #{i} person#{i}@example.com") }
+    counts = readers.flat_map(&:value)
+    final = run.call(writer, "select")
+    writer.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    expect(counts.map(&:first).uniq).to eq([0])
+    expect(counts.map(&:last) - (100..200).to_a).to eq([])
+    expect(final).to eq([0, 200])
+  end
 end